@@ -7,6 +7,8 @@
     Distributed under the MIT license.
 */
 
+#define _GNU_SOURCE     /* accept4() and other linux extensions */
+
 #include <stdio.h>
 #include <stdlib.h>     /* core functions */
 #include <unistd.h>     /* POSIX API (fork/exec, etc) */
@@ -15,27 +17,860 @@
 #include <stdbool.h>    /* C99 boolean types */
 #include <errno.h>      /* provides global variable errno */
 #include <string.h>     /* basic string functions */
+#include <getopt.h>     /* getopt_long() */
+#include <dirent.h>     /* directory listing, for poking around in /sys */
 #include <sys/stat.h>   /* inode manipulation (needed for umask()) */
 #include <sys/wait.h>   /* for waitpid() and friends on linux */
+#include <stdint.h>     /* fixed width integer types */
+#include <time.h>       /* clock_gettime() */
+#include <sys/uio.h>    /* struct iovec, for sendmsg() */
+#include <sys/mman.h>   /* mmap(), shm_open() */
+#include <sys/resource.h> /* getrusage() */
+#include <limits.h>     /* INT_MAX and friends */
+#include <netdb.h>      /* getaddrinfo() */
+#include <sys/socket.h> /* BSD sockets */
+#include <sys/un.h>     /* unix domain sockets */
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdarg.h>     /* variadic functions, for log_msg() */
+#include <pthread.h>    /* the logger thread */
+#include <sys/utsname.h> /* uname(), for `forking-daemon bench' */
+#include <stddef.h>     /* offsetof() */
+
+/* static tracepoints, if systemtap's <sys/sdt.h> is there (see TRACE()) */
+#if defined(__has_include) && !defined(NO_USDT)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define HAVE_USDT
+#endif
+#endif
+
+/* coroutines switch stacks by hand on x86-64 (see coro_switch()), or else (or
+ * with -DNO_CORO_ASM) with swapcontext() */
+#if defined(__x86_64__) && defined(__ELF__) && !defined(NO_CORO_ASM)
+#define CORO_ASM
+#else
+#include <ucontext.h>
+#endif
+
+#ifdef __linux__
+#include <sys/epoll.h>      /* epoll(7) event notification */
+#include <sys/signalfd.h>   /* signalfd(2): read signals as file descriptors */
+#include <sys/syscall.h>    /* syscall numbers, for pidfd_open(2) */
+#include <sys/eventfd.h>    /* eventfd(2): a counter to wake up a process */
+#include <linux/futex.h>    /* futex(2): sleep until a word of memory changes */
+#include <sched.h>          /* sched_setaffinity(2) */
+#include <linux/mempolicy.h>/* NUMA memory policies, for set_mempolicy(2) */
+#include <linux/sched.h>    /* clone(2) flags */
+#include <linux/io_uring.h> /* io_uring(7), for --io-uring */
+#else
+#include <sys/event.h>      /* kqueue(2) on the BSDs and OS X */
+#include <sys/time.h>
+#endif
 
 
 /*
  * TYPEDEFS (custom types)
  */
 
+/* limits to what --exec, --env and --rlimit may say */
+#define EXEC_MAX_ARGS       64          /* words in the command line */
+#define EXEC_MAX_ENV        16          /* --env variables */
+#define EXEC_MAX_RLIMITS    16          /* --rlimit limits */
+
+/* worker groups (--group) */
+#define MAX_GROUPS          16
+
+/* --peer addresses to start gossiping with (--cluster) */
+#define CLUSTER_SEEDS       16
+
+typedef struct {
+    char                name[32];       /* of its cgroup, too */
+    int                 count;          /* slots in the group */
+    int                 nice;           /* nice level, or 0 */
+    int                 policy;         /* SCHED_*, or -1 to leave it be */
+    int                 priority;       /* for SCHED_FIFO and SCHED_RR */
+    int                 cpu_weight;     /* cgroup cpu.weight, or 0 */
+    int                 io_weight;      /* cgroup io.weight, or 0 */
+    int                 memory_low;     /* cgroup memory.low, in MB, or 0 */
+    int                 memory_high;    /* cgroup memory.high, in MB, or 0 */
+    char                cpus[0xff];     /* CPUs of the group, or "" */
+} group_t;
+
+/* where an --exec worker finds what it inherits */
+#define EXEC_LISTEN_FD      3
+#define EXEC_STATS_FD       4
+#define EXEC_LOG_FD         5
+
 /* options storage */
 typedef struct {
     int                 jobs;           /* number of children to fork */
     bool                daemonize;      /* fork to background? */
     char                logfile[0xff];  /* File to log to when daemonized */
+    char                config[PATH_MAX]; /* config file (absolute), or "" */
+    char                listen[0xff];   /* [HOST:]PORT or PATH to serve on */
+    bool                reuseport;      /* one SO_REUSEPORT socket per child? */
+    int                 affinity;       /* AFFINITY_NONE, AFFINITY_RR, ... */
+    char                cpulist[0xff];  /* CPUs to use, for AFFINITY_LIST */
+    int                 numa;           /* NUMA_NONE, NUMA_BIND, ... */
+    bool                zygote;         /* spawn children from a zygote? */
+    int                 backoff_base;   /* first restart delay, in ms */
+    int                 backoff_max;    /* longest restart delay, in ms */
+    int                 min_uptime;     /* dying sooner is a failure, in ms */
+    int                 crash_limit;    /* failures in a row before parking */
+    int                 park_time;      /* how long a slot stays parked, in ms */
+    int                 restart_budget; /* restarts allowed per window, or 0 */
+    int                 restart_window; /* length of that window, in ms */
+    char                stats[0xff];    /* name of the stats segment */
+    int                 hang_timeout;   /* kill children silent this long (ms) */
+    int                 drain_timeout;  /* time allowed to exit gracefully (ms) */
+    int                 dispatch;       /* entries per dispatch ring, or 0 */
+    bool                steal;          /* idle dispatch children help out? */
+    int                 min_jobs;       /* smallest pool, when autoscaling */
+    int                 max_jobs;       /* largest pool, or 0 for a fixed pool */
+    int                 warmup;         /* MB of lookup table to build */
+    bool                hugepages;      /* put read-only data on huge pages? */
+    int                 max_requests;   /* recycle children after this many */
+    int                 max_rss;        /* ... or at this size, in MB */
+    int                 max_age;        /* ... or at this age, in ms */
+    int                 max_rotating;   /* children recycled at a time */
+    int                 spawn_parallel; /* children starting up at once, or 0 for any */
+    int                 spawn_stagger;  /* least time between two spawns (ms) */
+    int                 ready_percent;  /* of the children up, for the pool to be */
+    bool                io_uring;       /* serve with io_uring, not epoll? */
+    bool                herd;           /* wake every child on a shared socket? */
+    bool                balance;        /* master accepts, and hands connections out? */
+    int                 phase_sample;   /* time one in so many phases, or 0 */
+    int                 threads;        /* threads serving in each child */
+    int                 coroutines;     /* coroutines per thread, or 0 for none */
+    char                cluster[0xff];  /* [HOST:]PORT to gossip with peers on */
+    char                peers[CLUSTER_SEEDS][0xff]; /* HOST:PORT of peers to start from */
+    int                 npeers;
+    char                coordinator[0xff]; /* HOST:PORT to report to, or "" */
+    char                metrics[0xff];  /* [HOST:]PORT or PATH to serve /metrics on */
+    char                exec[0x400];    /* program to run as a worker, or "" */
+    char                env[EXEC_MAX_ENV][0xff]; /* NAME=VALUE for its environment */
+    int                 nenv;
+    struct {
+        int             resource;       /* RLIMIT_NOFILE, ... */
+        rlim_t          value;
+    }                   rlimits[EXEC_MAX_RLIMITS]; /* limits for it */
+    int                 nrlimits;
+    group_t             groups[MAX_GROUPS]; /* worker groups, in slot order */
+    int                 ngroups;
 } options_t;
 
+/* how children are pinned to CPUs */
+enum {
+    AFFINITY_NONE = 0,                  /* let the scheduler decide */
+    AFFINITY_RR,                        /* round robin over all usable CPUs */
+    AFFINITY_CORES,                     /* one per physical core (no SMT twins) */
+    AFFINITY_LIST                       /* round robin over options.cpulist */
+};
+
+/* where children allocate memory */
+enum {
+    NUMA_NONE = 0,                      /* wherever the kernel likes */
+    NUMA_BIND,                          /* only on the node of its CPU */
+    NUMA_PREFERRED                      /* the node of its CPU, if possible */
+};
+
+/* codes for long options without a short equivalent */
+enum {
+    OPT_CPU_AFFINITY = 0x100,
+    OPT_NUMA,
+    OPT_BACKOFF_BASE,
+    OPT_BACKOFF_MAX,
+    OPT_MIN_UPTIME,
+    OPT_CRASH_LIMIT,
+    OPT_PARK_TIME,
+    OPT_RESTART_BUDGET,
+    OPT_RESTART_WINDOW,
+    OPT_STATS,
+    OPT_HANG_TIMEOUT,
+    OPT_DRAIN_TIMEOUT,
+    OPT_DISPATCH,
+    OPT_STEAL,
+    OPT_MIN_JOBS,
+    OPT_MAX_JOBS,
+    OPT_WARMUP,
+    OPT_HUGEPAGES,
+    OPT_MAX_REQUESTS,
+    OPT_MAX_RSS,
+    OPT_MAX_AGE,
+    OPT_MAX_ROTATING,
+    OPT_IO_URING,
+    OPT_EXEC,
+    OPT_ENV,
+    OPT_RLIMIT,
+    OPT_GROUP,
+    OPT_HERD,
+    OPT_PHASE_SAMPLE,
+    OPT_METRICS,
+    OPT_THREADS,
+    OPT_COROUTINES,
+    OPT_CLUSTER,
+    OPT_PEER,
+    OPT_COORDINATOR,
+    OPT_SPAWN_PARALLEL,
+    OPT_SPAWN_STAGGER,
+    OPT_READY_PERCENT,
+    OPT_BALANCE
+};
+
 /* simple storage for registering signal handlers */
 typedef struct {
     int                 signal;         /* What SIGNAL to trap */
-    struct sigaction    action;         /* handler, passed to sigaction() */
+    void                (*handler)();   /* called from master's event loop */
 } sigpair_t;
 
+/* lifecycle of a slot in the child table */
+enum {
+    SLOT_EMPTY = 0,                     /* no process */
+    SLOT_STARTING,                      /* asked the zygote for a child */
+    SLOT_RUNNING,                       /* alive, and restarted when it dies */
+    SLOT_RETIRING,                      /* draining; will not be replaced */
+    SLOT_BACKOFF,                       /* dead, and waiting to be restarted */
+    SLOT_PARKED,                        /* failed too often; left alone a while */
+    SLOT_DRAINING                       /* draining; replaced once it exits */
+};
+
+/* The child table.
+ *
+ * This is a `struct of arrays' rather than an array of structs: the loops that
+ * touch every child (like terminate_children()) only walk the one or two
+ * arrays they need, which packs many more children into each cache line.
+ *
+ * Finding the slot of a dead child by pid goes through a small open
+ * addressing hash table instead of a linear scan.
+ */
+typedef struct {
+    int                 size;           /* number of slots allocated */
+    int                 live;           /* number of slots with a process */
+    int                 warming;        /* number of them not ready yet */
+    pid_t *             pid;            /* process id, or 0 for none */
+    uint8_t *           state;          /* SLOT_EMPTY, SLOT_RUNNING, ... */
+    uint32_t *          restarts;       /* times this slot has been respawned */
+    int *               status;         /* last exit status, from waitpid() */
+    int *               pidfd;          /* pidfd_open(2) handle, or -1 */
+    int *               lfd;            /* the child's own socket (SO_REUSEPORT, or its
+                                           end of the --balance channel), or -1 */
+    int *               chan;           /* our end of that channel, or -1 */
+    uint64_t *          handed;         /* connections handed to the child through it */
+    uint32_t *          balked;         /* balance round it could take no more (0: none) */
+    uint64_t *          started;        /* when the child was spawned, in ms */
+    uint16_t *          failures;       /* fast failures in a row */
+    uint64_t *          busy;           /* child's busy_ns when last sampled */
+    int *               cover;          /* slot this one stands in for, or -1 */
+    bool *              stale;          /* child has an old configuration */
+    bool *              warm;           /* child spawned, and not ready yet */
+    uint64_t *          spawn_ticks;    /* when a sampled spawn began, or 0 */
+
+    int                 hsize;          /* hash buckets; a power of two */
+    pid_t *             hpid;           /* pid in each bucket, or 0 for none */
+    int *               hslot;          /* slot of the pid in each bucket */
+} slots_t;
+
+/* Timers, kept in a hashed timer wheel.
+ *
+ * A timer is identified by its kind and an id (a slot, or -1 for timers that
+ * belong to the master as a whole). Each bucket of the wheel holds the timers
+ * that expire during one tick, give or take a multiple of WHEEL_SLOTS ticks,
+ * in a doubly linked list; arming, cancelling and expiring a timer are all
+ * O(1), no matter how many there are.
+ */
+#define WHEEL_SLOTS 512                 /* buckets, a power of two */
+#define WHEEL_TICK  10                  /* ms per bucket */
+
+enum {
+    TIMER_RESTART = 0,                  /* restart a slot after backoff */
+    TIMER_HEARTBEAT,                    /* check that a child is still alive */
+    TIMER_DRAIN,                        /* kill a child that is slow to exit */
+    TIMER_SCALE,                        /* (id -1) see if the pool is the right size */
+    TIMER_RECYCLE,                      /* (id -1) look for children to recycle */
+    TIMER_METRICS,                      /* (id -1) drop scrapers that take too long */
+    TIMER_CLUSTER,                      /* (id -1) gossip with peers */
+    TIMER_SPAWN,                        /* (id -1) spawn more, with --spawn-stagger */
+    TIMER_READY,                        /* (id -1) look for children that are ready */
+    TIMER_KINDS
+};
+
+typedef struct {
+    int                 size;           /* number of timers allocated */
+    uint64_t *          when;           /* expiry in ms, or 0 if not armed */
+    int *               next;           /* next timer in bucket, or -1 */
+    int *               prev;           /* previous timer in bucket, or -1 */
+    uint32_t *          gen;            /* bumped each time a timer changes */
+    int                 head[WHEEL_SLOTS]; /* first timer in each bucket */
+    uint64_t            tick;           /* last tick processed */
+    int                 armed;          /* number of armed timers */
+    int *               due;            /* scratch space for timer_run() */
+    uint32_t *          due_gen;
+} wheel_t;
+
+/* The stats segment.
+ *
+ * A named POSIX shared memory object holding a record for each slot, which the
+ * master and children update in place and anybody can read with
+ * `forking-daemon stats'. Children bump their counters with plain (relaxed)
+ * atomic stores: there is a single writer per field, so no locked
+ * instructions or system calls are needed.
+ *
+ * Each record starts on its own cache line(s), so children updating their
+ * records never contend for the same line. Readers must use the stride in the
+ * header, since records grow new fields over time.
+ */
+#define STATS_MAGIC     0x66647374      /* "fdst" */
+
+/* Phases of the master's and children's work, timed in samples with
+ * --phase-sample. Times are in ticks of the CPU's cycle counter (see ticks()). */
+enum {
+    PHASE_SPAWN = 0,                    /* master: child() asked, to child_started() */
+    PHASE_RESPAWN,                      /* master: reaping a child, and replacing it */
+    MASTER_PHASES
+};
+enum {
+    PHASE_WAIT = 0,                     /* child: waiting for work */
+    PHASE_WORK,                         /* child: working on a batch of it */
+    CHILD_PHASES
+};
+#define STATS_VERSION   1
+#define CACHE_LINE      64
+
+/* Bytes from one record to the next. With --threads, each of a child's
+ * threads has a record of its own, right after the child's: the child sums
+ * them up into its own record (see stats_fold()), which is the one the master
+ * and most readers look at. */
+#define STATS_STRIDE    (sizeof(stats_slot_t) * (options.threads > 1 ? 1 + options.threads : 1))
+
+typedef struct {
+    uint32_t            magic;          /* STATS_MAGIC */
+    uint32_t            version;        /* STATS_VERSION */
+    uint32_t            slots;          /* number of records */
+    uint32_t            stride;         /* bytes from one record to the next */
+    uint32_t            jobs;           /* size of the pool */
+    pid_t               master;         /* pid of the master */
+    uint64_t            started;        /* when the master started, in ns */
+    uint64_t            phase_ticks[MASTER_PHASES];   /* sampled time spent, */
+    uint64_t            phase_samples[MASTER_PHASES]; /* over so many samples */
+} __attribute__((aligned(CACHE_LINE))) stats_header_t;
+
+typedef struct {
+    /* written by the master */
+    pid_t               pid;            /* current child, or 0 */
+    uint32_t            state;          /* SLOT_EMPTY, SLOT_RUNNING, ... */
+    uint32_t            restarts;       /* times this slot has been respawned */
+    int32_t             status;         /* last exit status */
+
+    /* written by the child */
+    uint64_t            heartbeat;      /* last sign of life, in ns (monotonic) */
+    uint64_t            requests;       /* units of work done */
+    uint64_t            cpu_ns;         /* CPU time used */
+    uint64_t            rss_kb;         /* resident set size */
+    uint64_t            steals;         /* jobs taken from siblings */
+    uint64_t            steal_misses;   /* steals lost to another taker */
+    uint64_t            busy_ns;        /* time spent working, not waiting */
+    uint64_t            shared_kb;      /* resident, and shared with others */
+    uint64_t            private_kb;     /* resident, and ours alone */
+    uint64_t            allocs;         /* allocations from our own arenas */
+    uint64_t            scratch_peak;   /* most scratch used by a unit of work */
+    uint64_t            heap_peak;      /* most heap in use at once */
+
+    /* when things happened to the slot, in ns (monotonic), for timing them
+     * with `forking-daemon bench' */
+    uint64_t            spawned;        /* master: child() was asked for this child */
+    uint64_t            reaped;         /* master: the last child was reaped */
+    uint64_t            ready;          /* child: set up, and ready for work */
+
+    /* written by the child, with --phase-sample */
+    uint64_t            phase_ticks[CHILD_PHASES];
+    uint64_t            phase_samples[CHILD_PHASES];
+
+    /* written by the master, for /metrics */
+    uint32_t            failures;       /* children that died young, in a row */
+    uint32_t            backoff_ms;     /* wait before the next restart */
+
+    /* written by the child (by every one of its threads, with --threads) */
+    uint64_t            accepted;       /* connections taken on */
+    uint64_t            conns;          /* of them still open */
+} __attribute__((aligned(CACHE_LINE))) stats_slot_t;
+
+/* our mapping of the stats segment */
+typedef struct {
+    int                 fd;             /* shm_open() descriptor, or -1 */
+    size_t              size;           /* bytes mapped */
+    stats_header_t *    header;         /* start of the mapping */
+} stats_t;
+
+/* Dispatch: the master hands out jobs to children through shared memory.
+ *
+ * Every slot has a pair of single-producer, single-consumer rings in a shared
+ * segment: jobs, which the master fills and its child empties, and done, which
+ * goes the other way. Each side owns one index of a ring, and only reads the
+ * other, so pushing and popping are plain loads and stores: no locks, and no
+ * system calls. Entries are published in batches, by moving the index once
+ * for any number of them.
+ *
+ * Payloads live in the same segment, a block per job, and are read in place.
+ * Only the small descriptors go through the rings, and nothing is copied
+ * through the kernel.
+ *
+ * A side with nothing to do goes to sleep after raising its waiting flag, and
+ * the other side rings a doorbell only if it sees the flag up. While both are
+ * busy, there are no wakeups to pay for. A child sleeps on a futex, on the
+ * tail of its jobs ring; the master has an event loop to run, and sleeps on a
+ * single eventfd that all children share.
+ *
+ * With --steal, a child moves its jobs from the ring onto a deque of its own,
+ * and works on them from the bottom end; siblings with nothing to do steal
+ * from the top. This is the Chase-Lev deque (Chase & Lev, "Dynamic Circular
+ * Work-Stealing Deque", 2005, with the C11 fences of Le et al., 2013), which
+ * works across processes as it does across threads, since it is only loads,
+ * stores and compare-and-swaps on shared memory. A stolen job's payload stays
+ * where it is, and the thief reports it done on its own done ring.
+ */
+#define DISPATCH_BLOCK  64              /* bytes of payload per job */
+#define DISPATCH_BATCH  64              /* most jobs to do between reports */
+
+typedef struct {
+    /* each on a cache line of its own, so the two sides don't fight over them */
+    __attribute__((aligned(CACHE_LINE))) uint32_t head;    /* next entry to take */
+    __attribute__((aligned(CACHE_LINE))) uint32_t tail;    /* next entry to fill */
+    __attribute__((aligned(CACHE_LINE))) uint32_t waiting; /* consumer asleep? */
+} ring_t;
+
+typedef struct {
+    /* these only ever grow, so a stale index can never match a current one */
+    __attribute__((aligned(CACHE_LINE))) int64_t top;      /* thieves' end */
+    __attribute__((aligned(CACHE_LINE))) int64_t bottom;   /* the owner's end */
+} deque_t;
+
+typedef struct {
+    uint64_t            seq;            /* job number */
+    uint64_t            queued;         /* when it was handed out, in ns */
+    uint32_t            block;          /* payload block */
+    uint16_t            len;            /* bytes of payload */
+    uint16_t            rounds;         /* times to go over it */
+} job_t;
+
+typedef struct {
+    uint64_t            seq;            /* job number */
+    uint32_t            block;          /* payload block, now free */
+    uint32_t            result;         /* what became of the job */
+} done_t;
+
+typedef struct {
+    uint32_t            slots;          /* number of slot records */
+    uint32_t            stride;         /* bytes from one record to the next */
+    uint32_t            depth;          /* entries per ring, a power of two */
+    __attribute__((aligned(CACHE_LINE))) uint32_t master_waiting;
+} __attribute__((aligned(CACHE_LINE))) dispatch_header_t;
+
+/* A slot's record: its rings and deque, then depth jobs, depth done, depth
+ * deque entries, and depth blocks of payload */
+typedef struct {
+    ring_t              jobs;
+    ring_t              done;
+    deque_t             deque;
+} dispatch_slot_t;
+
+/* our mapping of the dispatch segment, and the master's bookkeeping */
+typedef struct {
+    int                 fd;             /* the shared segment, or -1 */
+    int                 bell[2];        /* the master's doorbell (read, write) */
+    size_t              size;           /* bytes mapped */
+    dispatch_header_t * header;         /* start of the mapping */
+    uint32_t *          free;           /* free payload blocks, depth per slot */
+    uint32_t *          nfree;          /* number of those, per slot */
+    uint64_t *          since;          /* seq of each slot's last reset */
+    uint64_t            seq;            /* jobs handed out */
+    uint64_t            completed;      /* jobs done */
+} dispatch_t;
+
+/* Logging.
+ *
+ * Every process writes fixed-size binary records to a ring of its own in a
+ * shared segment, and a thread of the master turns them into lines of text
+ * and writes them out. A ring has a single writer (its process) and a single
+ * reader (the logger thread), so, as for dispatch, it is plain loads and
+ * stores: a worker never takes a lock, makes a system call or waits on the
+ * disk to log something.
+ *
+ * Ring 0 belongs to the zygote, ring 1 to the master, and ring id + 2 to
+ * whichever child is in slot id.
+ */
+#define LOG_RINGS       1024            /* most rings; bigger pools use stdio */
+#define LOG_DEPTH       256             /* records per ring */
+#define LOG_TEXT        236             /* bytes of text, so a record is 256 */
+#define LOG_BATCH       256             /* most lines per writev() */
+#define LOG_FLUSH       20              /* ms between looks at the rings */
+
+enum {
+    LOG_INFO = 0,
+    LOG_WARN,
+    LOG_ERROR
+};
+
+/* who is logging, besides the slots */
+enum {
+    LOG_ZYGOTE = -2,
+    LOG_MASTER = -1
+};
+
+typedef struct {
+    uint64_t            time;           /* CLOCK_REALTIME, in ns */
+    pid_t               pid;
+    int32_t             id;             /* slot, LOG_MASTER or LOG_ZYGOTE */
+    uint16_t            level;          /* LOG_INFO, LOG_WARN, ... */
+    uint16_t            len;            /* bytes of text */
+    char                text[LOG_TEXT]; /* not NUL terminated */
+} log_record_t;
+
+typedef struct {
+    ring_t              ring;           /* head is the reader's, tail the writer's */
+    __attribute__((aligned(CACHE_LINE))) uint64_t dropped; /* records lost to a full ring */
+    pid_t               owner;          /* the process writing to it */
+    log_record_t        records[LOG_DEPTH];
+} log_ring_t;
+
+/* our mapping of the log segment */
+typedef struct {
+    int                 fd;             /* memfd(2) behind the mapping, or -1 */
+    log_ring_t *        rings;          /* LOG_RINGS of them, or NULL */
+    size_t              size;           /* bytes mapped */
+    uint32_t            used;           /* rings the logger looks at */
+    bool                stop;           /* logger thread: finish up and exit */
+    pthread_t           thread;
+} logs_t;
+
+/* A bump allocator over a region of memory: allocation is a matter of moving
+ * used along, and everything is freed at once, if at all */
+typedef struct {
+    uint8_t *           base;           /* start of the region */
+    size_t              size;           /* bytes in it */
+    size_t              used;           /* bytes handed out */
+} arena_t;
+
+/* Memory for a child's own use.
+ *
+ * malloc() is a fine general purpose allocator, but a poor fit for a forked
+ * child: its bookkeeping is spread over pages the child shares with the
+ * master, and the first malloc() or free() to touch one of them copies it.
+ * Instead, each child has two arenas of its own, mapped once it has moved to
+ * its CPU, so that their pages come from its local NUMA node:
+ *
+ *   - scratch, for whatever is needed during one unit of work (for a server,
+ *     a request). Allocating is a bump; scratch_reset() frees it all at once,
+ *     when the work is done.
+ *   - heap, carved into blocks of a few sizes (16 bytes to 4 kB, in powers of
+ *     two) with a free list each, for things that outlive a request, such as
+ *     connections. Anything bigger is left to malloc().
+ *
+ * With --threads, each thread of a child has arenas of its own, so they still
+ * need no locks.
+ *
+ * Each block of the heap starts with this header, which stays put while it
+ * is free; the free list runs through the blocks themselves.
+ */
+#define SCRATCH_SIZE    (1 << 20)
+#define HEAP_SIZE       (64 << 20)      /* of address space; pages are used as touched */
+#define MEM_CLASSES     9               /* 16 << 0 to 16 << 8 bytes */
+
+typedef struct {
+    uint32_t            class;          /* size class, or MEM_CLASSES for malloc() */
+    uint32_t            size;           /* bytes in the block */
+} __attribute__((aligned(16))) mem_header_t;
+
+/* With --threads: one of the threads of a server child, each running serve()
+ * with an I/O engine of its own (see serve_threaded()) */
+#define THREADS_MAX     64
+#define THREAD_STACK    (256 << 10)     /* serve() needs little of one */
+
+typedef struct {
+    int                 id;             /* our slot */
+    int                 fd;             /* listening socket */
+    int                 thread;         /* which thread, from 0 (the main one) */
+    pthread_t           tid;
+} serve_thread_t;
+
+/* The I/O engine of a server child; see io_init().
+ *
+ * Completions of io_uring requests carry a tag made of the operation, the
+ * connection (its index in the table of registered files), its generation,
+ * which changes when it is closed, and the buffer it was sent from.
+ */
+#define IO_ENTRIES      256             /* submission queue entries */
+#define IO_FILES        4096            /* most connections, with io_uring */
+#define IO_BUFS         512             /* receive buffers, a power of two */
+#define IO_BUF_SIZE     4096            /* bytes in each */
+#define IO_ACCEPT_PAUSE 100             /* ms to wait after accept fails */
+
+#define IO_TAG(op, gen, bid, id) ((uint64_t)(op) << 56 | (uint64_t)(uint16_t)(gen) << 40 | \
+                                  (uint64_t)(uint16_t)(bid) << 24 | ((uint32_t)(id) & 0xffffff))
+#define IO_TAG_OP(tag)  ((int)((tag) >> 56))
+#define IO_TAG_GEN(tag) ((uint16_t)((tag) >> 40))
+#define IO_TAG_BID(tag) ((uint16_t)((tag) >> 24))
+#define IO_TAG_ID(tag)  ((int)((tag) & 0xffffff))
+
+enum {
+    IO_OP_ACCEPT = 1,
+    IO_OP_RECV,
+    IO_OP_SEND,
+    IO_OP_CANCEL,
+    IO_OP_CLOSE
+};
+
+typedef struct {
+    bool                uring;          /* io_uring in use, rather than epoll? */
+    int                 lfd;            /* listening socket, or -1 */
+    int                 sending;        /* sends in flight */
+#ifdef IORING_SETUP_DEFER_TASKRUN
+    int                 ring;           /* the io_uring, or -1 */
+    uint32_t *          sq_head;        /* submission queue: the kernel's end */
+    uint32_t *          sq_tail;        /* ... and ours */
+    uint32_t            sq_local;       /* our next entry, maybe not yet published */
+    uint32_t            sq_mask;
+    uint32_t            sq_entries;
+    struct io_uring_sqe *sqes;
+    uint32_t *          cq_head;        /* completion queue: our end */
+    uint32_t *          cq_tail;        /* ... and the kernel's */
+    uint32_t            cq_mask;
+    struct io_uring_cqe *cqes;
+    struct io_uring_buf_ring *br;       /* ring of provided buffers */
+    uint8_t *           bufs;           /* the buffers themselves */
+    uint16_t *          gen;            /* generation of each connection */
+    int *               starved;        /* connections waiting for a buffer */
+    int                 nstarved;
+    uint64_t            accept_at;      /* accept failed: when to retry, or 0 */
+#endif
+} io_t;
+
+/* kinds of completions reported by io_wait() */
+enum {
+    IO_ACCEPT = 1,                      /* a new connection */
+    IO_RECV,                            /* data, or EOF (len 0) or -errno */
+    IO_ERROR                            /* a send failed, with -errno */
+};
+
+typedef struct {
+    int                 type;           /* IO_ACCEPT, IO_RECV, ... */
+    int                 id;             /* the connection */
+    char *              buf;            /* data received */
+    int                 len;            /* bytes of it, or a result */
+    int                 bid;            /* provided buffer holding it, or -1 */
+} io_event_t;
+
+/* Coroutines, for a server child with --coroutines.
+ *
+ * Each connection is served by a coroutine of its own, as plain sequential
+ * code that waits for its next request with conn_recv(). Waiting switches
+ * back to serve()'s loop, which switches the coroutine in again once the I/O
+ * engine has something for it. A switch only saves and restores what a
+ * function call has to preserve: on x86-64, by hand, six registers and the
+ * stack pointer, with no system call; elsewhere with swapcontext(), which
+ * also switches the signal mask, with one.
+ *
+ * Stacks come from a pool of options.coroutines, reserved all at once, each of
+ * CORO_STACK bytes above a guard page, so that overflowing one faults rather
+ * than scribbling over its neighbour. A stack's pages are only used as they
+ * are touched, and it goes back to the pool when its coroutine is done. Its
+ * pages stay with it, as deep as it ever went: handing them back would cost a
+ * system call per coroutine, and a page fault or more for the next one to use
+ * the stack. So memory is bounded by the most that have run at once, each at
+ * its deepest.
+ * (Each guard page costs a mapping, though: more than 30000 or so stacks need
+ * a larger vm.max_map_count.) The coroutine's own record sits at the top of
+ * its stack.
+ */
+#define CORO_STACK      (16 << 10)
+#define CORO_MAX        (1 << 20)       /* most per thread */
+
+typedef struct coro {
+#ifdef CORO_ASM
+    void *              sp;             /* its stack pointer, while switched out */
+#else
+    ucontext_t          uc;
+#endif
+    void                (*fn)(void *);  /* what it runs */
+    void *              arg;
+    bool                done;           /* has fn returned? */
+    struct coro *       next;           /* in the pool, while free */
+} coro_t;
+
+typedef struct {
+    uint8_t *           base;           /* the stacks */
+    size_t              size;           /* bytes of each, with its guard page */
+    size_t              guard;          /* bytes of a guard page */
+    int                 used;           /* stacks handed out at some point */
+    int                 max;            /* stacks there are room for */
+    coro_t *            free;           /* stacks handed back */
+    coro_t *            current;        /* the coroutine running, or NULL */
+#ifdef CORO_ASM
+    void *              sp;             /* serve()'s stack pointer, meanwhile */
+#else
+    ucontext_t          uc;
+#endif
+} coro_pool_t;
+
+/* a connection of a server child */
+typedef struct {
+    int                 fd;
+    uint64_t            requests;       /* requests served on it */
+    coro_t *            co;             /* serving it, with --coroutines */
+    io_event_t *        ev;             /* for it to handle, or NULL */
+} conn_t;
+
+/* kinds of events delivered by the master's event loop */
+enum {
+    EVENT_SIGNAL = 1,                   /* a trapped SIGNAL arrived */
+    EVENT_CHILD,                        /* a child process has exited */
+    EVENT_LISTEN,                       /* a listening socket can accept() */
+    EVENT_CONN,                         /* a connection has data (or EOF) */
+    EVENT_ZYGOTE,                       /* the zygote has news of a spawn */
+    EVENT_UPGRADE,                      /* a new master has exited */
+    EVENT_DISPATCH,                     /* children have finished some jobs */
+    EVENT_METRICS,                      /* a scraper is connecting to /metrics */
+    EVENT_METRICS_CONN,                 /* a scraper can be read from (or written to) */
+    EVENT_CLUSTER,                      /* a peer has news */
+    EVENT_READY                         /* children are ready for work */
+};
+
+/* request to the zygote, to spawn a child in slot id; a per-slot listening
+ * socket travels alongside as ancillary data */
+typedef struct {
+    int                 id;
+    uint64_t            start;          /* when the master asked, for timing */
+} spawn_request_t;
+
+/* the zygote's reply */
+typedef struct {
+    int                 id;
+    pid_t               pid;            /* the new child, or -errno */
+    uint64_t            start;          /* copied from the request */
+} spawn_reply_t;
+
+/* Without pidfds, a child of the zygote can die, and be reaped on SIGCHLD,
+ * before the zygote's reply has told us whose it was. The last few such pids
+ * are kept, with their statuses, for the reply to find. */
+#define UNCLAIMED       64
+
+/* A histogram of latencies (or anything else), after HdrHistogram: a bucket
+ * for every value up to 2^HIST_SUB_BITS, and then 2^(HIST_SUB_BITS - 1) to each
+ * power of two. See hist_record(). */
+#define HIST_SUB_BITS   7
+#define HIST_SUBS       (1 << HIST_SUB_BITS)
+#define HIST_SHIFTS     (64 - HIST_SUB_BITS + 1)
+typedef struct {
+    uint64_t            count;          /* values recorded */
+    uint64_t            max;            /* largest of them */
+    uint64_t            sum;            /* of them all */
+    uint64_t            counts[HIST_SHIFTS][HIST_SUBS];
+} hist_t;
+
+/* the largest request `forking-daemon load' sends */
+#define LOAD_MAX_SIZE   4096
+
+/* the most recent spawn latencies, in nanoseconds */
+#define LATENCY_SAMPLES 4096
+typedef struct {
+    uint64_t            count;          /* total samples ever taken */
+    uint64_t            ns[LATENCY_SAMPLES];
+} latency_t;
+
+/* A scraper of /metrics (see metrics_io()) */
+#define METRICS_CLIENTS 8               /* scrapers served at once */
+#define METRICS_TIMEOUT 5000            /* ms a scraper has to ask and be answered */
+#define METRICS_CHUNK   64              /* lines rendered per turn of the event loop */
+typedef struct {
+    int                 fd;             /* its connection, or -1 */
+    uint64_t            since;          /* when it connected, in ms */
+    char                req[0x400];     /* its request, so far */
+    size_t              reqlen;
+    bool                answering;      /* has asked already */
+    stats_header_t *    snap;           /* copy of the stats segment, or NULL */
+    int                 family, slot;   /* next metric to render */
+    char                out[0x4000];    /* rendered, but not yet written */
+    size_t              len, off;
+} metrics_client_t;
+
+/* Clustering, with --cluster.
+ *
+ * Masters on different hosts tell each other how they are doing, once every
+ * CLUSTER_INTERVAL, in UDP datagrams of a few fixed-size binary records (in
+ * network byte order): their own, and those of up to CLUSTER_RELAY others they
+ * know of, sent to CLUSTER_FANOUT peers picked at random. News gets around the
+ * cluster in a few rounds without anyone having to talk to everyone; with a
+ * hundred nodes, each sends some 1.5 kB a second. A node that has gone quiet
+ * for CLUSTER_DEAD is gone.
+ *
+ * From what it has heard, each master works out the same thing: how many
+ * children the nodes that are draining (for maintenance, on SIGUSR1) take out
+ * of the cluster, and its own share of making up for them, by how much
+ * headroom (--max-jobs over its own pool) each healthy node has. A draining
+ * node only shuts down once the others are running that many more children,
+ * and they keep running them until it is back (or CLUSTER_FORGET has passed).
+ * Draining nodes go one at a time, lowest id first, so that two of them can't
+ * both leave on the same cover.
+ *
+ * Anyone can send a datagram, so this is for a trusted network; but at worst a
+ * peer can talk a master into a pool of --max-jobs.
+ */
+#define CLUSTER_MAGIC       0x6664636c  /* "fdcl" */
+#define CLUSTER_VERSION     1
+#define CLUSTER_INTERVAL    1000        /* ms between rounds of gossip */
+#define CLUSTER_FANOUT      3           /* peers told in each round */
+#define CLUSTER_RELAY       8           /* others' records passed on to each */
+#define CLUSTER_DEAD        5000        /* ms of silence before a node is gone */
+#define CLUSTER_FORGET      3600000     /* ms a drained node is made up for */
+#define CLUSTER_NODES       256         /* most nodes we know of */
+
+enum {
+    CLUSTER_DRAINING = 1                /* leaving, once the others cover for it */
+};
+
+/* a node's record, as it goes over the wire */
+typedef struct {
+    uint64_t            node;           /* hash of its host name and port */
+    uint32_t            incarnation;    /* when its master started, in s */
+    uint32_t            seq;            /* bumped every round */
+    uint16_t            jobs;           /* its pool, */
+    uint16_t            base;           /* ... less what it runs for others */
+    uint16_t            max;            /* most it may run (--max-jobs) */
+    uint16_t            ready;          /* children up and ready */
+    uint16_t            failing;        /* slots in backoff, or parked */
+    uint16_t            busy;           /* how busy the children are, per mille */
+    uint8_t             flags;          /* CLUSTER_DRAINING */
+    uint8_t             pad;
+    uint16_t            port;           /* where it can be reached, */
+    uint8_t             addr[16];       /* ... IPv6 or IPv4-mapped (0: the sender) */
+} __attribute__((packed)) cluster_record_t;
+
+typedef struct {
+    uint32_t            magic;          /* CLUSTER_MAGIC */
+    uint8_t             version;        /* CLUSTER_VERSION */
+    uint8_t             count;          /* records that follow, the sender's first */
+    uint16_t            pad;
+} __attribute__((packed)) cluster_header_t;
+
+typedef struct {
+    struct sockaddr_storage sa;
+    socklen_t           len;            /* or 0 for none */
+} cluster_addr_t;
+
+/* what we know of another node */
+typedef struct {
+    cluster_record_t    rec;            /* its latest record, in host byte order */
+    cluster_addr_t      addr;           /* where to reach it */
+    uint64_t            heard;          /* when that record came, in ms */
+    bool                left;           /* went quiet while draining */
+} cluster_node_t;
+
+/* a single event, as returned by ev_wait() */
+typedef struct {
+    int                 type;           /* EVENT_SIGNAL, EVENT_CHILD, ... */
+    int                 id;             /* signal number, child id, or fd */
+} event_t;
+
 
 /*
  * FILE VARIABLES (effectively global, since this is a one-file program)
@@ -44,23 +879,388 @@ typedef struct {
 char *      process_name;               /* Name of current process; argv[0] */
 options_t   options;                    /* global options */
 int         sigcount = 0;               /* total signals trapped */
-sigpair_t   sigpairs[0xff];             /* array of SIGNALS, with handlers */
-pid_t       children[0xff];             /* array of child process ids */
+sigpair_t   sigpairs[16];               /* array of SIGNALS, with handlers */
+slots_t     slots;                      /* table of child processes */
+__thread int evfd = -1;                 /* event loop: epoll or kqueue instance */
+int         sigfd = -1;                 /* signalfd(2) of trapped SIGNALS */
+bool        use_pidfd = false;          /* kernel supports pidfd_open(2)? */
+bool        running = true;             /* cleared to leave the event loop */
+int         listenfd = -1;              /* listening socket shared by children */
+int *       cpus;                       /* CPUs children are pinned to, in order */
+int         ncpus = 0;                  /* number of entries in cpus[] */
+int         zygote_fd = -1;             /* socket to the zygote process */
+pid_t       zygote_pid = 0;             /* pid of the zygote process */
+pid_t       unclaimed_pid[UNCLAIMED];   /* reaped, but of no slot we know of */
+int         unclaimed_status[UNCLAIMED];/* ... and how they died */
+int         unclaimed = 0;              /* ... how many have been, ever */
+bool        zygote_leaving = false;     /* zygote_stop() is seeing it out */
+latency_t   spawn_latency;              /* fork() (or zygote) round trip times */
+wheel_t     wheel;                      /* timers of the master's event loop */
+uint64_t    budget_start = 0;           /* start of the current restart window */
+int         budget_used = 0;            /* restarts made in the current window */
+stats_t     stats = { -1, 0, NULL };    /* the stats segment */
+stats_slot_t *my_slot = NULL;           /* in a child: its own stats record */
+__thread stats_slot_t *my_stats = NULL; /* ... or its thread's, with --threads */
+char *      exec_path;                  /* program to exec() for an upgrade */
+char **     exec_argv;                  /* arguments to pass it */
+pid_t       upgrade_pid = 0;            /* pid of a new master, while upgrading */
+int         upgrade_pidfd = -1;         /* pidfd of the new master */
+bool        shutting_down = false;      /* draining the whole pool to exit? */
+uint64_t    shutdown_start;             /* when the shutdown began, in ms */
+int         stragglers = 0;             /* children killed at the deadline */
+volatile sig_atomic_t draining = 0;     /* in a child: asked to exit? */
+dispatch_t  dispatch = { .fd = -1, .bell = { -1, -1 } }; /* the dispatch segment */
+int         scale_hot = 0;              /* hot load samples in a row */
+int         scale_cold = 0;             /* cold load samples in a row */
+uint64_t    scale_sampled = 0;          /* when the load was last sampled */
+arena_t     warm;                       /* read-only data, shared by children */
+const uint32_t *crc_table;              /* CRC-32C, a byte at a time */
+const uint64_t *lookup;                 /* --warmup lookup table */
+size_t      lookup_size = 0;            /* entries in it */
+__thread arena_t scratch;               /* in a child: memory for a unit of work */
+__thread arena_t heap;                  /* in a child: memory for mem_alloc() */
+__thread mem_header_t *mem_free_list[MEM_CLASSES]; /* free heap blocks, by size class */
+__thread size_t mem_in_use = 0;         /* heap bytes allocated */
+__thread size_t mem_peak = 0;           /* most of those at once */
+__thread size_t scratch_peak = 0;       /* most scratch used by a unit of work */
+int         rotating = 0;               /* children being recycled */
+logs_t      logs = { .fd = -1 };        /* the log segment */
+log_ring_t *my_log = NULL;              /* our own ring, or NULL for stdio */
+int         my_log_id = LOG_MASTER;     /* who we are, in the log */
+pid_t       my_log_pid = 0;
+__thread io_t io = { .lfd = -1 };       /* in a server child: its I/O engine */
+char *      group_procs[MAX_GROUPS];    /* cgroup.procs of each worker group */
+__thread uint32_t phase_count = 0;      /* phases seen, for --phase-sample */
+int         respawn_sample = -1;        /* restart_child()'s sampling decision, for
+                                           the child() it calls, or -1 */
+hist_t      spawn_hist;                 /* all spawn latencies, in ns */
+int         metrics_fd = -1;            /* listening socket for /metrics */
+metrics_client_t metrics_clients[METRICS_CLIENTS]; /* scrapers being served */
+int         metrics_busy = 0;           /* how many of them */
+bool        threaded = false;           /* in a server child: with --threads? */
+__thread int my_thread = 0;             /* ... which of them we are */
+serve_thread_t *serve_threads = NULL;   /* ... all of them */
+int         serve_up = 0;               /* ... how many of them are ready */
+int         serve_accepting = 0;        /* ... and are still accepting */
+bool        serve_woken = false;        /* has the main thread been told to drain? */
+__thread coro_pool_t coro;              /* in a server child: its coroutines */
+int         cluster_fd = -1;            /* UDP socket to gossip on */
+cluster_record_t cluster_me;            /* our own record, in host byte order */
+cluster_node_t cluster_nodes[CLUSTER_NODES]; /* the other nodes we know of */
+int         cluster_known = 0;          /* how many of them */
+cluster_addr_t cluster_seeds[CLUSTER_SEEDS]; /* --peer addresses */
+cluster_addr_t cluster_coord;           /* --coordinator address */
+int         cluster_round = 0;          /* rounds of gossip so far */
+int         cluster_cover = 0;          /* children we run for draining nodes */
+bool        cluster_draining = false;   /* leaving the cluster? */
+uint64_t    cluster_busy = 0;           /* children's busy_ns, when last sampled */
+uint64_t    cluster_sampled = 0;        /* ... and when, in ns */
+int         ready_bell[2] = { -1, -1 }; /* rung by children once they are ready */
+bool        spawn_held = false;         /* empty slots left for spawn_pending()? */
+uint64_t    spawn_last = 0;             /* when it last spawned one, in ms */
+bool        pool_up = false;            /* has the pool been ready yet? */
+uint64_t    pool_start = 0;             /* when we started to spawn it, in ms */
+bool        balance_watching = false;   /* --balance: accepting on listenfd? */
+uint32_t    balance_round = 1;          /* ... batches handed out (never 0: see balked) */
+int         balance_next = 0;           /* ... where the next search starts */
+pthread_mutex_t log_lock = PTHREAD_MUTEX_INITIALIZER; /* the log ring, when threaded */
+#ifdef __linux__
+cpu_set_t   group_cpus[MAX_GROUPS];     /* CPUs of each worker group */
+#endif
+
+/* Long options, and the short options they stand for */
+struct option long_options[] = {
+    { "jobs",           required_argument,  NULL,   'j' },
+    { "config",         required_argument,  NULL,   'c' },
+    { "logfile",        required_argument,  NULL,   'f' },
+    { "daemonize",      no_argument,        NULL,   'd' },
+    { "listen",         required_argument,  NULL,   'l' },
+    { "reuseport",      no_argument,        NULL,   'r' },
+    { "cpu-affinity",   required_argument,  NULL,   OPT_CPU_AFFINITY },
+    { "numa",           required_argument,  NULL,   OPT_NUMA },
+    { "zygote",         no_argument,        NULL,   'z' },
+    { "backoff-base",   required_argument,  NULL,   OPT_BACKOFF_BASE },
+    { "backoff-max",    required_argument,  NULL,   OPT_BACKOFF_MAX },
+    { "min-uptime",     required_argument,  NULL,   OPT_MIN_UPTIME },
+    { "crash-limit",    required_argument,  NULL,   OPT_CRASH_LIMIT },
+    { "park-time",      required_argument,  NULL,   OPT_PARK_TIME },
+    { "restart-budget", required_argument,  NULL,   OPT_RESTART_BUDGET },
+    { "restart-window", required_argument,  NULL,   OPT_RESTART_WINDOW },
+    { "stats",          required_argument,  NULL,   OPT_STATS },
+    { "hang-timeout",   required_argument,  NULL,   OPT_HANG_TIMEOUT },
+    { "drain-timeout",  required_argument,  NULL,   OPT_DRAIN_TIMEOUT },
+    { "spawn-parallel", required_argument,  NULL,   OPT_SPAWN_PARALLEL },
+    { "spawn-stagger",  required_argument,  NULL,   OPT_SPAWN_STAGGER },
+    { "ready-percent",  required_argument,  NULL,   OPT_READY_PERCENT },
+    { "dispatch",       required_argument,  NULL,   OPT_DISPATCH },
+    { "steal",          no_argument,        NULL,   OPT_STEAL },
+    { "min-jobs",       required_argument,  NULL,   OPT_MIN_JOBS },
+    { "max-jobs",       required_argument,  NULL,   OPT_MAX_JOBS },
+    { "warmup",         required_argument,  NULL,   OPT_WARMUP },
+    { "hugepages",      no_argument,        NULL,   OPT_HUGEPAGES },
+    { "max-requests",   required_argument,  NULL,   OPT_MAX_REQUESTS },
+    { "max-rss",        required_argument,  NULL,   OPT_MAX_RSS },
+    { "max-age",        required_argument,  NULL,   OPT_MAX_AGE },
+    { "max-rotating",   required_argument,  NULL,   OPT_MAX_ROTATING },
+    { "io-uring",       no_argument,        NULL,   OPT_IO_URING },
+    { "herd",           no_argument,        NULL,   OPT_HERD },
+    { "balance",        no_argument,        NULL,   OPT_BALANCE },
+    { "phase-sample",   required_argument,  NULL,   OPT_PHASE_SAMPLE },
+    { "metrics",        required_argument,  NULL,   OPT_METRICS },
+    { "threads",        required_argument,  NULL,   OPT_THREADS },
+    { "coroutines",     required_argument,  NULL,   OPT_COROUTINES },
+    { "cluster",        required_argument,  NULL,   OPT_CLUSTER },
+    { "peer",           required_argument,  NULL,   OPT_PEER },
+    { "coordinator",    required_argument,  NULL,   OPT_COORDINATOR },
+    { "exec",           required_argument,  NULL,   OPT_EXEC },
+    { "env",            required_argument,  NULL,   OPT_ENV },
+    { "rlimit",         required_argument,  NULL,   OPT_RLIMIT },
+    { "group",          required_argument,  NULL,   OPT_GROUP },
+    { "help",           no_argument,        NULL,   'h' },
+    { NULL,             0,                  NULL,   0 }
+};
 
 
 /*
  * FUNCTIONS
  */
 
+/* Update a field of our own stats record. We are the only writer, so a
+ * relaxed load and store will do (no lock prefix, no fence). */
+#define STAT_SET(field, v) \
+    do { if (my_stats) __atomic_store_n(&my_stats->field, (v), __ATOMIC_RELAXED); } while (0)
+#define STAT_ADD(field, n) \
+    STAT_SET(field, __atomic_load_n(&my_stats->field, __ATOMIC_RELAXED) + (n))
+
+/* Update a field of the child's own record, which is not the same as (the
+ * thread's) my_stats with --threads */
+#define SLOT_SET(field, v) \
+    do { if (my_slot) __atomic_store_n(&my_slot->field, (v), __ATOMIC_RELAXED); } while (0)
+
+/* Add to a field of the child's own record that all of its threads write to,
+ * which takes a locked add */
+#define SLOT_ADD(field, n) \
+    do { if (my_slot) __atomic_add_fetch(&my_slot->field, (n), __ATOMIC_RELAXED); } while (0)
+
+/* A static tracepoint (USDT), for bpftrace, perf or SystemTap, e.g.
+ *
+ *   bpftrace -e 'usdt:./forking-daemon:forking_daemon:spawn__done
+ *                { @ns = hist(arg2); }'
+ *
+ * Each one is a single nop until a tracer attaches to it; its arguments are
+ * just left where the tracer will look for them. Without <sys/sdt.h>
+ * (systemtap-sdt-dev), or with -DNO_USDT, they compile to nothing at all.
+ *
+ *   spawn__start(id)                   child() is to spawn a child
+ *   spawn__done(id, pid, ns)           ...which is up, ns later
+ *   reap(id, pid, status)              the master reaped a child
+ *   signal(signo)                      the master is handling a signal
+ *   drain__begin(id, pid)              the master asked a child to drain
+ *   drain__end(id, pid)                ...and has reaped it
+ *   worker__ready(id)                  a child is ready for work
+ *   worker__drain(id)                  a server child stops accepting
+ *   request__start(id, conn, bytes)    a server child has a request
+ *   request__done(id, conn, ok)        ...and has answered it (or not)
+ *   job__start(seq), job__done(seq)    a dispatch child runs a job
+ */
+#ifdef HAVE_USDT
+#define TRACE(name, ...)    STAP_PROBEV(forking_daemon, name, ##__VA_ARGS__)
+#else
+#define TRACE(name, ...)    do { } while (0)
+#endif
+
+/* hard limit to the size of the pool; anything beyond this is surely a typo */
+#define MAX_JOBS 0x10000
+
+/* the longest an idle child goes without a heartbeat, in ms; --hang-timeout
+ * has to allow for two of these, or it kills children that are just idle */
+#define HEARTBEAT_INTERVAL  1000
+
+/* Autoscaling: the load is sampled every SCALE_INTERVAL ms. The pool grows
+ * by a quarter after SCALE_UP_AFTER hot samples in a row, and shrinks by one
+ * child after SCALE_DOWN_AFTER cold ones. The gap between the thresholds
+ * keeps a steady load from flapping between two sizes. */
+#define SCALE_INTERVAL      1000
+#define SCALE_UP_AFTER      2
+#define SCALE_DOWN_AFTER    10
+#define SCALE_HOT_BUSY      0.75        /* busy ratio that needs more hands */
+#define SCALE_COLD_BUSY     0.25        /* busy ratio that can do with fewer */
+#define SCALE_HOT_WAIT      50          /* ms a dispatch job may wait to start */
+#define SCALE_COLD_WAIT     5           /* ms it waits with hands to spare */
+
+/* how often to look for children to recycle, in ms */
+#define RECYCLE_INTERVAL    1000
+
+/* --balance: connections the master accepts at a time, and hands a child in
+ * a single message */
+#define BALANCE_ACCEPT      64
+#define BALANCE_BATCH       16
+
+/* Spawning: how often to look for children that are ready without having
+ * said so (--exec workers), and how long to wait for one before taking it
+ * to be, in ms */
+#define READY_POLL          100
+#define READY_TIMEOUT       10000
+
+/* size of a transparent huge page (on x86-64, and most others) */
+#define HUGE_PAGE (2 << 20)
+
 /* Declare functions now so we can order logically */
 void    optparse(int argc, char *argv[]);
+bool    options_read(options_t *opts, int argc, char *argv[], bool reloading);
+bool    options_load(options_t *opts, const char *path);
+bool    options_check(options_t *opts);
+bool    set_option(options_t *opts, int opt, char *arg);
+void    usage(char *name);
 int     daemonize();
 int     master();
 bool    child(int id);
+bool    exec_child(int id);
+void    worker(int id, int fd) __attribute__((noreturn));
+void    child_started(int id, pid_t pid, uint64_t start);
 void    register_signals();
 int     trap_signals(bool on);
 void    restart_children();
+bool    reaped_early(pid_t pid, int *status);
 void    terminate_children();
+bool    ev_init();
+bool    ev_watch_child(int id);
+bool    ev_watch_pid(pid_t pid, int type, int id, int *pidfd);
+bool    ev_watch_fd(int fd, int type, bool exclusive);
+bool    ev_watch_write(int fd, int type);
+void    ev_unwatch_fd(int fd);
+int     ev_wait(event_t *events, int max, int timeout);
+void    reap_child(int id);
+void    restart_child(int id, pid_t pid, int status);
+bool    slots_resize(int size);
+void    slots_index(pid_t pid, int id);
+void    slots_unindex(pid_t pid);
+int     slots_find(pid_t pid);
+bool    pool_resize(int jobs);
+bool    spawn_pending();
+bool    ready_init();
+void    ready_check();
+void    pool_ready(int up);
+void    notify(const char *fmt, ...);
+bool    balance_open(int id);
+void    balance_close(int id);
+void    balance_watch(bool on);
+void    balance_accept();
+void    balance_hand(int *fds, int n);
+int     balance_recv(int fd, int *fds);
+void    grow_pool();
+void    shrink_pool();
+void    reload();
+void    autoscale();
+void    recycle_children();
+void    start_rotation(int id);
+void    end_rotation(int j);
+int     slots_cover_of(int id);
+int     listen_socket(const char *addr, bool reuseport);
+int     serve(int id, int fd);
+int     serve_threaded(int id, int fd);
+void    serve_wake();
+bool    io_init(int fd);
+int     io_wait(io_event_t *events, int max, int timeout);
+bool    io_send(int id, char *buf, int len, int bid);
+void    io_release(int bid);
+void    io_close(int id);
+void    io_stop_accept();
+static void start_draining(int sig);
+int     parse_cpulist(const char *list, int *cpus, int max);
+bool    placement_init();
+void    place_child(int id);
+int     group_of(int id);
+void    group_cpuset(int g);
+void    group_limits(const char *dir, const group_t *grp, const group_t *old);
+bool    groups_init();
+void    groups_destroy();
+bool    group_enter(int g);
+void *  arena_alloc(arena_t *a, size_t n, size_t align);
+bool    warmup();
+bool    mem_init();
+void *  scratch_alloc(size_t n);
+void    scratch_reset();
+void *  mem_alloc(size_t n);
+void    mem_free(void *p);
+bool    coro_init(int max);
+coro_t *coro_create(void (*fn)(void *), void *arg);
+bool    coro_resume(coro_t *co);
+void    coro_yield();
+io_event_t *conn_recv(conn_t *conn);
+uint64_t now_ns();
+void    latency_record(latency_t *lat, uint64_t ns);
+uint64_t latency_percentile(latency_t *lat, double p);
+uint64_t ticks();
+bool    phase_sampled();
+void    phase_add(int phase, uint64_t ticks);
+void    worker_ready(int id);
+void    hist_record(hist_t *h, uint64_t v);
+uint64_t hist_percentile(const hist_t *h, double p);
+uint64_t hist_count_upto(const hist_t *h, uint64_t v);
+bool    zygote_start();
+void    zygote_stop();
+bool    zygote_spawn(int id);
+void    zygote_replies();
+uint64_t now_ms();
+bool    wheel_resize(int size);
+void    timer_set(int kind, int id, uint64_t when);
+void    timer_cancel(int kind, int id);
+int     timer_timeout();
+void    timer_run();
+void    on_timer(int kind, int id);
+void    schedule_restart(int id);
+void    restart_slot(int id);
+void    set_state(int id, int state);
+void    check_heartbeat(int id);
+void    drain_slot(int id, bool replace);
+void    finish_shutdown();
+bool    stats_create();
+bool    stats_map(int slots);
+stats_slot_t *stats_slot(int id);
+void    stats_publish(int id);
+void    stats_backoff(int id, uint64_t ms);
+void    stats_child(int id);
+void    stats_tick();
+void    stats_fold();
+void    stats_destroy();
+bool    metrics_init();
+void    metrics_stop();
+bool    cluster_init();
+void    cluster_stop();
+void    cluster_recv();
+void    cluster_gossip();
+void    cluster_leave();
+int     cluster_main(int argc, char *argv[]);
+void    metrics_accept();
+void    metrics_close(metrics_client_t *c);
+void    metrics_expire();
+void    metrics_io(int fd);
+int     stats_main(int argc, char *argv[]);
+stats_header_t *stats_attach(const char *arg, size_t *size, int *n);
+int     bench_main(int argc, char *argv[]);
+int     load_main(int argc, char *argv[]);
+int     bench_worker();
+bool    dispatch_create();
+bool    dispatch_map(int n);
+dispatch_slot_t *dispatch_slot(int id);
+void    dispatch_reset(int id);
+void    dispatch_fill(int id);
+void    dispatch_reap();
+uint64_t dispatch_age(int id, uint64_t now);
+void    dispatch_child(int id);
+int     dispatch_work(int id);
+void    upgrade();
+void    upgrade_reap();
+bool    inherit_listeners();
+bool    log_start();
+void    log_stop();
+void    log_attach(int id);
+void    log_resize(int size);
+void    log_msg(int level, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+void    log_error(const char *what);
+void    log_reopen();
+static void *log_thread(void *arg);
 
 /* Entry routine; parse command line options and launch master process.
  *
@@ -82,15 +1282,50 @@ void    terminate_children();
  */
 int main(int argc, char *argv[])
 {
-    pid_t   pid;
-    int     status;
+    pid_t           pid;
+    int             status, i;
+    char            path[PATH_MAX];
+    extern char **  environ;
+
+    /* Keep a copy of our arguments for re-executing ourselves on an upgrade,
+     * since we are about to write over argv[0]. Relative paths won't work
+     * once we have moved to /, so find out where we really are. */
+    exec_argv = calloc(argc + 1, sizeof(*exec_argv));
+    for (i = 0; i < argc; ++i)
+        exec_argv[i] = strdup(argv[i]);
+    exec_path = strchr(argv[0], '/') && realpath(argv[0], path) ? strdup(path) : exec_argv[0];
+
+    /* The environment comes right after the arguments, and a process name
+     * longer than argv[0] runs into it: copy it out of the way too, or
+     * getenv("NOTIFY_SOCKET") (say) finds just zeros later on */
+    for (i = 0; environ[i]; ++i)
+        environ[i] = strdup(environ[i]);
 
     /* record process name so we can modify it later */
     process_name = argv[0];
 
+    /* `forking-daemon stats' reads the stats of a running daemon */
+    if (argc > 1 && !strcmp(argv[1], "stats"))
+        return stats_main(argc - 1, argv + 1);
+
+    /* `forking-daemon bench' times a few of them */
+    if (argc > 1 && !strcmp(argv[1], "bench"))
+        return bench_main(argc - 1, argv + 1);
+    if (argc > 1 && !strcmp(argv[1], "bench-worker"))
+        return bench_worker();
+
+    /* and `forking-daemon load' puts load on one that serves */
+    if (argc > 1 && !strcmp(argv[1], "load"))
+        return load_main(argc - 1, argv + 1);
+
+    /* and `forking-daemon cluster' listens to a cluster of them */
+    if (argc > 1 && !strcmp(argv[1], "cluster"))
+        return cluster_main(argc - 1, argv + 1);
+
     optparse(argc, argv);
 
-    if (options.daemonize) {
+    /* A new master started by an upgrade is a daemon already */
+    if (options.daemonize && !getenv("FORKING_DAEMON_PARENT")) {
         pid = fork();
 
         if (pid < 0) {
@@ -109,324 +1344,8392 @@ int main(int argc, char *argv[])
             exit(status);
     }
 
-    return master();
+    status = master();
+    log_stop();
+    return status;
 }
 
-/* Simple options parsing with getopt(), which has the old UNIX semantics.
- *
- * Modern GNU style long options processing can be achieved with getopt_long()
+/* Options parsing with getopt_long(), which understands both the old UNIX
+ * style short options (-j 4) and GNU style long options (--jobs=4).
  */
 void optparse(int argc, char *argv[])
 {
-    int     opt;
-    bool    clean_exit = false;
+    if (!options_read(&options, argc, argv, false))
+        exit(1);
+}
 
-    /* default options */
-    options.jobs      = 2;
-    options.daemonize = false;
-    strcpy(options.logfile, "/dev/null\0");
+/* Set opts to the defaults */
+static void options_defaults(options_t *opts)
+{
+    memset(opts, 0, sizeof(*opts));
+    opts->jobs           = 2;
+    opts->daemonize      = false;
+    strcpy(opts->logfile, "/dev/null\0");
+    opts->backoff_base   = 100;
+    opts->backoff_max    = 30000;
+    opts->min_uptime     = 1000;
+    opts->crash_limit    = 5;
+    opts->park_time      = 60000;
+    opts->restart_budget = 0;
+    opts->restart_window = 1000;
+    opts->drain_timeout  = 10000;
+    opts->max_rotating   = 1;
+    opts->threads        = 1;
+    opts->ready_percent  = 100;
+}
 
-    /* Colons indicate flags that have required arguments */
-    while ((opt = getopt(argc, argv, "hdf:j:")) != -1) {
-        switch (opt) {
-        case 'd':
-            options.daemonize = true;
-            break;
-        case 'f':
-            /* strncpy() to prevent buffer overflows */
-            strncpy(options.logfile, optarg, sizeof(options.logfile));
-            break;
-        case 'j':
-            /* keep it simple; no argument checking */
-            options.jobs = atoi(optarg);
-            break;
-        case 'h':
-            clean_exit = true;
-            /* fall through */
-        default:
-            printf("An example forking daemon utilizing SIGCHLD.\n\n");
-            printf("Usage: %s [options]\n\n", argv[0]);
-            printf("Options:\n");
-            printf("    -j JOBS     number of children to spawn\n");
-            printf("    -f FILE     log to file when daemonized\n");
-            printf("    -d          daemonize\n");
-            printf("    -h\n");
+/* Apply the command line to opts. With reloading, nothing is printed but the
+ * complaints of set_option(), and nobody exits. */
+static bool options_argv(options_t *opts, int argc, char *argv[], bool reloading)
+{
+    int opt;
 
-            exit(clean_exit ? 0 : 1);
+    /* start getopt_long() over, for a second pass or a reload */
+#ifdef __GLIBC__
+    optind = 0;
+#else
+    optind = optreset = 1;
+#endif
+
+    /* Colons indicate flags that have required arguments */
+    while ((opt = getopt_long(argc, argv, "hc:df:j:l:rz", long_options, NULL)) != -1) {
+        if (opt == 'h' && !reloading) {
+            usage(argv[0]);
+            exit(0);
+        }
+        if (opt == '?' || opt == 'h' || !set_option(opts, opt, optarg)) {
+            if (!reloading)
+                usage(argv[0]);
+            return false;
         }
     }
+
+    return true;
 }
 
-/* Go through the proper incantations to make this a proper UNIX daemon */
-int daemonize()
+/* Read the options into opts: the defaults, then the config file (-c), if
+ * there is one, and then the command line, which has the last word. Returns
+ * false, after complaining, if any of it is no good.
+ *
+ * The master does this again on SIGHUP (see reload()), with the same command
+ * line; only the file can have changed.
+ */
+bool options_read(options_t *opts, int argc, char *argv[], bool reloading)
 {
-    int log;
-
-    /* Reset master file umask in case it has been altered.
-     * Notice that this is a bitmask, and not a file mode!
-     *
-     * e.g. umask(022); open(f, O_CREAT, 0777) => -rwxr-xr-x
-     *      umask(077); open(f, O_CREAT, 0777) => -rwx------
-     *      umask(0);   open(f, O_CREAT, 0777) => -rwxrwxrwx
-     *
-     * Setting to zero essentially allows the program to fully manage its
-     * file permissions.
-     */
-    umask(0);
+    char    config[PATH_MAX];
+    char *  p = getenv("FORKING_DAEMON_CONFIG");
 
-    /* Redirect the 3 standard streams to /dev/null, or to a specified logfile.
-     *
-     * This is better than closing the streams, since printf() to a closed file
-     * descriptor will raise noisy errors.
-     */
-    if ((log = open(options.logfile, O_WRONLY|O_APPEND|O_CREAT, 0644)) < 0) {
-        perror("open()");
-        return errno;
-    }
-    dup2(log, STDIN_FILENO);
-    dup2(log, STDOUT_FILENO);
-    dup2(log, STDERR_FILENO);
-    close(log);
+    /* a first pass, just to find the file */
+    options_defaults(opts);
+    if (!options_argv(opts, argc, argv, reloading))
+        return false;
 
-    /* Create a new session.
-     *
-     * Processes are not only grouped hierarchically by parent pid, but also by
-     * `process groups', which are typically composed of programs launched by
-     * a common process, like your shell (which of course often correspond
-     * exactly with the parent-child hierarchy).
-     *
-     * Process groups can be targets of various signals, so it's important to
-     * break from the parent's group and form a new group (aka session). Calling
-     * setsid() makes this process the session leader for a new process group.
-     */
-    if (setsid() < 0) {
-        perror("setsid()");
-        return errno;
-    }
+    if (opts->config[0]) {
+        /* A daemon is in / by the time it reads the file again, so from then
+         * on, it is the one we found the first time; as it is for a master
+         * started by an upgrade (see upgrade()) */
+        if (reloading) {
+            strcpy(config, options.config);
+        } else if (p) {
+            snprintf(config, sizeof(config), "%s", p);
+            unsetenv("FORKING_DAEMON_CONFIG");
+        } else if (!realpath(opts->config, config)) {
+            fprintf(stderr, "--config: %s: %s\n", opts->config, strerror(errno));
+            return false;
+        }
 
-    /* Change working directory to root.
-     *
-     * Every process has a working directory. Life is better when your working
-     * directory is set to something that is unlikely to disappear.
-     */
-    if (chdir("/") < 0) {
-        perror("chdir()");
-        return errno;
+        options_defaults(opts);
+        if (!options_load(opts, config) || !options_argv(opts, argc, argv, reloading))
+            return false;
+        strcpy(opts->config, config);
     }
 
-    return 0;
+    return options_check(opts);
 }
 
-/* Fork children, trap signals, block, and wait.
+/* Apply the options in a config file to opts. Returns false, after
+ * complaining about every line that is no good, if there were any.
  *
- * Return values become exit values for the program.
+ * Each line of the file has an option, named as its long option, and its
+ * argument, if it takes one:
+ *
+ *   # blank lines, and anything after a #, are ignored
+ *   jobs 8
+ *   listen 0.0.0.0:8080
+ *   zygote
+ *   group web:6:nice=-5
+ *   backoff-max = 10000
+ *
+ * Each goes through set_option(), just as it would on the command line.
  */
-int master()
+bool options_load(options_t *opts, const char *path)
 {
-    int i;
+    char            line[0x800], *name, *arg, *end;
+    FILE *          f;
+    int             n = 0;
+    bool            ok = true;
+    struct option * o;
 
-    /* Give our master a name (strncpy to remove any trailing garbage) */
-    strncpy(process_name, "forking-daemon: master", 0xff);
+    if (!(f = fopen(path, "r"))) {
+        fprintf(stderr, "%s: %s\n", path, strerror(errno));
+        return false;
+    }
 
-    /* spawn some children */
-    for (i = 0; i < options.jobs; ++i) {
-        if (!child(i)) {
-            fprintf(stderr, "child() failed!\n");
-            return 1;
+    while (fgets(line, sizeof(line), f)) {
+        ++n;
+        line[strcspn(line, "#\n")] = '\0';
+
+        /* NAME, then space or = (or both), then the argument, if any */
+        name = line + strspn(line, " \t");
+        if (!*name)
+            continue;
+        arg = name + strcspn(name, " \t=");
+        if (*arg) {
+            *arg++ = '\0';
+            arg += strspn(arg, " \t=");
         }
-    }
+        for (end = arg + strlen(arg); end > arg && (end[-1] == ' ' || end[-1] == '\t'); )
+            *--end = '\0';
 
-    register_signals();
+        for (o = long_options; o->name && strcmp(o->name, name); ++o)
+            ;
 
-    /* Trap after forking children, during which SIGCHLD should be ignored
-     *
-     * This bit is new to me; forking many times in a row can lead to stillborn
-     * children. The program will handle this gracefully by itself if SIGCHLD
-     * is left alone during the spawning.
-     */
-    if (!trap_signals(true)) {
-        fprintf(stderr, "trap_signals() failed!\n");
-        return 1;
+        if (!o->name || o->val == 'h' || o->val == 'c') {
+            fprintf(stderr, "%s:%d: unknown option %s\n", path, n, name);
+            ok = false;
+        } else if ((o->has_arg == no_argument) != !*arg) {
+            fprintf(stderr, "%s:%d: %s %s\n", path, n, name,
+                    *arg ? "takes no argument" : "needs an argument");
+            ok = false;
+        } else if (!set_option(opts, o->val, arg)) {
+            fprintf(stderr, "%s:%d: in %s\n", path, n, name);
+            ok = false;
+        }
     }
 
-    /* Block and wait for signals.
-     *
-     * An alternate, synchronous strategy to SIGCHLD could be deployed here,
-     * which is to call waitpid(..., WNOHANG) in a loop
+    fclose(f);
+    return ok;
+}
+
+/* Make sure the options in opts go together, and work out the ones that follow
+ * from the others. Returns false, after complaining, if they don't. */
+bool options_check(options_t *opts)
+{
+    int i;
+
+    if (opts->dispatch && opts->listen[0]) {
+        fprintf(stderr, "--dispatch and --listen don't mix\n");
+        return false;
+    }
+    if (opts->steal && !opts->dispatch) {
+        fprintf(stderr, "--steal needs --dispatch\n");
+        return false;
+    }
+    if (opts->exec[0] && (opts->dispatch || opts->zygote)) {
+        fprintf(stderr, "--exec doesn't mix with --dispatch or --zygote\n");
+        return false;
+    }
+    if (opts->io_uring && !opts->listen[0]) {
+        fprintf(stderr, "--io-uring needs --listen\n");
+        return false;
+    }
+    if (opts->balance && (!opts->listen[0] || opts->reuseport || opts->io_uring || opts->exec[0])) {
+        fprintf(stderr, "--balance needs --listen, and doesn't mix with --reuseport, --io-uring or --exec\n");
+        return false;
+    }
+    if (opts->threads > 1 && (!opts->listen[0] || opts->exec[0])) {
+        fprintf(stderr, "--threads needs --listen, and doesn't mix with --exec\n");
+        return false;
+    }
+    if (opts->coroutines && (!opts->listen[0] || opts->exec[0])) {
+        fprintf(stderr, "--coroutines needs --listen, and doesn't mix with --exec\n");
+        return false;
+    }
+    if ((opts->npeers || opts->coordinator[0]) && !opts->cluster[0]) {
+        fprintf(stderr, "--peer and --coordinator need --cluster\n");
+        return false;
+    }
+
+    /* the worker groups are the pool */
+    if (opts->ngroups) {
+        if (opts->max_jobs) {
+            fprintf(stderr, "--group and --max-jobs don't mix\n");
+            return false;
+        }
+        for (i = opts->jobs = 0; i < opts->ngroups; ++i)
+            opts->jobs += opts->groups[i].count;
+        if (opts->jobs > MAX_JOBS) {
+            fprintf(stderr, "--group: the groups add up to %d children, more than %d\n",
+                    opts->jobs, MAX_JOBS);
+            return false;
+        }
+    }
+
+    /* an autoscaled pool starts out at --jobs, within its bounds */
+    if (opts->min_jobs && !opts->max_jobs) {
+        fprintf(stderr, "--min-jobs needs --max-jobs\n");
+        return false;
+    }
+    if (opts->max_jobs) {
+        if (!opts->min_jobs)
+            opts->min_jobs = 1;
+        if (opts->min_jobs > opts->max_jobs) {
+            fprintf(stderr, "--min-jobs is more than --max-jobs\n");
+            return false;
+        }
+        if (opts->jobs < opts->min_jobs)
+            opts->jobs = opts->min_jobs;
+        if (opts->jobs > opts->max_jobs)
+            opts->jobs = opts->max_jobs;
+    }
+
+    return true;
+}
+
+/* Name of an option, for error messages */
+static const char *option_name(int opt)
+{
+    struct option *o;
+
+    for (o = long_options; o->name; ++o)
+        if (o->val == opt)
+            return o->name;
+
+    return "?";
+}
+
+/* Parse a number from min to max for option opt, or complain */
+static bool parse_number(int opt, const char *arg, long min, long max, long *n)
+{
+    char *end;
+
+    /* strtol() tells us where the number ended, unlike atoi() */
+    *n = strtol(arg, &end, 10);
+    if (*arg == '\0' || *end != '\0' || *n < min || *n > max) {
+        fprintf(stderr, "--%s: expected a number from %ld to %ld\n",
+                option_name(opt), min, max);
+        return false;
+    }
+
+    return true;
+}
+
+/* Parse an --rlimit RESOURCE=N into opts */
+static bool parse_rlimit(options_t *opts, const char *arg)
+{
+    static const struct {
+        const char *    name;
+        int             resource;
+    } names[] = {
+        { "as", RLIMIT_AS }, { "core", RLIMIT_CORE }, { "cpu", RLIMIT_CPU },
+        { "data", RLIMIT_DATA }, { "fsize", RLIMIT_FSIZE }, { "memlock", RLIMIT_MEMLOCK },
+        { "nofile", RLIMIT_NOFILE }, { "nproc", RLIMIT_NPROC }, { "stack", RLIMIT_STACK }
+    };
+    const char *        eq = strchr(arg, '=');
+    char *              end;
+    unsigned long long  n;
+    size_t              i;
+
+    for (i = 0; eq && i < sizeof(names) / sizeof(*names); ++i)
+        if ((size_t)(eq - arg) == strlen(names[i].name) && !strncmp(arg, names[i].name, eq - arg))
+            break;
+
+    if (!eq || i == sizeof(names) / sizeof(*names) || opts->nrlimits == EXEC_MAX_RLIMITS) {
+        fprintf(stderr, "--rlimit: expected RESOURCE=N (at most %d of them)\n", EXEC_MAX_RLIMITS);
+        return false;
+    }
+
+    if (!strcmp(eq + 1, "unlimited")) {
+        n = RLIM_INFINITY;
+    } else {
+        errno = 0;
+        n = strtoull(eq + 1, &end, 10);
+        if (errno || end == eq + 1 || *end) {
+            fprintf(stderr, "--rlimit: %s is not a number\n", eq + 1);
+            return false;
+        }
+    }
+
+    opts->rlimits[opts->nrlimits].resource = names[i].resource;
+    opts->rlimits[opts->nrlimits++].value  = n;
+    return true;
+}
+
+/* Parse a --group NAME:COUNT[:KEY=VALUE...] into opts */
+static bool parse_group(options_t *opts, const char *arg)
+{
+#ifdef __linux__
+    static const struct {
+        const char *    name;
+        int             policy;
+    } policies[] = {
+        { "other", SCHED_OTHER }, { "batch", SCHED_BATCH }, { "idle", SCHED_IDLE },
+        { "fifo", SCHED_FIFO }, { "rr", SCHED_RR }
+    };
+#endif
+    char        spec[0x400], *field, *save, *eq, *end;
+    group_t *   g = &opts->groups[opts->ngroups];
+    long        n;
+    size_t      i;
+
+    if (opts->ngroups == MAX_GROUPS) {
+        fprintf(stderr, "--group: at most %d of them\n", MAX_GROUPS);
+        return false;
+    }
+    memset(g, 0, sizeof(*g));
+    g->policy = -1;
+    strncpy(spec, arg, sizeof(spec) - 1);
+    spec[sizeof(spec) - 1] = '\0';
+
+    /* the name goes into the cgroup's path, so keep it tame */
+    field = strtok_r(spec, ":", &save);
+    if (!field || strlen(field) >= sizeof(g->name) || strspn(field,
+        "abcdefghijklmnopqrstuvwxyz0123456789_-") != strlen(field) ||
+        !strcmp(field, "forking-daemon.master")) {
+        fprintf(stderr, "--group: expected NAME:COUNT, with a NAME of [a-z0-9_-]\n");
+        return false;
+    }
+    strcpy(g->name, field);
+    for (i = 0; i < (size_t)opts->ngroups; ++i)
+        if (!strcmp(opts->groups[i].name, g->name)) {
+            fprintf(stderr, "--group: %s twice\n", g->name);
+            return false;
+        }
+
+    if (!(field = strtok_r(NULL, ":", &save)) || !parse_number(OPT_GROUP, field, 1, 0x10000, &n))
+        return false;
+    g->count = n;
+
+    while ((field = strtok_r(NULL, ":", &save))) {
+        if (!(eq = strchr(field, '='))) {
+            fprintf(stderr, "--group: expected KEY=VALUE, not %s\n", field);
+            return false;
+        }
+        *eq++ = '\0';
+        n = strtol(eq, &end, 10);
+
+#ifdef __linux__
+        if (!strcmp(field, "sched")) {
+            for (i = 0; i < sizeof(policies) / sizeof(*policies); ++i)
+                if (!strcmp(eq, policies[i].name))
+                    break;
+            if (i == sizeof(policies) / sizeof(*policies)) {
+                fprintf(stderr, "--group: unknown sched=%s\n", eq);
+                return false;
+            }
+            g->policy = policies[i].policy;
+            continue;
+        }
+#endif
+        if (!strcmp(field, "cpus")) {
+            if (strlen(eq) >= sizeof(g->cpus) || parse_cpulist(eq, NULL, 0) <= 0) {
+                fprintf(stderr, "--group: bad cpus=%s\n", eq);
+                return false;
+            }
+            strcpy(g->cpus, eq);
+            continue;
+        }
+
+        /* the rest are all numbers */
+        if (!*eq || *end) {
+            fprintf(stderr, "--group: %s=%s is not a number\n", field, eq);
+            return false;
+        }
+        if (!strcmp(field, "nice") && n >= -20 && n <= 19)
+            g->nice = n;
+        else if (!strcmp(field, "priority") && n >= 1 && n <= 99)
+            g->priority = n;
+        else if (!strcmp(field, "cpu-weight") && n >= 1 && n <= 10000)
+            g->cpu_weight = n;
+        else if (!strcmp(field, "io-weight") && n >= 1 && n <= 10000)
+            g->io_weight = n;
+        else if (!strcmp(field, "memory-low") && n >= 1)
+            g->memory_low = n;
+        else if (!strcmp(field, "memory-high") && n >= 1)
+            g->memory_high = n;
+        else {
+            fprintf(stderr, "--group: bad (or unknown) %s=%s\n", field, eq);
+            return false;
+        }
+    }
+
+#ifdef __linux__
+    /* realtime policies need a priority, and the others can't have one */
+    if ((g->policy == SCHED_FIFO || g->policy == SCHED_RR) != (g->priority != 0)) {
+        fprintf(stderr, "--group: priority=N goes with (and only with) sched=fifo or rr\n");
+        return false;
+    }
+#endif
+
+    ++opts->ngroups;
+    return true;
+}
+
+/* Apply a single option (as returned by getopt_long()) to opts.
+ * Returns false, after complaining, if arg is no good.
+ */
+bool set_option(options_t *opts, int opt, char *arg)
+{
+    long    n;
+
+    switch (opt) {
+    case 'd':
+        opts->daemonize = true;
+        break;
+    case 'c':
+        strncpy(opts->config, arg, sizeof(opts->config) - 1);
+        break;
+    case 'f':
+        /* strncpy() to prevent buffer overflows */
+        strncpy(opts->logfile, arg, sizeof(opts->logfile) - 1);
+        break;
+    case 'j':
+    case OPT_MIN_JOBS:
+    case OPT_MAX_JOBS:
+        if (!parse_number(opt, arg, 1, MAX_JOBS, &n))
+            return false;
+        *(opt == 'j'          ? &opts->jobs :
+          opt == OPT_MIN_JOBS ? &opts->min_jobs :
+                                &opts->max_jobs) = n;
+        break;
+    case 'l':
+        strncpy(opts->listen, arg, sizeof(opts->listen) - 1);
+        break;
+    case 'r':
+        opts->reuseport = true;
+        break;
+    case 'z':
+#ifdef __linux__
+        opts->zygote = true;
+#else
+        fprintf(stderr, "--zygote: not supported on this platform\n");
+        return false;
+#endif
+        break;
+    case OPT_CPU_AFFINITY:
+        if (!strcmp(arg, "none")) {
+            opts->affinity = AFFINITY_NONE;
+        } else if (!strcmp(arg, "rr")) {
+            opts->affinity = AFFINITY_RR;
+        } else if (!strcmp(arg, "cores")) {
+            opts->affinity = AFFINITY_CORES;
+        } else if (parse_cpulist(arg, NULL, 0) > 0) {
+            opts->affinity = AFFINITY_LIST;
+            strncpy(opts->cpulist, arg, sizeof(opts->cpulist) - 1);
+        } else {
+            fprintf(stderr, "--cpu-affinity: expected none, rr, cores, or a list of CPUs\n");
+            return false;
+        }
+        break;
+    case OPT_NUMA:
+        if (!strcmp(arg, "none")) {
+            opts->numa = NUMA_NONE;
+        } else if (!strcmp(arg, "bind")) {
+            opts->numa = NUMA_BIND;
+        } else if (!strcmp(arg, "preferred")) {
+            opts->numa = NUMA_PREFERRED;
+        } else {
+            fprintf(stderr, "--numa: expected none, bind, or preferred\n");
+            return false;
+        }
+        break;
+    case OPT_BACKOFF_BASE:
+    case OPT_BACKOFF_MAX:
+    case OPT_MIN_UPTIME:
+    case OPT_PARK_TIME:
+    case OPT_RESTART_WINDOW:
+    case OPT_HANG_TIMEOUT:
+    case OPT_DRAIN_TIMEOUT:
+    case OPT_MAX_AGE:
+        if (!parse_number(opt, arg, opt == OPT_RESTART_WINDOW, INT_MAX, &n))
+            return false;
+        if (opt == OPT_HANG_TIMEOUT && n && n < 2 * HEARTBEAT_INTERVAL) {
+            fprintf(stderr, "--hang-timeout: expected 0, or at least %d (an idle child only "
+                    "beats every %dms)\n", 2 * HEARTBEAT_INTERVAL, HEARTBEAT_INTERVAL);
+            return false;
+        }
+        *(opt == OPT_BACKOFF_BASE   ? &opts->backoff_base :
+          opt == OPT_BACKOFF_MAX    ? &opts->backoff_max :
+          opt == OPT_MIN_UPTIME     ? &opts->min_uptime :
+          opt == OPT_PARK_TIME      ? &opts->park_time :
+          opt == OPT_HANG_TIMEOUT   ? &opts->hang_timeout :
+          opt == OPT_DRAIN_TIMEOUT  ? &opts->drain_timeout :
+          opt == OPT_MAX_AGE        ? &opts->max_age :
+                                      &opts->restart_window) = n;
+        break;
+    case OPT_SPAWN_PARALLEL:
+    case OPT_SPAWN_STAGGER:
+        if (!parse_number(opt, arg, 0, INT_MAX, &n))
+            return false;
+        *(opt == OPT_SPAWN_PARALLEL ? &opts->spawn_parallel : &opts->spawn_stagger) = n;
+        break;
+    case OPT_READY_PERCENT:
+        if (!parse_number(opt, arg, 1, 100, &n))
+            return false;
+        opts->ready_percent = n;
+        break;
+    case OPT_CRASH_LIMIT:
+        if (!parse_number(opt, arg, 0, UINT16_MAX, &n))
+            return false;
+        opts->crash_limit = n;
+        break;
+    case OPT_STATS:
+        /* shm_open() names are supposed to start with a slash */
+        snprintf(opts->stats, sizeof(opts->stats), "%s%s", arg[0] == '/' ? "" : "/", arg);
+        break;
+    case OPT_RESTART_BUDGET:
+        if (!parse_number(opt, arg, 0, INT_MAX, &n))
+            return false;
+        opts->restart_budget = n;
+        break;
+    case OPT_DISPATCH:
+        if (!parse_number(opt, arg, 0, 0x10000, &n))
+            return false;
+        if (n & (n - 1)) {
+            fprintf(stderr, "--dispatch: expected a power of two\n");
+            return false;
+        }
+        opts->dispatch = n;
+        break;
+    case OPT_STEAL:
+        opts->steal = true;
+        break;
+    case OPT_IO_URING:
+#ifdef IORING_SETUP_DEFER_TASKRUN
+        opts->io_uring = true;
+        break;
+#else
+        fprintf(stderr, "--io-uring: not supported on this platform\n");
+        return false;
+#endif
+    case OPT_HERD:
+        opts->herd = true;
+        break;
+    case OPT_BALANCE:
+        opts->balance = true;
+        break;
+    case OPT_PHASE_SAMPLE:
+        if (!parse_number(opt, arg, 0, 1000000, &n))
+            return false;
+        opts->phase_sample = n;
+        break;
+    case OPT_METRICS:
+        strncpy(opts->metrics, arg, sizeof(opts->metrics) - 1);
+        break;
+    case OPT_THREADS:
+        if (!parse_number(opt, arg, 1, THREADS_MAX, &n))
+            return false;
+        opts->threads = n;
+        break;
+    case OPT_COROUTINES:
+        if (!parse_number(opt, arg, 0, CORO_MAX, &n))
+            return false;
+        opts->coroutines = n;
+        break;
+    case OPT_CLUSTER:
+        strncpy(opts->cluster, arg, sizeof(opts->cluster) - 1);
+        break;
+    case OPT_PEER:
+        if (!strchr(arg, ':') || opts->npeers == CLUSTER_SEEDS) {
+            fprintf(stderr, "--peer: expected HOST:PORT (at most %d of them)\n", CLUSTER_SEEDS);
+            return false;
+        }
+        strncpy(opts->peers[opts->npeers++], arg, sizeof(opts->peers[0]) - 1);
+        break;
+    case OPT_COORDINATOR:
+        if (!strchr(arg, ':')) {
+            fprintf(stderr, "--coordinator: expected HOST:PORT\n");
+            return false;
+        }
+        strncpy(opts->coordinator, arg, sizeof(opts->coordinator) - 1);
+        break;
+    case OPT_EXEC:
+        strncpy(opts->exec, arg, sizeof(opts->exec) - 1);
+        break;
+    case OPT_ENV:
+        if (!strchr(arg, '=') || opts->nenv == EXEC_MAX_ENV) {
+            fprintf(stderr, "--env: expected NAME=VALUE (at most %d of them)\n", EXEC_MAX_ENV);
+            return false;
+        }
+        strncpy(opts->env[opts->nenv++], arg, sizeof(opts->env[0]) - 1);
+        break;
+    case OPT_RLIMIT:
+        return parse_rlimit(opts, arg);
+    case OPT_GROUP:
+        return parse_group(opts, arg);
+    case OPT_WARMUP:
+        if (!parse_number(opt, arg, 0, 0x10000, &n))
+            return false;
+        opts->warmup = n;
+        break;
+    case OPT_HUGEPAGES:
+        opts->hugepages = true;
+        break;
+    case OPT_MAX_REQUESTS:
+    case OPT_MAX_RSS:
+    case OPT_MAX_ROTATING:
+        if (!parse_number(opt, arg, opt == OPT_MAX_ROTATING, INT_MAX, &n))
+            return false;
+        *(opt == OPT_MAX_REQUESTS ? &opts->max_requests :
+          opt == OPT_MAX_RSS      ? &opts->max_rss :
+                                    &opts->max_rotating) = n;
+        break;
+    default:
+        return false;
+    }
+
+    return true;
+}
+
+/* Print usage information */
+void usage(char *name)
+{
+    printf("An example forking daemon utilizing SIGCHLD.\n\n");
+    printf("Usage: %s [options]\n", name);
+    printf("       %s stats NAME|PID\n", name);
+    printf("       %s bench [--sizes N,N...] [--modes fork,zygote,exec]\n", name);
+    printf("             [--rounds N] [--timeout MS]\n");
+    printf("       %s load [-c CONNS] [-R RATE] [-d MS] [-s BYTES]\n", name);
+    printf("             [--stats NAME|PID] ADDRESS | --compare [--modes LIST] [-j N]\n");
+    printf("       %s cluster [HOST:]PORT\n\n", name);
+    printf("Options:\n");
+    printf("    -j, --jobs JOBS         number of children to spawn\n");
+    printf("    -c, --config FILE       read options from FILE (as NAME [VALUE] lines,\n");
+    printf("                            reloaded on SIGHUP); the command line wins\n");
+    printf("    -f, --logfile FILE      log to file when daemonized\n");
+    printf("    -l, --listen ADDR       serve on [HOST:]PORT, or a unix socket PATH\n");
+    printf("    -r, --reuseport         give each child its own SO_REUSEPORT socket\n");
+    printf("    -z, --zygote            spawn children from a small helper process\n");
+    printf("    -d, --daemonize         daemonize\n");
+    printf("    --cpu-affinity POLICY   pin children to CPUs: none, rr, cores,\n");
+    printf("                            or a list like 0-3,8\n");
+    printf("    --numa POLICY           keep child memory on the node of its CPU:\n");
+    printf("                            none, bind, or preferred\n");
+    printf("    --backoff-base MS       first delay before restarting a failed child\n");
+    printf("                            (doubled for each failure in a row; 100)\n");
+    printf("    --backoff-max MS        longest delay before a restart (30000)\n");
+    printf("    --min-uptime MS         children dying sooner have failed (1000)\n");
+    printf("    --crash-limit N         park a slot after N failures in a row,\n");
+    printf("                            or 0 to never park (5)\n");
+    printf("    --park-time MS          how long a slot stays parked (60000)\n");
+    printf("    --restart-budget N      restarts allowed per window, or 0 for\n");
+    printf("                            no limit (0)\n");
+    printf("    --restart-window MS     length of the restart window (1000)\n");
+    printf("    --stats NAME            name of the shared memory stats segment\n");
+    printf("                            (/forking-daemon.PID)\n");
+    printf("    --hang-timeout MS       replace children with no heartbeat for this\n");
+    printf("                            long (2000 or more), or 0 to never (0)\n");
+    printf("    --drain-timeout MS      time children have to finish their work and\n");
+    printf("                            exit, before they are killed (10000)\n");
+    printf("    --spawn-parallel N      start up at most N children at a time, the\n");
+    printf("                            rest as those are ready, or 0 for all at\n");
+    printf("                            once (0)\n");
+    printf("    --spawn-stagger MS      spawn children at least MS apart (0)\n");
+    printf("    --ready-percent P       the pool is up (for systemd's READY=1, and to\n");
+    printf("                            take over in an upgrade) once P%% of its\n");
+    printf("                            children are ready (100)\n");
+    printf("    --dispatch DEPTH        feed children jobs through shared memory rings\n");
+    printf("                            of DEPTH (a power of two) entries, or 0 for\n");
+    printf("                            none (0)\n");
+    printf("    --steal                 let idle dispatch children take jobs from\n");
+    printf("                            busy ones\n");
+    printf("    --min-jobs JOBS         with --max-jobs, let the pool grow and shrink\n");
+    printf("    --max-jobs JOBS         with the load, between these sizes (1, and 0\n");
+    printf("                            for a pool of a fixed size)\n");
+    printf("    --warmup MB             build a lookup table of MB megabytes for the\n");
+    printf("                            dispatch jobs, shared by all children (0)\n");
+    printf("    --hugepages             put read-only data on transparent huge pages\n");
+    printf("    --max-requests N        recycle children after N requests (or jobs),\n");
+    printf("                            or 0 for no limit (0)\n");
+    printf("    --max-rss MB            recycle children grown to MB megabytes (0)\n");
+    printf("    --max-age MS            recycle children this old (0)\n");
+    printf("    --max-rotating N        children recycled at a time (1)\n");
+    printf("    --io-uring              serve connections with io_uring rather than\n");
+    printf("                            epoll (Linux 6.0)\n");
+    printf("    --herd                  wake every child for a connection on a shared\n");
+    printf("                            socket, not just one (to compare)\n");
+    printf("    --balance               accept connections in the master, and hand each\n");
+    printf("                            to the child with the fewest open, rather than\n");
+    printf("                            to whichever accept()s first\n");
+    printf("    --phase-sample N        time one in N spawns, respawns and batches of\n");
+    printf("                            work, for `stats' (0)\n");
+    printf("    --metrics ADDR          serve Prometheus metrics at /metrics on\n");
+    printf("                            [HOST:]PORT or PATH, from the master\n");
+    printf("    --threads N             serve with N threads in each child, each with\n");
+    printf("                            an event loop of its own (1)\n");
+    printf("    --coroutines N          serve each connection with a coroutine of its\n");
+    printf("                            own, at most N at once in each thread, or 0\n");
+    printf("                            to handle requests inline (0)\n");
+    printf("    --cluster ADDR          gossip with other masters over UDP on\n");
+    printf("                            [HOST:]PORT, and cover for nodes that drain\n");
+    printf("                            (on SIGUSR1) with --max-jobs headroom\n");
+    printf("    --peer HOST:PORT        a master to start gossiping with (repeatable)\n");
+    printf("    --coordinator HOST:PORT also report to HOST:PORT, e.g. `cluster'\n");
+    printf("    --exec CMD              run CMD as the worker, instead of this program\n");
+    printf("    --env NAME=VALUE        set NAME in the environment of --exec workers;\n");
+    printf("                            %%i in VALUE is the slot (repeatable)\n");
+    printf("    --rlimit RES=N          limit --exec workers' RES (as, core, cpu, data,\n");
+    printf("                            fsize, memlock, nofile, nproc or stack) to N,\n");
+    printf("                            or unlimited (repeatable)\n");
+    printf("    --group NAME:N[:KEY=VAL...]\n");
+    printf("                            run the next N slots as worker group NAME,\n");
+    printf("                            with nice=N, sched=other|batch|idle|fifo|rr,\n");
+    printf("                            priority=N, cpus=LIST and (in a cgroup of its\n");
+    printf("                            own) cpu-weight=N, io-weight=N, memory-low=MB\n");
+    printf("                            and memory-high=MB; the groups make up the\n");
+    printf("                            pool (repeatable)\n");
+    printf("    -h, --help\n");
+}
+
+/* Go through the proper incantations to make this a proper UNIX daemon */
+int daemonize()
+{
+    int log;
+
+    /* Reset master file umask in case it has been altered.
+     * Notice that this is a bitmask, and not a file mode!
+     *
+     * e.g. umask(022); open(f, O_CREAT, 0777) => -rwxr-xr-x
+     *      umask(077); open(f, O_CREAT, 0777) => -rwx------
+     *      umask(0);   open(f, O_CREAT, 0777) => -rwxrwxrwx
+     *
+     * Setting to zero essentially allows the program to fully manage its
+     * file permissions.
+     */
+    umask(0);
+
+    /* Redirect the 3 standard streams to /dev/null, or to a specified logfile.
+     *
+     * This is better than closing the streams, since printf() to a closed file
+     * descriptor will raise noisy errors.
+     */
+    if ((log = open(options.logfile, O_WRONLY|O_APPEND|O_CREAT, 0644)) < 0) {
+        perror("open()");
+        return errno;
+    }
+    dup2(log, STDIN_FILENO);
+    dup2(log, STDOUT_FILENO);
+    dup2(log, STDERR_FILENO);
+    close(log);
+
+    /* Create a new session.
+     *
+     * Processes are not only grouped hierarchically by parent pid, but also by
+     * `process groups', which are typically composed of programs launched by
+     * a common process, like your shell (which of course often correspond
+     * exactly with the parent-child hierarchy).
+     *
+     * Process groups can be targets of various signals, so it's important to
+     * break from the parent's group and form a new group (aka session). Calling
+     * setsid() makes this process the session leader for a new process group.
+     */
+    if (setsid() < 0) {
+        perror("setsid()");
+        return errno;
+    }
+
+    /* Change working directory to root.
+     *
+     * Every process has a working directory. Life is better when your working
+     * directory is set to something that is unlikely to disappear.
+     */
+    if (chdir("/") < 0) {
+        perror("chdir()");
+        return errno;
+    }
+
+    return 0;
+}
+
+/* Trap signals, fork children, and run the event loop.
+ *
+ * Return values become exit values for the program.
+ */
+int master()
+{
+    int     i, n;
+    event_t events[64];
+
+    /* Give our master a name (strncpy to remove any trailing garbage) */
+    strncpy(process_name, "forking-daemon: master", 0xff);
+
+    /* Everything from here on is logged through the logger thread */
+    if (!log_start()) {
+        fprintf(stderr, "log_start() failed!\n");
+        return 1;
+    }
+
+    if (!ev_init()) {
+        log_msg(LOG_ERROR, "ev_init() failed!");
+        return 1;
+    }
+
+    register_signals();
+
+    /* Trap signals BEFORE forking children.
+     *
+     * Trapped signals are blocked and read synchronously from the event loop,
+     * so a child that dies during the spawn loop is not lost: its SIGCHLD (or
+     * its pidfd) simply stays pending until we get around to looking at it.
+     * Nothing ever runs in signal context, so it is also safe to printf() and
+     * fork() in response to a signal.
      */
-    while (1) sleep(1);
+    if (!trap_signals(true)) {
+        log_msg(LOG_ERROR, "trap_signals() failed!");
+        return 1;
+    }
+
+    /* The stats segment is created before any children, who inherit it */
+    if (!stats_create()) {
+        log_msg(LOG_ERROR, "stats_create() failed!");
+        return 1;
+    }
+
+    /* So is the dispatch segment; children map it for themselves */
+    if (!dispatch_create()) {
+        log_msg(LOG_ERROR, "dispatch_create() failed!");
+        return 1;
+    }
+
+    /* Decide where children will run before there are any */
+    if (!placement_init()) {
+        log_msg(LOG_ERROR, "placement_init() failed!");
+        return 1;
+    }
+    if (!groups_init()) {
+        log_msg(LOG_ERROR, "groups_init() failed!");
+        return 1;
+    }
+
+    /* Build whatever the children only ever read, once, for all of them */
+    if (!warmup()) {
+        log_msg(LOG_ERROR, "warmup() failed!");
+        return 1;
+    }
+
+    /* Open the listening socket before forking, so that every child
+     * inherits it; the kernel then hands each connection to whichever child
+     * is first to accept() it. */
+    if (!inherit_listeners()) {
+        log_msg(LOG_ERROR, "inherit_listeners() failed!");
+        return 1;
+    }
+    if (options.listen[0] && !options.reuseport && listenfd < 0 &&
+        (listenfd = listen_socket(options.listen, false)) < 0) {
+        log_msg(LOG_ERROR, "listen_socket() failed!");
+        return 1;
+    }
+
+    /* Scrapers can reach us before there are any children to report on */
+    if (!metrics_init()) {
+        log_msg(LOG_ERROR, "metrics_init() failed!");
+        return 1;
+    }
+
+    /* and the rest of the cluster can start to hear from us */
+    if (!cluster_init()) {
+        log_msg(LOG_ERROR, "cluster_init() failed!");
+        return 1;
+    }
+
+    /* Children ring the master once they are ready; the zygote's, too */
+    if (!ready_init()) {
+        log_msg(LOG_ERROR, "ready_init() failed!");
+        return 1;
+    }
+
+    /* The zygote is forked while the master is still small, and forks every
+     * child from then on. */
+    if (options.zygote && !zygote_start()) {
+        log_msg(LOG_ERROR, "zygote_start() failed!");
+        return 1;
+    }
+
+    /* Spawn some children (or, with --spawn-parallel or --spawn-stagger, the
+     * first few of them: the event loop spawns the rest as it goes). The pool
+     * is up once enough of them say they are ready; see pool_ready(). */
+    pool_start = now_ms();
+    if (!pool_resize(options.jobs)) {
+        log_msg(LOG_ERROR, "child() failed!");
+        return 1;
+    }
+
+    if (options.max_jobs) {
+        scale_sampled = now_ns();
+        timer_set(TIMER_SCALE, -1, now_ms() + SCALE_INTERVAL);
+    }
+    if (options.max_requests || options.max_rss || options.max_age)
+        timer_set(TIMER_RECYCLE, -1, now_ms() + RECYCLE_INTERVAL);
+    if (cluster_fd >= 0)
+        timer_set(TIMER_CLUSTER, -1, now_ms() + CLUSTER_INTERVAL);
+
+    /* Block and wait for events.
+     *
+     * The kernel wakes us only when something has happened: a signal was
+     * delivered, or a particular child exited, or the next timer is due.
+     * There are no periodic wakeups, and the cost of an exit is just the cost
+     * of reaping that one child.
+     */
+    while (running) {
+        if ((n = ev_wait(events, 64, timer_timeout())) < 0) {
+            log_error("ev_wait()");
+            return 1;
+        }
+
+        for (i = 0; i < n && running; ++i) {
+            switch (events[i].type) {
+            case EVENT_SIGNAL:
+                TRACE(signal, events[i].id);
+                for (int j = 0; j < sigcount; ++j)
+                    if (sigpairs[j].signal == events[i].id)
+                        sigpairs[j].handler();
+                break;
+            case EVENT_CHILD:
+                reap_child(events[i].id);
+                break;
+            case EVENT_ZYGOTE:
+                zygote_replies();
+                break;
+            case EVENT_UPGRADE:
+                upgrade_reap();
+                break;
+            case EVENT_DISPATCH:
+                dispatch_reap();
+                break;
+            case EVENT_METRICS:
+                metrics_accept();
+                break;
+            case EVENT_METRICS_CONN:
+                metrics_io(events[i].id);
+                break;
+            case EVENT_CLUSTER:
+                cluster_recv();
+                break;
+            case EVENT_READY:
+                ready_check();
+                break;
+            case EVENT_LISTEN:
+                balance_accept();
+                break;
+            }
+        }
+
+        if (running)
+            timer_run();
+
+        /* children that are ready (or gone) may have made room for more */
+        if (running && spawn_held)
+            spawn_pending();
+    }
+
+    return 0;
+}
+
+/* Forks a child process, and returns true if successful.
+ * The forked child blocks and randomly dies.
+ *
+ * If this program did any work, the main communication between parent and child
+ * could take place through a pipe(2). With --dispatch it does, if only for
+ * show, and communicates through rings in shared memory instead; see
+ * dispatch_t.
+ */
+bool child(int id)
+{
+    pid_t       pid;
+    int         i;
+    uint64_t    start;
+    bool        sampled;
+
+    /* Each child listens on its own socket with SO_REUSEPORT. The socket
+     * belongs to the slot rather than the process, so connections queued on
+     * it survive while a dead child is being replaced. */
+    if (options.reuseport && slots.lfd[id] < 0 &&
+        (slots.lfd[id] = listen_socket(options.listen, true)) < 0)
+        return false;
+
+    /* With --balance, it gets its connections from us instead, through a
+     * channel of its own; see balance_accept() */
+    if (options.balance && slots.lfd[id] < 0 && !balance_open(id))
+        return false;
+
+    TRACE(spawn__start, id);
+    sampled = respawn_sample >= 0 ? respawn_sample : phase_sampled();
+    slots.spawn_ticks[id] = sampled ? ticks() : 0;
+
+    /* a new child starts out with empty rings, and a full load of jobs */
+    if (dispatch.header)
+        dispatch_reset(id);
+
+    if (options.exec[0] || zygote_fd >= 0) {
+        if (options.exec[0] ? exec_child(id) : zygote_spawn(id))
+            return true;
+        slots.spawn_ticks[id] = 0;
+        return false;
+    }
+
+    /* flush stdio first, or the child inherits (and later repeats) anything
+     * still sitting in our buffers */
+    fflush(stdout);
+
+    start = now_ns();
+
+    /* see main() for discussion on fork() */
+    pid = fork();
+
+    if (pid < 0) {
+        slots.spawn_ticks[id] = 0;
+        return false;
+    } else if (pid > 0) {
+        child_started(id, pid, start);
+        return true;
+    }
+
+    /* Child process continues here */
+
+    for (i = 0; i < slots.size; ++i) {
+        if (i != id && slots.lfd[i] >= 0)
+            close(slots.lfd[i]);
+        if (slots.chan[i] >= 0)
+            close(slots.chan[i]);
+    }
+
+    worker(id, slots.lfd[id] >= 0 ? slots.lfd[id] : listenfd);
+}
+
+/* Record a newly spawned child in the child table */
+void child_started(int id, pid_t pid, uint64_t start)
+{
+    int j, status;
+
+    latency_record(&spawn_latency, now_ns() - start);
+    hist_record(&spawn_hist, now_ns() - start);
+    TRACE(spawn__done, id, pid, now_ns() - start);
+    if (slots.spawn_ticks[id]) {
+        phase_add(PHASE_SPAWN, ticks() - slots.spawn_ticks[id]);
+        slots.spawn_ticks[id] = 0;
+    }
+
+    log_msg(LOG_INFO, "Master: Spawning child(%d) [pid %d]", id, pid);
+
+    /* record the child pid */
+    slots.pid[id]     = pid;
+    slots.started[id] = now_ms();
+    slots.stale[id]   = false;
+    slots.live++;
+    slots_index(pid, id);
+    if (stats.header && id < (int)stats.header->slots)
+        __atomic_store_n(&stats_slot(id)->spawned, start, __ATOMIC_RELAXED);
+    set_state(id, SLOT_RUNNING);
+
+    /* A stand-in is up: the child it stands in for can go. Once that child's
+     * replacement is up, the stand-in can go in turn. */
+    if (slots.cover[id] >= 0) {
+        drain_slot(slots.cover[id], true);
+    } else if ((j = slots_cover_of(id)) >= 0) {
+        end_rotation(j);
+        drain_slot(j, false);
+    }
+
+    if (options.hang_timeout)
+        timer_set(TIMER_HEARTBEAT, id, slots.started[id] + options.hang_timeout);
+
+    /* Have the event loop tell us when this particular child exits. One we
+     * can't watch (out of descriptors for its pidfd, say) is one whose death
+     * we would never hear of, so it goes now, as a spawn that failed. */
+    if (!ev_watch_child(id)) {
+        log_msg(LOG_ERROR, "Master: cannot watch child(%d) [pid %d], killing it", id, pid);
+        kill(pid, SIGKILL);
+        if (waitpid(pid, &status, 0) == pid)
+            restart_child(id, pid, status);
+    }
+}
+
+/* Copy an --env NAME=VALUE into buf, with each %i in it replaced by the slot
+ * id (and each %% by a %) */
+static void exec_expand(char *buf, size_t size, const char *var, int id)
+{
+    size_t len = 0;
+
+    for (; *var && len + 1 < size; ++var) {
+        if (var[0] == '%' && var[1] == 'i') {
+            len += snprintf(buf + len, size - len, "%d", id);
+            if (len >= size)
+                len = size - 1;
+            ++var;
+        } else {
+            buf[len++] = *var;
+            if (var[0] == '%' && var[1] == '%')
+                ++var;
+        }
+    }
+    buf[len] = '\0';
+}
+
+/* Spawn a --exec worker in slot id, and returns true if successful.
+ *
+ * The worker is some other program, so there is no point in copying the
+ * master for it, only to throw the copy away with exec(). vfork() borrows our
+ * address space (and suspends us) until the exec(), which takes just as long
+ * whether the master is megabytes or gigabytes. posix_spawn() does this very
+ * thing under the hood, but has no way to set resource limits in the new
+ * process, short of racing it with prlimit(2); so we do the few steps it
+ * would take ourselves. Until the exec(), the child may only make system
+ * calls: anything else would scribble on our memory.
+ *
+ * Nothing is inherited unless we say so. The worker gets stdin, stdout and
+ * stderr, and then:
+ *
+ *   fd 3   its listening socket (with --listen)
+ *   fd 4   the stats segment; its record is slot FORKING_DAEMON_SLOT
+ *   fd 5   the log segment (Linux); its ring is FORKING_DAEMON_SLOT + 2
+ *
+ * and each of those is also in the environment (FORKING_DAEMON_LISTEN_FD, and
+ * so on), along with any --env of our own. Everything else is closed.
+ */
+bool exec_child(int id)
+{
+    pid_t           pid;
+    uint64_t        start;
+    char            line[sizeof(options.exec)], *argv[EXEC_MAX_ARGS + 1];
+    char ** volatile envp;          /* (volatile, like all we use across vfork()) */
+    char            vars[4 + EXEC_MAX_ENV][0xff];
+    int             from[3], to[3], i, n = 0, argc = 0, envc = 0;
+    volatile int    top = EXEC_LOG_FD;
+    sigset_t        none;
+    volatile int    err = 0;        /* set by the child, if exec() fails */
+    volatile int    group_err = 0;  /* ... or if it could not fully join its group */
+    extern char **  environ;
+
+    /* split the command line into words (there is no quoting) */
+    strcpy(line, options.exec);
+    for (char *w = strtok(line, " \t"); w && argc < EXEC_MAX_ARGS; w = strtok(NULL, " \t"))
+        argv[argc++] = w;
+    argv[argc] = NULL;
+    if (!argc) {
+        errno = EINVAL;
+        return false;
+    }
+
+    /* the descriptors to pass on, and where they go */
+    if ((options.reuseport ? slots.lfd[id] : listenfd) >= 0) {
+        from[n] = options.reuseport ? slots.lfd[id] : listenfd;
+        to[n++] = EXEC_LISTEN_FD;
+    }
+    if (stats.fd >= 0) {
+        from[n] = stats.fd;
+        to[n++] = EXEC_STATS_FD;
+    }
+    if (logs.fd >= 0) {
+        from[n] = logs.fd;
+        to[n++] = EXEC_LOG_FD;
+    }
+    for (i = 0; i < n; ++i)
+        if (from[i] > top)
+            top = from[i];
+
+    /* the environment: ours, less anything of ours meant for somebody else
+     * (NOTIFY_SOCKET too: only the master speaks for us to systemd), and then
+     * the worker's own */
+    for (i = 0; environ[i]; ++i)
+        ;
+    if (!(envp = calloc(i + 5 + EXEC_MAX_ENV, sizeof(*envp))))
+        return false;
+    for (i = 0; environ[i]; ++i)
+        if (strncmp(environ[i], "FORKING_DAEMON_", 15) && strncmp(environ[i], "NOTIFY_SOCKET=", 14))
+            envp[envc++] = environ[i];
+
+    snprintf(vars[0], sizeof(vars[0]), "FORKING_DAEMON_SLOT=%d", id);
+    envp[envc++] = vars[0];
+    for (i = 0; i < n; ++i) {
+        snprintf(vars[i + 1], sizeof(vars[i + 1]), "FORKING_DAEMON_%s_FD=%d",
+                 to[i] == EXEC_LISTEN_FD ? "LISTEN" : to[i] == EXEC_STATS_FD ? "STATS" : "LOG",
+                 to[i]);
+        envp[envc++] = vars[i + 1];
+    }
+    for (i = 0; i < options.nenv; ++i) {
+        exec_expand(vars[4 + i], sizeof(vars[4 + i]), options.env[i], id);
+        envp[envc++] = vars[4 + i];
+    }
+    envp[envc] = NULL;
+
+    sigemptyset(&none);
+    start = now_ns();
+
+    if ((pid = vfork()) == 0) {
+        /* Move the descriptors in two steps, by way of numbers above all of
+         * them (and above 3 to 5), so that none is overwritten before it has
+         * been moved: the listening socket may well be fd 4 itself, say.
+         * dup2() clears close-on-exec on the copies. */
+        for (i = 0; i < n; ++i)
+            dup2(from[i], top + 1 + i);
+        for (i = 0; i < n; ++i) {
+            dup2(top + 1 + i, to[i]);
+            close(top + 1 + i);
+        }
+#ifdef SYS_close_range
+        /* and close whatever else might not be close-on-exec (Linux 5.9) */
+        syscall(SYS_close_range, EXEC_LOG_FD + 1, ~0U, 0);
+#endif
+
+        /* The dispositions of signals are our own, even now; the mask of
+         * trapped signals would carry over into the worker */
+        for (i = 0; i < sigcount; ++i)
+            signal(sigpairs[i].signal, SIG_DFL);
+        signal(SIGPIPE, SIG_DFL);
+        sigprocmask(SIG_SETMASK, &none, NULL);
+
+        /* as best it can, as a forked child does; we warn for it */
+        if (group_of(id) >= 0 && !group_enter(group_of(id)))
+            group_err = errno;
+
+        for (i = 0; i < options.nrlimits; ++i) {
+            struct rlimit rl = { options.rlimits[i].value, options.rlimits[i].value };
+
+            if (setrlimit(options.rlimits[i].resource, &rl) < 0) {
+                err = errno;
+                _exit(127);
+            }
+        }
+
+        execvpe(argv[0], argv, envp);
+        err = errno;
+        _exit(127);
+    }
+
+    free(envp);
+
+    if (pid < 0)
+        return false;
+
+    /* the child is gone already; don't leave it a zombie */
+    if (err) {
+        waitpid(pid, NULL, 0);
+        log_msg(LOG_ERROR, "Master: cannot run %s: %s", argv[0], strerror(err));
+        errno = err;
+        return false;
+    }
+    if (group_err)
+        log_msg(LOG_WARN, "Master: child(%d) cannot fully join group %s: %s", id,
+                options.groups[group_of(id)].name, strerror(group_err));
+
+    child_started(id, pid, start);
+    return true;
+}
+
+/* The life of a child process, listening on fd (if we are a server) */
+void worker(int id, int fd)
+{
+    struct sigaction sa;
+
+    /* Give our child a name, and a ring of its own to log to */
+    snprintf(process_name, 0xff, "forking-daemon: child(%d)", id);
+    log_attach(id);
+
+    /* Children processes are exact (almost) copies of the parent!
+     * Including signal traps! Our parent has a SIGTERM handler, and this child
+     * will dutifully execute the handler on SIGTERM unless we reset all
+     * signals back to their default handlers */
+    if (!trap_signals(false)) {
+        log_msg(LOG_ERROR, "Child %d: trap_signals() failed!", id);
+        exit(1);
+    }
+
+    /* a scraper must not be kept waiting for us to close its connection */
+    metrics_stop();
+    cluster_stop();
+
+    /* and with --balance, the listening socket is the master's alone */
+    if (options.balance && listenfd >= 0 && listenfd != fd) {
+        close(listenfd);
+        listenfd = -1;
+    }
+
+    /* Join our worker group, and move to our CPU (and memory node), before
+     * touching any memory */
+    if (group_of(id) >= 0 && !group_enter(group_of(id)))
+        log_msg(LOG_WARN, "Child %d: cannot fully join group %s: %s", id,
+                options.groups[group_of(id)].name, strerror(errno));
+    place_child(id);
+
+    stats_child(id);
+    if (!mem_init())
+        exit(1);
+    dispatch_child(id);
+
+    /* Servers and dispatch workers drain on SIGTERM: they finish the work they
+     * have, and exit. Without SA_RESTART, the signal also interrupts whatever
+     * they are blocked in, to let them know right away. */
+    if (options.listen[0] || options.dispatch) {
+        memset(&sa, 0, sizeof(sa));
+        sa.sa_handler = &start_draining;
+        sigaction(SIGTERM, &sa, NULL);
+    }
+
+    /* Serve connections, if we have been given an address to listen on */
+    if (options.listen[0])
+        exit(options.threads > 1 ? serve_threaded(id, fd) : serve(id, fd));
+
+    /* Or work on whatever the master hands us */
+    if (options.dispatch)
+        exit(dispatch_work(id));
+
+    /* Block, and randomly die.
+     * If you're on Linux, arc4random() is why you need to link to libbsd
+     * (because it works, and I'm lazy) */
+    worker_ready(id);
+    while (1) {
+        stats_tick();
+        arc4random_stir();
+        if (arc4random() % 20)
+            sleep(1);
+        else
+            break;
+    }
+
+    exit(0);
+}
+
+/* Populate our array of custom handler objects */
+void register_signals()
+{
+    int i = 0;
+
+    sigpairs[i].signal          = SIGINT;
+    sigpairs[i].handler         = &terminate_children;
+
+    sigpairs[++i].signal        = SIGTERM;
+    sigpairs[i].handler         = &terminate_children;
+
+    /* Like nginx, USR2 upgrades to a new binary without downtime */
+    sigpairs[++i].signal        = SIGUSR2;
+    sigpairs[i].handler         = &upgrade;
+
+    /* Like gunicorn, TTIN and TTOU add or remove a child */
+    sigpairs[++i].signal        = SIGTTIN;
+    sigpairs[i].handler         = &grow_pool;
+
+    sigpairs[++i].signal        = SIGTTOU;
+    sigpairs[i].handler         = &shrink_pool;
+
+    /* HUP reopens the logfile, once it has been rotated, and reloads the
+     * config file */
+    sigpairs[++i].signal        = SIGHUP;
+    sigpairs[i].handler         = &reload;
+
+    /* USR1 leaves the cluster, once the other nodes cover for us */
+    sigpairs[++i].signal        = SIGUSR1;
+    sigpairs[i].handler         = &cluster_leave;
+
+    /* Without pidfds, SIGCHLD is the only way to learn about dead children */
+    if (!use_pidfd) {
+        sigpairs[++i].signal    = SIGCHLD;
+        sigpairs[i].handler     = &restart_children;
+    }
+
+    /* setting sigcount now is easier than doing it dynamically */
+    sigcount = ++i;
+}
+
+/* When passed true, traps signals and routes them to the event loop, where
+ * the handlers defined in sigpairs[] are called.
+ * When passed false, resets all trapped signals back to their default behavior.
+ *
+ * Classic signal handlers interrupt the program at an arbitrary point, so they
+ * may only call async-signal-safe functions (which rules out printf() and
+ * malloc(), and makes fork() a gamble). Instead, we block the signals and have
+ * the kernel queue them for us: on Linux as reads from a signalfd(2), on the
+ * BSDs as EVFILT_SIGNAL events on a kqueue(2).
+ */
+int trap_signals(bool on)
+{
+    int         i;
+    sigset_t    set;
+    struct sigaction dfl;       /* the handler object */
+
+    memset(&dfl, 0, sizeof(dfl));
+    dfl.sa_handler = SIG_DFL;   /* for resetting to default behavior */
+
+    sigemptyset(&set);
+    for (i = 0; i < sigcount; ++i)
+        sigaddset(&set, sigpairs[i].signal);
+
+    if (!on) {
+        /* Children processes are exact (almost) copies of the parent,
+         * including the signal mask and the event loop descriptors. */
+        if (sigfd >= 0)
+            close(sigfd);
+        if (evfd >= 0)
+            close(evfd);
+        sigfd = evfd = -1;
+
+        for (i = 0; i < sigcount; ++i)
+            if (sigaction(sigpairs[i].signal, &dfl, NULL) < 0)
+                return false;
+
+        return sigprocmask(SIG_UNBLOCK, &set, NULL) == 0;
+    }
+
+#ifdef __linux__
+    struct epoll_event ev = { .events = EPOLLIN };
+
+    if (sigprocmask(SIG_BLOCK, &set, NULL) < 0)
+        return false;
+    if ((sigfd = signalfd(-1, &set, SFD_NONBLOCK|SFD_CLOEXEC)) < 0)
+        return false;
+
+    ev.data.u64 = (uint64_t)EVENT_SIGNAL << 32;
+    if (epoll_ctl(evfd, EPOLL_CTL_ADD, sigfd, &ev) < 0)
+        return false;
+#else
+    struct kevent kev;
+
+    /* kqueue records signals even when they are ignored, so ignore them
+     * rather than letting the default action kill us */
+    for (i = 0; i < sigcount; ++i) {
+        signal(sigpairs[i].signal, SIG_IGN);
+        EV_SET(&kev, sigpairs[i].signal, EVFILT_SIGNAL, EV_ADD, 0, 0, NULL);
+        if (kevent(evfd, &kev, 1, NULL, 0, NULL) < 0)
+            return false;
+    }
+#endif
+
+    return true;
+}
+
+/* Create the master's event loop.
+ *
+ * On Linux we use epoll(7), and probe for pidfd_open(2) (Linux 5.3), which
+ * hands us a file descriptor that becomes readable when a given process exits.
+ * Elsewhere, kqueue(2) can watch processes directly with EVFILT_PROC.
+ */
+bool ev_init()
+{
+#ifdef __linux__
+    int fd;
+
+    if ((evfd = epoll_create1(EPOLL_CLOEXEC)) < 0)
+        return false;
+
+#ifdef SYS_pidfd_open
+    if ((fd = syscall(SYS_pidfd_open, getpid(), 0)) >= 0) {
+        close(fd);
+        use_pidfd = true;
+    }
+#endif
+#else
+    if ((evfd = kqueue()) < 0)
+        return false;
+#endif
+
+    return true;
+}
+
+/* Ask the event loop to report the exit of child(id) as an EVENT_CHILD.
+ *
+ * Returns false if the child could not be watched because it has already
+ * exited; the caller should reap it.
+ */
+bool ev_watch_child(int id)
+{
+    return ev_watch_pid(slots.pid[id], EVENT_CHILD, id, &slots.pidfd[id]);
+}
+
+/* Ask the event loop to report the exit of process pid as an event of the
+ * given type and id. On Linux, *pidfd is set to the pidfd that is watched
+ * (or -1 if SIGCHLD has to do), which the caller is to close after reaping.
+ */
+bool ev_watch_pid(pid_t pid, int type, int id, int *pidfd)
+{
+    uint64_t tag = (uint64_t)type << 32 | (uint32_t)id;
+
+    *pidfd = -1;
+
+    if (!use_pidfd)
+        return true;    /* SIGCHLD will tell us */
+
+#ifdef __linux__
+    struct epoll_event ev = { .events = EPOLLIN, .data.u64 = tag };
+
+    if ((*pidfd = syscall(SYS_pidfd_open, pid, 0)) < 0) {
+        log_error("pidfd_open()");
+        return false;
+    }
+    fcntl(*pidfd, F_SETFD, FD_CLOEXEC);
+
+    if (epoll_ctl(evfd, EPOLL_CTL_ADD, *pidfd, &ev) < 0) {
+        log_error("epoll_ctl()");
+        close(*pidfd);
+        *pidfd = -1;
+        return false;
+    }
+#else
+    struct kevent kev;
+
+    EV_SET(&kev, pid, EVFILT_PROC, EV_ADD|EV_ONESHOT, NOTE_EXIT, 0, (void *)(intptr_t)tag);
+    if (kevent(evfd, &kev, 1, NULL, 0, NULL) < 0)
+        return false;
+#endif
+
+    return true;
+}
+
+/* Ask the event loop to report when fd is readable as an event of the given
+ * type, with the fd as its id. Closing the fd removes it from the loop.
+ *
+ * An exclusive watch on a descriptor shared between processes wakes only one
+ * of its waiters per event (EPOLLEXCLUSIVE, Linux 4.5), rather than the whole
+ * herd of them.
+ */
+bool ev_watch_fd(int fd, int type, bool exclusive)
+{
+    uint64_t tag = (uint64_t)type << 32 | (uint32_t)fd;
+
+#ifdef __linux__
+    struct epoll_event ev = { .events = EPOLLIN, .data.u64 = tag };
+
+#ifdef EPOLLEXCLUSIVE
+    if (exclusive) {
+        ev.events |= EPOLLEXCLUSIVE;
+        if (epoll_ctl(evfd, EPOLL_CTL_ADD, fd, &ev) == 0)
+            return true;
+        ev.events &= ~EPOLLEXCLUSIVE;   /* older kernel; take the herd */
+    }
+#endif
+
+    return epoll_ctl(evfd, EPOLL_CTL_ADD, fd, &ev) == 0;
+#else
+    struct kevent kev;
+
+    EV_SET(&kev, fd, EVFILT_READ, EV_ADD, 0, 0, (void *)(intptr_t)tag);
+    return kevent(evfd, &kev, 1, NULL, 0, NULL) == 0;
+#endif
+}
+
+/* Ask the event loop to report when fd (already watched by ev_watch_fd()) is
+ * writable instead, as an event of the given type with the fd as its id */
+bool ev_watch_write(int fd, int type)
+{
+    uint64_t tag = (uint64_t)type << 32 | (uint32_t)fd;
+
+#ifdef __linux__
+    struct epoll_event ev = { .events = EPOLLOUT, .data.u64 = tag };
+
+    return epoll_ctl(evfd, EPOLL_CTL_MOD, fd, &ev) == 0;
+#else
+    struct kevent kev[2];
+
+    EV_SET(&kev[0], fd, EVFILT_READ, EV_DELETE, 0, 0, NULL);
+    EV_SET(&kev[1], fd, EVFILT_WRITE, EV_ADD, 0, 0, (void *)(intptr_t)tag);
+    return kevent(evfd, kev, 2, NULL, 0, NULL) == 0;
+#endif
+}
+
+/* Stop watching fd, without closing it (which only takes it out of the loop
+ * once every descriptor for the file is gone, in every process) */
+void ev_unwatch_fd(int fd)
+{
+#ifdef __linux__
+    epoll_ctl(evfd, EPOLL_CTL_DEL, fd, NULL);
+#else
+    struct kevent kev;
+
+    EV_SET(&kev, fd, EVFILT_READ, EV_DELETE, 0, 0, NULL);
+    kevent(evfd, &kev, 1, NULL, 0, NULL);
+#endif
+}
+
+/* Wait up to timeout milliseconds (-1 for forever) for events, and store up to
+ * max of them in events[]. Returns the number of events, or -1 on error.
+ */
+int ev_wait(event_t *events, int max, int timeout)
+{
+    int i, n, count = 0;
+
+#ifdef __linux__
+    struct epoll_event      ep[64];
+    struct signalfd_siginfo si;
+    uint64_t                tag;
+
+    if (max > 64)
+        max = 64;
+
+    if ((n = epoll_wait(evfd, ep, max, timeout)) < 0)
+        return errno == EINTR ? 0 : -1;
+
+    for (i = 0; i < n; ++i) {
+        tag = ep[i].data.u64;
+        events[count].type = tag >> 32;
+        events[count].id   = (uint32_t)tag;
+
+        /* signalfd is level triggered, so read one signal at a time; any
+         * others will be reported by the next epoll_wait() */
+        if (events[count].type == EVENT_SIGNAL) {
+            if (read(sigfd, &si, sizeof(si)) != sizeof(si))
+                continue;
+            events[count].id = si.ssi_signo;
+        }
+
+        ++count;
+    }
+#else
+    struct kevent   kev[64];
+    struct timespec ts, *tsp = NULL;
+
+    if (max > 64)
+        max = 64;
+
+    if (timeout >= 0) {
+        ts.tv_sec  = timeout / 1000;
+        ts.tv_nsec = (timeout % 1000) * 1000000;
+        tsp = &ts;
+    }
+
+    if ((n = kevent(evfd, NULL, 0, kev, max, tsp)) < 0)
+        return errno == EINTR ? 0 : -1;
+
+    for (i = 0; i < n; ++i) {
+        if (kev[i].filter == EVFILT_SIGNAL) {
+            events[count].type = EVENT_SIGNAL;
+            events[count].id   = kev[i].ident;
+        } else {
+            events[count].type = (uint64_t)(intptr_t)kev[i].udata >> 32;
+            events[count].id   = (uint32_t)(intptr_t)kev[i].udata;
+        }
+        ++count;
+    }
+#endif
+
+    return count;
+}
+
+/* Master's SIGCHLD handler, used when pidfds are not available.
+ *
+ * When a process is fork()ed by a process, the new process is an exact copy
+ * of the old process, except for a few values, one of which is that the parent
+ * pid of the child is that of the process that forked it.
+ *
+ * When this child exits, the signal SIGCHLD is sent to the parent process to
+ * alert it. By default, the signal is ignored, but we can take this opportunity
+ * to restart any children that have died.
+ *
+ * There are many ways to determine which children have died, but the most
+ * portable method is to use the wait() family of system calls.
+ *
+ * A dead child process releases its memory, but sticks around so that any
+ * interested parties can determine how they died (exit status). Calling wait()
+ * in the master collects the status of the first available dead process, and
+ * removes it from the process table.
+ *
+ * If wait() is never called by the parent, the dead child sticks around as a
+ * "zombie" process, marked with status `Z' in ps output. If the parent process
+ * exits without ever calling wait, the zombie process does not disappear, but
+ * is inherited by the root process (its parent pid is set to 1).
+ *
+ * Because pending signals are coalesced, many children dying simultaneously
+ * may produce a single SIGCHLD. Rather than polling every known child, we ask
+ * waitpid(-1, ..., WNOHANG) for dead children until it has no more to give,
+ * so the work done is proportional to the number of children that died.
+ */
+void restart_children()
+{
+    int     id, status;
+    pid_t   pid;
+
+    while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+        if ((id = slots_find(pid)) >= 0) {
+            restart_child(id, pid, status);
+        } else if (pid == upgrade_pid) {
+            upgrade_reap();
+        } else if (zygote_fd >= 0 && pid != zygote_pid) {
+            /* most likely a child of the zygote, whose reply is on its way */
+            unclaimed_pid[unclaimed % UNCLAIMED]    = pid;
+            unclaimed_status[unclaimed % UNCLAIMED] = status;
+            unclaimed++;
+        }
+    }
+}
+
+/* Take pid off the list of unclaimed dead, if it is there. Returns whether it
+ * was, with its status in *status. */
+bool reaped_early(pid_t pid, int *status)
+{
+    int i;
+
+    for (i = 0; i < UNCLAIMED && i < unclaimed; ++i)
+        if (unclaimed_pid[i] == pid) {
+            unclaimed_pid[i] = 0;
+            *status = unclaimed_status[i];
+            return true;
+        }
+
+    return false;
+}
+
+/* Reap child(id) after the event loop has reported its exit */
+void reap_child(int id)
+{
+    int     status;
+    pid_t   pid;
+
+    if (slots.pid[id] <= 0)
+        return;
+
+    pid = waitpid(slots.pid[id], &status, WNOHANG); /* non-blocking! */
+
+    if (pid < 0) {
+        log_error("waitpid()");
+    } else if (pid > 0) {
+        restart_child(id, pid, status);
+    }
+}
+
+/* Relaunch a particular child that has been reaped, unless it was retired */
+void restart_child(int id, pid_t pid, int status)
+{
+    uint64_t t = phase_sampled() ? ticks() : 0;
+
+    TRACE(reap, id, pid, status);
+    if (slots.state[id] == SLOT_DRAINING || slots.state[id] == SLOT_RETIRING)
+        TRACE(drain__end, id, pid);
+
+    if (slots.pidfd[id] >= 0) {
+        close(slots.pidfd[id]); /* also removes it from the epoll set */
+        slots.pidfd[id] = -1;
+    }
+
+    slots_unindex(pid);
+    slots.pid[id]    = 0;
+    slots.status[id] = status;
+    slots.live--;
+    if (slots.chan[id] >= 0)
+        balance_close(id);
+    if (stats.header && id < (int)stats.header->slots)
+        __atomic_store_n(&stats_slot(id)->reaped, now_ns(), __ATOMIC_RELAXED);
+    stats_publish(id);
+    timer_cancel(TIMER_HEARTBEAT, id);
+    timer_cancel(TIMER_DRAIN, id);
+
+    log_msg(LOG_INFO, "Master: reaped dead child(%d) [pid %d]", id, pid);
+
+    if (shutting_down) {
+        set_state(id, SLOT_EMPTY);
+        if (!slots.live)
+            finish_shutdown();
+        return;
+    }
+
+    /* a stand-in that died on the job is not replaced; the recycling of the
+     * child it stood in for carries on without it */
+    if (slots.cover[id] >= 0) {
+        end_rotation(id);
+        set_state(id, SLOT_RETIRING);
+    }
+
+    if (slots.state[id] == SLOT_RETIRING) {
+        /* stop the kernel from queueing connections for this slot */
+        if (slots.lfd[id] >= 0) {
+            close(slots.lfd[id]);
+            slots.lfd[id] = -1;
+        }
+        set_state(id, SLOT_EMPTY);
+        return;
+    }
+
+    /* the spawn is part of the respawn, and shares its sample */
+    respawn_sample = t != 0;
+
+    /* a drained child did not fail, however young it was */
+    if (slots.state[id] == SLOT_DRAINING) {
+        slots.failures[id] = 0;
+        restart_slot(id);
+    } else {
+        schedule_restart(id);
+    }
+    respawn_sample = -1;
+
+    if (t)
+        phase_add(PHASE_RESPAWN, ticks() - t);
+}
+
+/* Move a slot to a new state, and let the stats segment know.
+ *
+ * A child is warm from when it is asked of the zygote (or spawned) until
+ * ready_check() hears that it is ready. Only child_started() makes a slot
+ * SLOT_RUNNING, so that is always a new child; in any other state, a child is
+ * in no position to be ready. */
+void set_state(int id, int state)
+{
+    bool warm = state == SLOT_STARTING || state == SLOT_RUNNING;
+
+    if (warm && !slots.warm[id]) {
+        slots.warm[id] = true;
+        if (!slots.warming++)
+            timer_set(TIMER_READY, -1, now_ms() + READY_POLL);
+    } else if (!warm && slots.warm[id]) {
+        slots.warm[id] = false;
+        slots.warming--;
+    }
+
+    slots.state[id] = state;
+    stats_publish(id);
+}
+
+/* Decide when to restart a slot whose child has died.
+ *
+ * A child that dies right after being spawned will most likely do it again,
+ * and restarting it right away just burns a core on fork() and floods the log.
+ * So a child that dies within min_uptime counts as a failure, and each failure
+ * in a row doubles the wait before the next restart, up to backoff_max. A
+ * little randomness (jitter) keeps slots that failed together from being
+ * restarted together.
+ *
+ * After crash_limit failures in a row, the slot is parked: the circuit breaker
+ * trips, and we leave it alone for park_time before trying once more.
+ */
+void schedule_restart(int id)
+{
+    uint64_t    now = now_ms(), delay;
+    int         shift;
+
+    if (now - slots.started[id] >= (uint64_t)options.min_uptime) {
+        slots.failures[id] = 0;
+        restart_slot(id);
+        return;
+    }
+
+    if (slots.failures[id] < UINT16_MAX)
+        slots.failures[id]++;
+
+    if (options.crash_limit && slots.failures[id] >= options.crash_limit) {
+        log_msg(LOG_WARN, "Master: child(%d) failed %d times in a row, parking it for %dms",
+                id, slots.failures[id], options.park_time);
+        set_state(id, SLOT_PARKED);
+        timer_set(TIMER_RESTART, id, now + options.park_time);
+        stats_backoff(id, options.park_time);
+        return;
+    }
+
+    shift = slots.failures[id] - 1;
+    delay = (uint64_t)options.backoff_base << (shift < 32 ? shift : 32);
+    if (delay > (uint64_t)options.backoff_max)
+        delay = options.backoff_max;
+
+    /* somewhere from half the delay to all of it */
+    delay = delay / 2 + arc4random_uniform(delay / 2 + 1);
+
+    set_state(id, SLOT_BACKOFF);
+    timer_set(TIMER_RESTART, id, now + delay);
+    stats_backoff(id, delay);
+}
+
+/* Restart a slot right now, if the restart budget allows it; otherwise wait
+ * for the next restart window.
+ */
+void restart_slot(int id)
+{
+    uint64_t now = now_ms();
+
+    if (options.restart_budget) {
+        if (now - budget_start >= (uint64_t)options.restart_window) {
+            budget_start = now;
+            budget_used  = 0;
+        }
+
+        if (budget_used >= options.restart_budget) {
+            set_state(id, SLOT_BACKOFF);
+            timer_set(TIMER_RESTART, id, budget_start + options.restart_window);
+            return;
+        }
+
+        budget_used++;
+    }
+
+    set_state(id, SLOT_EMPTY);
+    slots.restarts[id]++;
+
+    /* failing to fork is as good as dying young */
+    if (!child(id)) {
+        log_error("child()");
+        slots.started[id] = now;
+        schedule_restart(id);
+    }
+}
+
+/* Grow the child table to hold size slots.
+ *
+ * Slots are never moved, only added at the end, so a child's id is stable
+ * for its lifetime; nor is the table ever shrunk: a smaller pool just leaves
+ * the slots beyond it empty, for next time. The hash index is rebuilt at
+ * twice the table size, which keeps the probe sequences short.
+ */
+bool slots_resize(int size)
+{
+    int     i, old = slots.size, hsize = 16, *hslot;
+    pid_t * hpid;
+    void *  p;
+
+#define SLOTS_REALLOC(field) \
+    if (!(p = realloc(slots.field, size * sizeof(*slots.field)))) \
+        return false; \
+    slots.field = p;
+
+    if (size > old) {
+        SLOTS_REALLOC(pid);
+        SLOTS_REALLOC(state);
+        SLOTS_REALLOC(restarts);
+        SLOTS_REALLOC(status);
+        SLOTS_REALLOC(pidfd);
+        SLOTS_REALLOC(lfd);
+        SLOTS_REALLOC(chan);
+        SLOTS_REALLOC(handed);
+        SLOTS_REALLOC(balked);
+        SLOTS_REALLOC(started);
+        SLOTS_REALLOC(failures);
+        SLOTS_REALLOC(busy);
+        SLOTS_REALLOC(cover);
+        SLOTS_REALLOC(stale);
+        SLOTS_REALLOC(warm);
+        SLOTS_REALLOC(spawn_ticks);
+
+        for (i = old; i < size; ++i) {
+            slots.pid[i]      = 0;
+            slots.state[i]    = SLOT_EMPTY;
+            slots.restarts[i] = 0;
+            slots.status[i]   = 0;
+            slots.pidfd[i]    = -1;
+            slots.lfd[i]      = -1;
+            slots.chan[i]     = -1;
+            slots.handed[i]   = 0;
+            slots.balked[i]   = 0;
+            slots.started[i]  = 0;
+            slots.failures[i] = 0;
+            slots.busy[i]     = 0;
+            slots.cover[i]    = -1;
+            slots.stale[i]    = false;
+            slots.warm[i]     = false;
+            slots.spawn_ticks[i] = 0;
+        }
+    }
+#undef SLOTS_REALLOC
+
+    slots.size = size;
+
+    if (!wheel_resize((size + 1) * TIMER_KINDS))
+        return false;
+
+    if (stats.header && !stats_map(size))
+        return false;
+
+    if (dispatch.header && !dispatch_map(size))
+        return false;
+
+    log_resize(size);
+
+    while (hsize < 2 * size)
+        hsize <<= 1;
+
+    if (hsize > slots.hsize) {
+        /* the old index stays as it is, unless there is a new one */
+        hpid  = calloc(hsize, sizeof(*hpid));
+        hslot = calloc(hsize, sizeof(*hslot));
+        if (!hpid || !hslot) {
+            free(hpid);
+            free(hslot);
+            return false;
+        }
+        free(slots.hpid);
+        free(slots.hslot);
+        slots.hsize = hsize;
+        slots.hpid  = hpid;
+        slots.hslot = hslot;
+
+        for (i = 0; i < size; ++i)
+            if (slots.pid[i] > 0)
+                slots_index(slots.pid[i], i);
+    }
+
+    return true;
+}
+
+/* Bucket to start probing from for a given pid (Fibonacci hashing) */
+static inline int slots_hash(pid_t pid)
+{
+    return ((uint32_t)pid * 2654435769u) & (slots.hsize - 1);
+}
+
+/* Record that pid lives in slot id */
+void slots_index(pid_t pid, int id)
+{
+    int h = slots_hash(pid);
+
+    /* linear probing: walk forward to the first free bucket */
+    while (slots.hpid[h])
+        h = (h + 1) & (slots.hsize - 1);
+
+    slots.hpid[h]  = pid;
+    slots.hslot[h] = id;
+}
+
+/* Forget about pid.
+ *
+ * Simply emptying the bucket would break the probe sequence of any pid that
+ * was pushed past it, so entries after the hole are shifted back into it.
+ */
+void slots_unindex(pid_t pid)
+{
+    int h = slots_hash(pid), next, home, mask = slots.hsize - 1;
+
+    while (slots.hpid[h] != pid) {
+        if (!slots.hpid[h])
+            return;
+        h = (h + 1) & mask;
+    }
+
+    for (next = (h + 1) & mask; slots.hpid[next]; next = (next + 1) & mask) {
+        home = slots_hash(slots.hpid[next]);
+
+        /* move the entry back only if the hole lies on its probe path */
+        if (((next - home) & mask) >= ((next - h) & mask)) {
+            slots.hpid[h]  = slots.hpid[next];
+            slots.hslot[h] = slots.hslot[next];
+            h = next;
+        }
+    }
+
+    slots.hpid[h] = 0;
+}
+
+/* Returns the slot of pid, or -1 if it is not one of our children */
+int slots_find(pid_t pid)
+{
+    int h = slots_hash(pid);
+
+    while (slots.hpid[h]) {
+        if (slots.hpid[h] == pid)
+            return slots.hslot[h];
+        h = (h + 1) & (slots.hsize - 1);
+    }
+
+    return -1;
+}
+
+/* Change the number of children to jobs.
+ *
+ * New slots get a fresh child right away. Slots past the new end are told to
+ * exit, and are released once they have been reaped.
+ */
+bool pool_resize(int jobs)
+{
+    int i;
+
+    if (jobs < 1 || jobs > MAX_JOBS)
+        return false;
+
+    if (jobs > slots.size && !slots_resize(jobs))
+        return false;
+
+    options.jobs = jobs;
+
+    for (i = 0; i < slots.size; ++i) {
+        /* A stand-in for a child that is being recycled leaves on its own,
+         * unless that child is no longer wanted; one that finds itself in
+         * the pool is just part of it now. */
+        if (slots.cover[i] >= 0 && (i < jobs || slots.cover[i] >= jobs))
+            end_rotation(i);
+        else if (slots.cover[i] >= 0)
+            continue;
+
+        if (i < jobs) {
+            /* a retiring child in a slot we want back is replaced instead */
+            if (slots.state[i] == SLOT_RETIRING)
+                set_state(i, SLOT_DRAINING);
+        } else if (slots.state[i] == SLOT_RUNNING || slots.state[i] == SLOT_DRAINING) {
+            log_msg(LOG_INFO, "Master: retiring child(%d) [pid %d]", i, slots.pid[i]);
+            drain_slot(i, false);
+        } else if (slots.state[i] == SLOT_BACKOFF || slots.state[i] == SLOT_PARKED) {
+            timer_cancel(TIMER_RESTART, i);
+            set_state(i, SLOT_EMPTY);
+        }
+    }
+
+    /* and the empty slots are filled, as fast as we may */
+    return spawn_pending();
+}
+
+/* Spawn children in the empty slots of the pool.
+ *
+ * Forking a thousand children at once is quick enough, but then they all
+ * warm up at once, and fight over memory bandwidth (and the CPUs, and
+ * whatever they load at startup) until the last of them is done. With
+ * --spawn-parallel, at most so many children are starting up at a time, and
+ * the next is spawned as soon as one of them is ready; with --spawn-stagger,
+ * spawns are at least so far apart. Whatever is left is held for the event
+ * loop, which calls us again as children come up, or with TIMER_SPAWN.
+ *
+ * Children respawned after a crash, and stand-ins for recycling, are not held
+ * up: those are few at a time already.
+ */
+bool spawn_pending()
+{
+    int         i;
+    uint64_t    now = now_ms();
+
+    spawn_held = false;
+    if (shutting_down)
+        return true;
+
+    for (i = 0; i < options.jobs && i < slots.size; ++i) {
+        if (slots.state[i] != SLOT_EMPTY)
+            continue;
+
+        if (options.spawn_parallel && slots.warming >= options.spawn_parallel) {
+            spawn_held = true;
+            return true;
+        }
+        if (options.spawn_stagger && now < spawn_last + options.spawn_stagger) {
+            spawn_held = true;
+            timer_set(TIMER_SPAWN, -1, spawn_last + options.spawn_stagger);
+            return true;
+        }
+
+        if (!child(i))
+            return false;
+        spawn_last = now;
+    }
+
+    return true;
+}
+
+/* SIGTTIN: add a child to the pool */
+void grow_pool()
+{
+    if (!pool_resize(options.jobs + 1))
+        log_msg(LOG_WARN, "Master: could not grow pool to %d", options.jobs + 1);
+}
+
+/* SIGTTOU: remove a child from the pool */
+void shrink_pool()
+{
+    if (options.jobs > 1)
+        pool_resize(options.jobs - 1);
+}
+
+/* Open the doorbell children ring once they are ready for work: an eventfd
+ * on Linux, or a pipe, as in dispatch_create(). It is there before the zygote
+ * is, so that the zygote's children can ring it too. */
+bool ready_init()
+{
+    int i;
+
+#ifdef __linux__
+    if ((ready_bell[0] = ready_bell[1] = eventfd(0, 0)) < 0) {
+#else
+    if (pipe(ready_bell) < 0) {
+#endif
+        log_error("ready_init()");
+        return false;
+    }
+    for (i = 0; i < 2; ++i) {
+        fcntl(ready_bell[i], F_SETFL, fcntl(ready_bell[i], F_GETFL) | O_NONBLOCK);
+        fcntl(ready_bell[i], F_SETFD, FD_CLOEXEC);
+    }
+
+    return ev_watch_fd(ready_bell[0], EVENT_READY, false);
+}
+
+/* EVENT_READY, TIMER_READY: see which of the warm children are ready.
+ *
+ * The stats record of a child says when it was last spawned, and when it was
+ * ready: it is ready once the one comes after the other. worker_ready() sees
+ * to that, and rings the doorbell, so that we hear of it right away; an --exec
+ * worker (like bench-worker) only updates its record, and is looked at every
+ * READY_POLL ms. One that still hasn't said anything after READY_TIMEOUT
+ * likely never will, and is taken to be ready, so as not to hold up the rest.
+ */
+void ready_check()
+{
+    uint64_t        junk, now = now_ms();
+    stats_slot_t *  rec;
+    int             i, up = 0;
+
+    /* an eventfd is reset by a single read; a pipe takes a few */
+    while (read(ready_bell[0], &junk, sizeof(junk)) > 0)
+        ;
+
+    for (i = 0; i < slots.size && slots.warming; ++i) {
+        if (!slots.warm[i] || slots.pid[i] <= 0 || i >= (int)stats.header->slots)
+            continue;
+
+        rec = stats_slot(i);
+        if (__atomic_load_n(&rec->ready, __ATOMIC_RELAXED) <
+            __atomic_load_n(&rec->spawned, __ATOMIC_RELAXED)) {
+            if (now - slots.started[i] < READY_TIMEOUT)
+                continue;
+            log_msg(LOG_WARN, "Master: child(%d) [pid %d] not ready after %dms, taking it to be",
+                    i, slots.pid[i], READY_TIMEOUT);
+        }
+
+        slots.warm[i] = false;
+        slots.warming--;
+    }
+
+    /* with --balance, we accept connections once there is a child to take
+     * them */
+    if (options.balance && !balance_watching && !shutting_down)
+        balance_watch(true);
+
+    if (pool_up)
+        return;
+
+    for (i = 0; i < options.jobs && i < slots.size; ++i)
+        up += slots.state[i] == SLOT_RUNNING && slots.pid[i] > 0 && !slots.warm[i];
+
+    if (up * 100 >= options.jobs * options.ready_percent)
+        pool_ready(up);
+}
+
+/* The pool is up: --ready-percent of its children are ready for work.
+ *
+ * Until now, a service manager should not count on us, and neither should an
+ * old master we are upgrading it from: only now do we tell systemd (with our
+ * pid, which is new, if this is an upgrade), and the old master that it can
+ * go. A new master whose children never come up leaves the old one be.
+ */
+void pool_ready(int up)
+{
+    char *  p, *end;
+    long    old;
+
+    pool_up = true;
+    log_msg(LOG_INFO, "Master: pool ready, %d of %d children up after %llums",
+            up, options.jobs, (unsigned long long)(now_ms() - pool_start));
+    notify("READY=1\nMAINPID=%d\nSTATUS=%d of %d children ready", getpid(), up, options.jobs);
+
+    /* The old master is the one that started us. Anything else in there
+     * (garbage would make atoi() say 0, and kill(0) signal our own process
+     * group) is nobody we should be killing. */
+    if ((p = getenv("FORKING_DAEMON_PARENT"))) {
+        old = strtol(p, &end, 10);
+        if (*p && !*end && old > 1 && old == getppid()) {
+            log_msg(LOG_INFO, "Master: taking over from old master [pid %ld]", old);
+            kill(old, SIGTERM);
+        } else {
+            log_msg(LOG_WARN, "Master: FORKING_DAEMON_PARENT=%s is not our parent, leaving it be", p);
+        }
+        unsetenv("FORKING_DAEMON_PARENT");
+    }
+}
+
+/* Tell the service manager how we are, as sd_notify(3) does, without linking
+ * libsystemd for it: a datagram of NAME=VALUE lines to the unix socket named
+ * by NOTIFY_SOCKET (in the abstract namespace if it starts with @). Without
+ * one, nobody is listening, and this does nothing. */
+void __attribute__((format(printf, 1, 2))) notify(const char *fmt, ...)
+{
+    const char *        path = getenv("NOTIFY_SOCKET");
+    struct sockaddr_un  addr;
+    char                msg[0x200];
+    va_list             ap;
+    int                 fd, len;
+
+    if (!path || (path[0] != '/' && path[0] != '@') || strlen(path) >= sizeof(addr.sun_path))
+        return;
+
+    va_start(ap, fmt);
+    len = vsnprintf(msg, sizeof(msg), fmt, ap);
+    va_end(ap);
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    if (path[0] == '@')
+        addr.sun_path[0] = '\0';
+
+    if ((fd = socket(AF_UNIX, SOCK_DGRAM|SOCK_CLOEXEC, 0)) < 0)
+        return;
+    if (sendto(fd, msg, len < (int)sizeof(msg) ? len : (int)sizeof(msg) - 1, MSG_NOSIGNAL,
+               (struct sockaddr *)&addr, offsetof(struct sockaddr_un, sun_path) + strlen(path)) < 0)
+        log_error("notify()");
+    close(fd);
+}
+
+/* Mark the children of slots first to last - 1 as spawned under an old
+ * configuration, for recycle_children() to replace */
+static void mark_stale(int first, int last)
+{
+    int i;
+
+    for (i = first; i < last && i < slots.size; ++i)
+        if (slots.pid[i] > 0 && slots.state[i] == SLOT_RUNNING)
+            slots.stale[i] = true;
+}
+
+/* Does the zygote, which has the options we run with, still make the
+ * children next describes? Its children take from it their CPUs (the master
+ * works them out afresh, but the zygote has its own copy), their group's nice
+ * level, policy and CPUs, --phase-sample, --coroutines and --drain-timeout.
+ * (--exec, its environment and limits don't go with --zygote.) */
+static bool zygote_current(const options_t *next)
+{
+    int g;
+
+    if (next->affinity != options.affinity || strcmp(next->cpulist, options.cpulist) ||
+        next->numa != options.numa || next->phase_sample != options.phase_sample ||
+        next->coroutines != options.coroutines || next->drain_timeout != options.drain_timeout)
+        return false;
+
+    for (g = 0; g < options.ngroups; ++g)
+        if (next->groups[g].nice != options.groups[g].nice ||
+            next->groups[g].policy != options.groups[g].policy ||
+            next->groups[g].priority != options.groups[g].priority ||
+            strcmp(next->groups[g].cpus, options.groups[g].cpus))
+            return false;
+
+    return true;
+}
+
+/* SIGHUP: reopen the logfile, and reload the config file, if there is one.
+ *
+ * The options are read again just as they were at startup (the defaults, the
+ * file, the command line), and compared with those we are running with. Only
+ * what has changed is acted on:
+ *
+ *   - restart policy, timeouts, limits: the master simply uses the new values
+ *   - the size of the pool: resized, which forks (or retires) the difference
+ *   - anything a child is made of (its CPUs, its group's nice level, policy or
+ *     CPUs, --exec and its environment and limits, --phase-sample): just the
+ *     children affected are recycled, a few at a time and each replaced before
+ *     it goes, as in recycle_children(); a zygote that would give its
+ *     children any of the old ones (see zygote_current()) is replaced first
+ *   - a group's cgroup limits: written to its cgroup, with nobody respawned
+ *
+ * Whatever the master has built itself around (its sockets, the I/O engine,
+ * dispatch, the stats segment, the worker groups themselves) takes an upgrade
+ * (SIGUSR2), which reads the file afresh anyway; until then, the old values
+ * stay. A file with anything wrong with it changes nothing at all.
+ */
+void reload()
+{
+    static options_t    next;
+    int                 argc, g, first, jobs;
+    bool                respawn = false, scaling, same, rezygote;
+    char                dir[PATH_MAX];
+    uint64_t            now = now_ms();
+
+    if (!options.config[0] || shutting_down) {
+        log_reopen();
+        return;
+    }
+
+    for (argc = 0; exec_argv[argc]; ++argc)
+        ;
+    if (!options_read(&next, argc, exec_argv, true)) {
+        log_msg(LOG_ERROR, "Master: %s has errors, keeping the configuration we have",
+                options.config);
+        return;
+    }
+
+    /* what only an upgrade can change */
+#define KEEP(field, name) \
+    if (memcmp(&next.field, &options.field, sizeof(next.field))) { \
+        log_msg(LOG_WARN, "Master: " name " changed, which takes an upgrade (SIGUSR2)"); \
+        memcpy(&next.field, &options.field, sizeof(next.field)); \
+    }
+    /* (the stats segment is named after the master, unless it was named) */
+    if (!next.stats[0])
+        strcpy(next.stats, options.stats);
+    KEEP(daemonize, "--daemonize");
+    KEEP(listen, "--listen");
+    KEEP(reuseport, "--reuseport");
+    KEEP(zygote, "--zygote");
+    KEEP(stats, "--stats");
+    KEEP(metrics, "--metrics");
+    KEEP(dispatch, "--dispatch");
+    KEEP(steal, "--steal");
+    KEEP(warmup, "--warmup");
+    KEEP(hugepages, "--hugepages");
+    KEEP(io_uring, "--io-uring");
+    KEEP(herd, "--herd");
+    KEEP(balance, "--balance");
+    KEEP(threads, "--threads");
+    KEEP(cluster, "--cluster");
+    KEEP(peers, "--peer");
+    KEEP(coordinator, "--coordinator");
+    next.npeers = options.npeers;
+
+    /* the groups make up the pool, in order; what each group is can change,
+     * but not which groups there are, or their sizes */
+    same = next.ngroups == options.ngroups;
+    for (g = 0; same && g < next.ngroups; ++g)
+        same = !strcmp(next.groups[g].name, options.groups[g].name) &&
+               next.groups[g].count == options.groups[g].count;
+    if (!same) {
+        log_msg(LOG_WARN, "Master: the worker groups changed, which takes an upgrade (SIGUSR2)");
+        memcpy(next.groups, options.groups, sizeof(next.groups));
+        next.ngroups = options.ngroups;
+        next.jobs    = options.jobs;
+    }
+#undef KEEP
+
+    /* what is left must still make sense with what we kept */
+    if (!options_check(&next)) {
+        log_msg(LOG_ERROR, "Master: %s doesn't go with the running configuration, keeping it",
+                options.config);
+        return;
+    }
+
+    /* An autoscaled pool stays the size it has grown to, within the new
+     * bounds, rather than going back to --jobs; and whatever we run for
+     * drained nodes of the cluster comes on top */
+    jobs = next.jobs;
+    if (next.max_jobs && options.max_jobs) {
+        jobs = options.jobs - cluster_cover;
+        jobs = jobs < next.min_jobs ? next.min_jobs : jobs > next.max_jobs ? next.max_jobs : jobs;
+    }
+    jobs += cluster_cover;
+
+    /* what the children are made of */
+    if (next.affinity != options.affinity || strcmp(next.cpulist, options.cpulist) ||
+        next.numa != options.numa || strcmp(next.exec, options.exec) ||
+        next.nenv != options.nenv || memcmp(next.env, options.env, sizeof(next.env)) ||
+        next.nrlimits != options.nrlimits ||
+        memcmp(next.rlimits, options.rlimits, sizeof(next.rlimits)) ||
+        next.phase_sample != options.phase_sample || next.coroutines != options.coroutines) {
+        mark_stale(0, options.jobs);
+        respawn = true;
+    }
+
+    for (g = first = 0; g < options.ngroups; first += options.groups[g++].count) {
+        const group_t *old = &options.groups[g], *grp = &next.groups[g];
+
+        if (grp->nice != old->nice || grp->policy != old->policy ||
+            grp->priority != old->priority || strcmp(grp->cpus, old->cpus)) {
+            mark_stale(first, first + grp->count);
+            respawn = true;
+        }
+        if (group_procs[g]) {
+            snprintf(dir, sizeof(dir), "%s", group_procs[g]);
+            *strrchr(dir, '/') = '\0';
+            group_limits(dir, grp, old);
+        }
+    }
+
+    /* the children that have been with us all along hear of a new hang
+     * timeout with their next heartbeat check; unless they had none */
+    if (next.hang_timeout != options.hang_timeout && (!next.hang_timeout || !options.hang_timeout))
+        for (g = 0; g < slots.size; ++g) {
+            timer_cancel(TIMER_HEARTBEAT, g);
+            if (next.hang_timeout && slots.state[g] == SLOT_RUNNING && slots.pid[g] > 0)
+                timer_set(TIMER_HEARTBEAT, g, now + next.hang_timeout);
+        }
+
+    log_msg(LOG_INFO, "Master: reloaded %s", options.config);
+    rezygote = zygote_fd >= 0 && !zygote_current(&next);
+
+    /* From here on, the new options are the options (but for the size of
+     * the pool, which pool_resize() sees to) */
+    scaling   = options.max_jobs;
+    next.jobs = options.jobs;
+    options   = next;
+    log_reopen();
+
+    for (g = 0; g < options.ngroups; ++g)
+        group_cpuset(g);
+    free(cpus);
+    cpus  = NULL;
+    ncpus = 0;
+    if (!placement_init())
+        log_msg(LOG_WARN, "Master: cannot place children with the new --cpu-affinity");
+
+    /* A new zygote is forked from the master as it is now, with its tables,
+     * arenas and grown child table, rather than as small as the first one
+     * was: so the zygote we have stays, unless its children would not be
+     * what the new options make them */
+    if (rezygote) {
+        log_msg(LOG_INFO, "Master: replacing the zygote, which has the old options");
+        zygote_stop();
+        if (!zygote_start())
+            log_msg(LOG_ERROR, "Master: zygote_start() failed!");
+    }
+
+    if (jobs != options.jobs) {
+        log_msg(LOG_INFO, "Master: resizing pool from %d to %d children", options.jobs, jobs);
+        if (!pool_resize(jobs))
+            log_msg(LOG_WARN, "Master: could not resize pool to %d", jobs);
+    }
+
+    if (options.max_jobs && !scaling) {
+        scale_sampled = now_ns();
+        timer_set(TIMER_SCALE, -1, now + SCALE_INTERVAL);
+    } else if (!options.max_jobs) {
+        timer_cancel(TIMER_SCALE, -1);
+    }
+
+    if (respawn || options.max_requests || options.max_rss || options.max_age)
+        timer_set(TIMER_RECYCLE, -1, now);
+}
+
+/* Number of connections waiting to be accepted on listening socket fd, where
+ * the kernel will tell (a TCP socket on Linux); zero elsewhere */
+static int listen_backlog(int fd)
+{
+#if defined(__linux__) && defined(TCP_INFO)
+    struct tcp_info ti;
+    socklen_t       len = sizeof(ti);
+
+    /* for a listening socket, tcpi_unacked is the length of the accept queue */
+    if (fd >= 0 && getsockopt(fd, IPPROTO_TCP, TCP_INFO, &ti, &len) == 0 &&
+        ti.tcpi_state == TCP_LISTEN)
+        return ti.tcpi_unacked;
+#endif
+    return 0;
+}
+
+/* TIMER_SCALE: grow or shrink the pool to fit the load.
+ *
+ * Three things are measured: how busy the children are (the busy_ns they
+ * publish in the stats segment, as a fraction of the time since last we
+ * looked), how many connections are waiting to be accepted, and how long
+ * the oldest dispatch job has been waiting to be started. (Not how full the
+ * dispatch rings are: we keep them full.) Any one of them running hot is
+ * reason enough to grow; shrinking needs all of them to be cold.
+ *
+ * The pool shrinks from the top, since a child's stats record, rings and log
+ * are those of its slot. So it only shrinks while the child in the top slot is
+ * idle as well, with no connections open: otherwise we wait for a sample in
+ * which it is, rather than cut short the work of a busy child while others
+ * have nothing to do. It is retired the usual way (see drain_slot()).
+ */
+void autoscale()
+{
+    int         i, n = 0, backlog = 0, jobs = options.jobs, top = options.jobs - 1;
+    uint64_t    now = now_ns(), busy, delta, total = 0, top_busy = 0, top_conns = 0;
+    uint64_t    age, waited = 0;
+    double      ratio;
+    bool        idle;
+    stats_slot_t *rec;
+
+    if (shutting_down)
+        return;
+
+    timer_set(TIMER_SCALE, -1, now_ms() + SCALE_INTERVAL);
+
+    backlog = listen_backlog(listenfd);
+
+    for (i = 0; i < slots.size; ++i) {
+        if (slots.state[i] != SLOT_RUNNING || !slots.pid[i])
+            continue;
+
+        /* a new child starts over from zero */
+        rec  = stats_slot(i);
+        busy = __atomic_load_n(&rec->busy_ns, __ATOMIC_RELAXED);
+        delta  = busy >= slots.busy[i] ? busy - slots.busy[i] : busy;
+        total += delta;
+        slots.busy[i] = busy;
+        if (i == top) {
+            top_busy  = delta;
+            top_conns = __atomic_load_n(&rec->conns, __ATOMIC_RELAXED);
+        }
+
+        /* with --balance, the queue is in the channels, between us and
+         * the children */
+        if (options.balance)
+            backlog += slots.handed[i] - __atomic_load_n(&rec->accepted, __ATOMIC_RELAXED);
+        else
+            backlog += listen_backlog(slots.lfd[i]);
+
+        /* the longest any job handed out has gone without being started */
+        if (dispatch.header && (age = dispatch_age(i, now)) > waited)
+            waited = age;
+        ++n;
+    }
+
+    if (!n || now <= scale_sampled) {
+        scale_sampled = now;
+        return;
+    }
+
+    ratio  = (double)total / n / (now - scale_sampled);
+    idle   = (double)top_busy / (now - scale_sampled) < SCALE_COLD_BUSY && !top_conns;
+    scale_sampled = now;
+
+    if (ratio > SCALE_HOT_BUSY || backlog > 0 || waited > SCALE_HOT_WAIT * 1000000ULL) {
+        scale_cold = 0;
+        if (++scale_hot >= SCALE_UP_AFTER && jobs < options.max_jobs) {
+            jobs += jobs / 4 > 1 ? jobs / 4 : 1;
+            jobs  = jobs < options.max_jobs ? jobs : options.max_jobs;
+        }
+    } else if (ratio < SCALE_COLD_BUSY && waited < SCALE_COLD_WAIT * 1000000ULL) {
+        scale_hot = 0;
+        if (++scale_cold >= SCALE_DOWN_AFTER && jobs > options.min_jobs + cluster_cover && idle)
+            --jobs;
+    } else {
+        scale_hot = scale_cold = 0;
+    }
+
+    if (jobs == options.jobs)
+        return;
+
+    log_msg(LOG_INFO, "Master: scaling %s to %d children (busy %.0f%%, backlog %d, waited %.1fms)",
+            jobs > options.jobs ? "up" : "down", jobs, ratio * 100, backlog, waited / 1e6);
+    scale_hot = scale_cold = 0;
+
+    if (!pool_resize(jobs))
+        log_msg(LOG_WARN, "Master: could not resize pool to %d", jobs);
+}
+
+/* TIMER_RECYCLE: replace children that have grown old, or fat.
+ *
+ * However carefully a child looks after its memory, a long life tends to
+ * leave it bigger than it started, and the only sure way to get that memory
+ * back is a new process. A child that has served --max-requests, grown past
+ * --max-rss, or lived past --max-age is recycled: first a stand-in is spawned
+ * into a spare slot beyond the pool, and only once it is up is the old child
+ * drained, and replaced (see drain_slot()). When the replacement is up in
+ * turn, the stand-in is drained too, and the pool is back as it was, without
+ * ever having been short of a child.
+ *
+ * No more than --max-rotating children are recycled at a time, so a pool that
+ * was started all at once is not also renewed all at once.
+ */
+void recycle_children()
+{
+    int             i;
+    uint64_t        now = now_ms();
+    stats_slot_t *  rec;
+    const char *    why;
+
+    if (shutting_down)
+        return;
+
+    timer_set(TIMER_RECYCLE, -1, now + RECYCLE_INTERVAL);
+
+    for (i = 0; i < options.jobs && rotating < options.max_rotating; ++i) {
+        if (slots.state[i] != SLOT_RUNNING || !slots.pid[i] || slots_cover_of(i) >= 0)
+            continue;
+
+        rec = stats_slot(i);
+        if (options.max_requests &&
+            __atomic_load_n(&rec->requests, __ATOMIC_RELAXED) >= (uint64_t)options.max_requests)
+            why = "served enough requests";
+        else if (options.max_rss &&
+                 __atomic_load_n(&rec->rss_kb, __ATOMIC_RELAXED) >= (uint64_t)options.max_rss * 1024)
+            why = "grown too big";
+        else if (options.max_age && now - slots.started[i] >= (uint64_t)options.max_age)
+            why = "grown too old";
+        else if (slots.stale[i])
+            why = "an old configuration";
+        else
+            continue;
+
+        log_msg(LOG_INFO, "Master: recycling child(%d) [pid %d], which has %s", i, slots.pid[i], why);
+        start_rotation(i);
+    }
+}
+
+/* Spawn a stand-in for child(id), in the first spare slot beyond the pool */
+void start_rotation(int id)
+{
+    int j;
+
+    for (j = options.jobs; j < slots.size && slots.state[j] != SLOT_EMPTY; ++j)
+        ;
+    if (j == slots.size && !slots_resize(j + 1))
+        return;
+
+    slots.cover[j] = id;
+    rotating++;
+
+    if (!child(j)) {
+        log_error("child()");
+        end_rotation(j);
+    }
+}
+
+/* Slot j no longer stands in for anybody */
+void end_rotation(int j)
+{
+    slots.cover[j] = -1;
+    rotating--;
+}
+
+/* The slot standing in for child(id), or -1 */
+int slots_cover_of(int id)
+{
+    int j;
+
+    for (j = options.jobs; j < slots.size; ++j)
+        if (slots.cover[j] == id)
+            return j;
+
+    return -1;
+}
+
+/* Master's kill switch
+ *
+ * It's important to ensure that all children have exited before the master
+ * exits so no root zombies are created. The default handler for SIGINT sends
+ * SIGINT to all children, but this is not true with SIGTERM.
+ *
+ * Shutting down happens in stages. Every child is asked to drain: to stop
+ * accepting new work, finish what it has, and exit. Meanwhile the event loop
+ * carries on reaping them as usual (but no longer restarting them), and kills
+ * any that are still around after drain_timeout. Once the last one is gone,
+ * finish_shutdown() ends the loop.
+ *
+ * A second termination signal skips the wait, and kills everybody outright.
+ */
+void terminate_children()
+{
+    int i;
+
+    if (shutting_down) {
+        log_msg(LOG_INFO, "Master: second termination signal, killing remaining children");
+        for (i = 0; i < slots.size; ++i)
+            if (slots.pid[i] > 0)
+                kill(slots.pid[i], SIGKILL);
+        return;
+    }
+
+    log_msg(LOG_INFO, "Termination signal received! Draining children");
+
+    /* dead children are no longer to be restarted */
+    shutting_down  = true;
+    shutdown_start = now_ms();
+
+    /* and with --balance, connections still waiting are left in the listen
+     * queue, for a new master if this is an upgrade */
+    balance_watch(false);
+
+    /* children the zygote is still working on need to be known to be drained */
+    zygote_stop();
+
+    for (i = 0; i < slots.size; ++i) {
+        if (slots.pid[i] > 0) {
+            drain_slot(i, false);
+        } else if (slots.state[i] != SLOT_EMPTY) {
+            timer_cancel(TIMER_RESTART, i);
+            set_state(i, SLOT_EMPTY);
+        }
+    }
+
+    if (!slots.live)
+        finish_shutdown();
+}
+
+/* Ask child(id) to drain (SIGTERM), and set a deadline for it to be gone.
+ * If replace is true, it is restarted once it has exited, just as if it had
+ * died; otherwise the slot is left empty.
+ *
+ * Only this one child is affected, so any number of children can be cycled
+ * without taking the rest of the pool down with them.
+ */
+void drain_slot(int id, bool replace)
+{
+    if (slots.pid[id] <= 0)
+        return;
+
+    if (slots.state[id] != SLOT_RETIRING && slots.state[id] != SLOT_DRAINING) {
+        TRACE(drain__begin, id, slots.pid[id]);
+        kill(slots.pid[id], SIGTERM);
+        timer_set(TIMER_DRAIN, id, now_ms() + options.drain_timeout);
+    }
+
+    set_state(id, replace ? SLOT_DRAINING : SLOT_RETIRING);
+}
+
+/* The last child of a shutdown has been reaped */
+void finish_shutdown()
+{
+    char killed[64] = "";
+
+    running = false;
+
+    if (stragglers)
+        snprintf(killed, sizeof(killed), " (%d killed at the deadline)", stragglers);
+    log_msg(LOG_INFO, "All children reaped, shutting down after %.3fs%s.",
+            (now_ms() - shutdown_start) / 1e3, killed);
+
+    if (dispatch.header)
+        log_msg(LOG_INFO, "Master: %llu jobs done, %.0f per second",
+                (unsigned long long)dispatch.completed,
+                dispatch.completed / ((now_ns() - stats.header->started) / 1e9));
+
+    stats_destroy();
+    groups_destroy();
+
+    if (spawn_latency.count)
+        log_msg(LOG_INFO, "Master: %llu spawns, latency p50 %.1fus p99 %.1fus",
+                (unsigned long long)spawn_latency.count,
+                latency_percentile(&spawn_latency, 0.50) / 1e3,
+                latency_percentile(&spawn_latency, 0.99) / 1e3);
+}
+
+/* Create a listening socket for addr (options.listen, or options.metrics).
+ *
+ * Addresses containing a slash are unix domain socket paths; anything else is
+ * [HOST:]PORT, resolved with getaddrinfo(). With reuseport, any number of
+ * sockets may be bound to the same port, and the kernel spreads incoming
+ * connections across them (Linux 3.9; the BSDs have SO_REUSEPORT_LB).
+ */
+int listen_socket(const char *addr, bool reuseport)
+{
+    int                 fd = -1, on = 1;
+    char                host[0xff], *port;
+    struct addrinfo     hints, *res, *ai;
+    struct sockaddr_un  sun;
+    struct stat         st;
+
+    if (strchr(addr, '/')) {
+        if (reuseport) {
+            log_msg(LOG_ERROR, "-r: not supported for unix domain sockets");
+            return -1;
+        }
+
+        memset(&sun, 0, sizeof(sun));
+        sun.sun_family = AF_UNIX;
+        strncpy(sun.sun_path, addr, sizeof(sun.sun_path) - 1);
+        /* a stale socket from a previous run goes; anything else that is
+         * there is somebody's file, and bind() will say so */
+        if (lstat(sun.sun_path, &st) == 0 && S_ISSOCK(st.st_mode))
+            unlink(sun.sun_path);
+
+        if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0 ||
+            bind(fd, (struct sockaddr *)&sun, sizeof(sun)) < 0) {
+            log_error(addr);
+            if (fd >= 0)
+                close(fd);
+            return -1;
+        }
+    } else {
+        strncpy(host, addr, sizeof(host) - 1);
+        host[sizeof(host) - 1] = '\0';
+
+        if ((port = strrchr(host, ':'))) {
+            *port++ = '\0';
+        } else {
+            port = (char *)addr;    /* just a port */
+            host[0] = '\0';
+        }
+
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_family   = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        hints.ai_flags    = AI_PASSIVE;
+
+        if ((errno = getaddrinfo(host[0] ? host : NULL, port, &hints, &res))) {
+            log_msg(LOG_ERROR, "%s: %s", addr, gai_strerror(errno));
+            return -1;
+        }
+
+        for (ai = res; ai; ai = ai->ai_next) {
+            if ((fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol)) < 0)
+                continue;
+
+            setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+#if defined(SO_REUSEPORT_LB)
+            if (reuseport)
+                setsockopt(fd, SOL_SOCKET, SO_REUSEPORT_LB, &on, sizeof(on));
+#elif defined(SO_REUSEPORT)
+            if (reuseport)
+                setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on));
+#endif
+
+            if (bind(fd, ai->ai_addr, ai->ai_addrlen) == 0)
+                break;
+
+            close(fd);
+            fd = -1;
+        }
+
+        freeaddrinfo(res);
+
+        if (fd < 0) {
+            log_error(addr);
+            return -1;
+        }
+    }
+
+    if (listen(fd, SOMAXCONN) < 0) {
+        log_error("listen()");
+        close(fd);
+        return -1;
+    }
+
+    /* Non-blocking, so a child that loses the race for a connection gets
+     * EAGAIN instead of sleeping in accept(); close-on-exec, because no
+     * program we might exec has any business with it. */
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+
+    return fd;
+}
+
+/* Accept a connection from fd, as a non-blocking socket */
+static int accept_connection(int fd)
+{
+    int conn;
+
+#ifdef __linux__
+    conn = accept4(fd, NULL, NULL, SOCK_NONBLOCK|SOCK_CLOEXEC);
+#else
+    if ((conn = accept(fd, NULL, NULL)) >= 0) {
+        fcntl(conn, F_SETFL, fcntl(conn, F_GETFL) | O_NONBLOCK);
+        fcntl(conn, F_SETFD, FD_CLOEXEC);
+    }
+#endif
+
+    return conn;
+}
+
+/* Balancing: with --balance, the master accepts every connection itself, and
+ * hands it to the child with the fewest connections on its hands.
+ *
+ * The kernel hands connections to children as they accept() them (or by a
+ * hash of the address, with SO_REUSEPORT), with no idea how many each already
+ * has. With short requests that evens out, but long-lived connections pile up
+ * on whichever children were quickest off the mark (or unlucky with the
+ * hash), and stay there. Here the master counts: each child publishes how
+ * many connections it has taken on, and how many of those are still open, in
+ * its stats record; what the master has handed it that it hasn't taken on
+ * yet is the difference from what the master has sent. A child that is not
+ * SLOT_RUNNING is sent nothing at all, so a draining child gets no new
+ * connections, from the moment we decide to drain it.
+ *
+ * Each child has a channel (a SEQPACKET socketpair) of its own, for as long
+ * as it lives, and connections go through it as SCM_RIGHTS, up to
+ * BALANCE_BATCH of them in a message. We keep the child's end open as well:
+ * whatever it hasn't taken by the time it dies is still there for us to take
+ * back, and hand to somebody else.
+ *
+ * The price is a hop through the master, which is now in the path of every
+ * new connection (though not of anything sent over it). Requests on an open
+ * connection go to its child directly, as ever.
+ */
+bool balance_open(int id)
+{
+    int sv[2];
+
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET|SOCK_CLOEXEC, 0, sv) < 0) {
+        log_error("balance_open()");
+        return false;
+    }
+
+    slots.chan[id]   = sv[0];
+    slots.lfd[id]    = sv[1];
+    slots.handed[id] = 0;
+    return true;
+}
+
+/* Take back whatever the late child of slot id had not got around to yet,
+ * and close its channel */
+void balance_close(int id)
+{
+    int n, fds[BALANCE_BATCH];
+
+    /* once our end is closed, no more is sent, and what's there can still be
+     * read from the other */
+    close(slots.chan[id]);
+    slots.chan[id] = -1;
+
+    while ((n = balance_recv(slots.lfd[id], fds)) > 0) {
+        log_msg(LOG_INFO, "Master: handing %d connections of child(%d) to others", n, id);
+        balance_hand(fds, n);
+    }
+
+    close(slots.lfd[id]);
+    slots.lfd[id] = -1;
+}
+
+/* Start (or stop) accepting connections on the listening socket */
+void balance_watch(bool on)
+{
+    if (!options.balance || listenfd < 0 || on == balance_watching)
+        return;
+
+    if (on && !ev_watch_fd(listenfd, EVENT_LISTEN, false)) {
+        log_error("balance_watch()");
+        return;
+    }
+    if (!on)
+        ev_unwatch_fd(listenfd);
+    balance_watching = on;
+}
+
+/* Is any child ready for work (whether or not it is keeping up)? */
+static bool balance_ready()
+{
+    int i;
+
+    for (i = 0; i < slots.size; ++i)
+        if (slots.chan[i] >= 0 && slots.state[i] == SLOT_RUNNING && !slots.warm[i])
+            return true;
+    return false;
+}
+
+/* Start a new round of handing out, in which every child gets a fresh chance */
+static void balance_new_round()
+{
+    if (!++balance_round)
+        ++balance_round;    /* 0 is what nobody has balked at */
+}
+
+/* The child to hand the next connection to: the one (ready for work, and not
+ * found to be full this round) with the fewest connections open or on their
+ * way. Returns its slot, or -1 if there is none.
+ *
+ * The search starts where the last one left off, so that children with as
+ * many as each other take turns. */
+static int balance_pick()
+{
+    int             i, j, best = -1;
+    uint64_t        load, least = UINT64_MAX;
+    stats_slot_t *  rec;
+
+    for (j = 0; j < slots.size; ++j) {
+        i = (balance_next + j) % slots.size;
+        if (slots.chan[i] < 0 || slots.state[i] != SLOT_RUNNING || slots.warm[i] ||
+            slots.balked[i] == balance_round || i >= (int)stats.header->slots)
+            continue;
+
+        rec  = stats_slot(i);
+        load = __atomic_load_n(&rec->conns, __ATOMIC_RELAXED) + slots.handed[i] -
+               __atomic_load_n(&rec->accepted, __ATOMIC_RELAXED);
+        if (load < least) {
+            least = load;
+            best  = i;
+        }
+    }
+
+    if (best >= 0)
+        balance_next = best + 1;
+    return best;
+}
+
+/* Send n (at most BALANCE_BATCH) connections to child id in one message */
+static bool balance_send(int id, int *fds, int n)
+{
+    char            cbuf[CMSG_SPACE(sizeof(int) * BALANCE_BATCH)];
+    uint32_t        count = n;
+    struct iovec    iov = { &count, sizeof(count) };
+    struct msghdr   msg;
+    struct cmsghdr *cmsg;
+
+    memset(&msg, 0, sizeof(msg));
+    memset(cbuf, 0, sizeof(cbuf));
+    msg.msg_iov        = &iov;
+    msg.msg_iovlen     = 1;
+    msg.msg_control    = cbuf;
+    msg.msg_controllen = CMSG_SPACE(sizeof(int) * n);
+    cmsg               = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level   = SOL_SOCKET;
+    cmsg->cmsg_type    = SCM_RIGHTS;
+    cmsg->cmsg_len     = CMSG_LEN(sizeof(int) * n);
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * n);
+
+    return sendmsg(slots.chan[id], &msg, MSG_DONTWAIT|MSG_NOSIGNAL) >= 0;
+}
+
+/* Send child id a batch of k connections from balance_hand(), or if it can't
+ * take them (its channel is full: it is not keeping up), add them to again[],
+ * for somebody else */
+static void balance_give(int id, int *batch, int k, int *again, int *left)
+{
+    if (balance_send(id, batch, k)) {
+        while (k)
+            close(batch[--k]);
+        return;
+    }
+
+    slots.handed[id] -= k;
+    slots.balked[id]  = balance_round;
+    while (k)
+        again[(*left)++] = batch[--k];
+}
+
+/* Hand out n (at most BALANCE_ACCEPT) connections, and close our copies.
+ *
+ * Each goes to the least loaded child, counting those before it, and then
+ * each child is sent its share, a message at a time. The shares of children
+ * that turn out to be full go round again, to the others; whatever nobody
+ * can take is hung up on.
+ */
+void balance_hand(int *fds, int n)
+{
+    int to[BALANCE_ACCEPT], again[BALANCE_ACCEPT], batch[BALANCE_BATCH];
+    int i, j, k, id, left;
+
+    balance_new_round();
+
+    while (n) {
+        for (i = 0; i < n; ++i)
+            if ((to[i] = balance_pick()) >= 0)
+                slots.handed[to[i]]++;
+
+        for (i = left = 0; i < n; ++i) {
+            if ((id = to[i]) == -2)
+                continue;       /* sent, with an earlier one */
+            if (id < 0) {
+                again[left++] = fds[i];
+                continue;
+            }
+
+            for (j = i, k = 0; j < n; ++j) {
+                if (to[j] != id)
+                    continue;
+                to[j]      = -2;
+                batch[k++] = fds[j];
+                if (k == BALANCE_BATCH) {
+                    balance_give(id, batch, k, again, &left);
+                    k = 0;
+                }
+            }
+            if (k)
+                balance_give(id, batch, k, again, &left);
+        }
+
+        if (left && balance_pick() < 0) {
+            log_msg(LOG_WARN, "Master: no child can take %d connections, closing them", left);
+            while (left)
+                close(again[--left]);
+        }
+        memcpy(fds, again, left * sizeof(*fds));
+        n = left;
+    }
+}
+
+/* EVENT_LISTEN, in the master with --balance: accept what is waiting, and
+ * hand it out */
+void balance_accept()
+{
+    int n = 0, fds[BALANCE_ACCEPT];
+
+    /* With nobody to take them, connections are better off in the listen
+     * queue; we listen again once a child is ready (see ready_check()). A
+     * child that was full last time is not nobody: it may have caught up. */
+    balance_new_round();
+    if (shutting_down || !balance_ready()) {
+        balance_watch(false);
+        return;
+    }
+
+    while (n < BALANCE_ACCEPT && (fds[n] = accept_connection(listenfd)) >= 0)
+        ++n;
+
+    if (n)
+        balance_hand(fds, n);
+}
+
+/* Receive a message's worth of connections from a channel into fds (room for
+ * BALANCE_BATCH). Returns how many, or 0 if the other end has gone, or -1 if
+ * there are none yet. */
+int balance_recv(int fd, int *fds)
+{
+    char            cbuf[CMSG_SPACE(sizeof(int) * BALANCE_BATCH)];
+    uint32_t        count;
+    struct iovec    iov = { &count, sizeof(count) };
+    struct msghdr   msg;
+    struct cmsghdr *cmsg;
+    ssize_t         len;
+    int             n = 0;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov        = &iov;
+    msg.msg_iovlen     = 1;
+    msg.msg_control    = cbuf;
+    msg.msg_controllen = sizeof(cbuf);
+
+    if ((len = recvmsg(fd, &msg, MSG_DONTWAIT|MSG_CMSG_CLOEXEC)) < 0)
+        return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR ? -1 : 0;
+    if (len == 0)
+        return 0;
+
+    for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg))
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+            n = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            memcpy(fds, CMSG_DATA(cmsg), sizeof(int) * n);
+        }
+
+    /* an empty message would look like the end; there are none, but still */
+    return n ? n : -1;
+}
+
+/* The I/O engine of a server child.
+ *
+ * serve() sees I/O as completions: a connection was accepted, some data was
+ * received, a send failed. With io_uring (--io-uring, Linux 6.0) that is what
+ * the kernel delivers; with epoll, io_wait() waits for readiness and does the
+ * accept() or read() itself, so that the two look the same from above.
+ *
+ * The io_uring engine is built on the raw system calls, and goes out of its way
+ * to keep the number of them down:
+ *
+ *   - one multishot accept stands for every connection to come, and puts each
+ *     straight into the ring's table of registered files, so it never gets a
+ *     file descriptor at all (and requests on it skip the fd table lookup);
+ *   - one multishot recv per connection stands for all of its requests, and
+ *     picks a buffer for each from a ring of provided buffers, which is handed
+ *     back once the echo has been sent from it: nothing is copied;
+ *   - requests are queued up while serve() works through a batch, and the
+ *     whole lot is submitted by the same io_uring_enter() that waits for the
+ *     next batch. A request costs no system calls of its own.
+ *
+ * The ring is set up in the child, so each has its own, and with
+ * SINGLE_ISSUER and DEFER_TASKRUN the kernel only runs completions when we
+ * ask for them, rather than interrupting us to do so.
+ */
+#ifdef IORING_SETUP_DEFER_TASKRUN
+
+/* Get a submission queue entry, submitting what's queued if the ring is full */
+static struct io_uring_sqe *io_sqe()
+{
+    struct io_uring_sqe *sqe;
+
+    if (io.sq_local - __atomic_load_n(io.sq_head, __ATOMIC_ACQUIRE) >= io.sq_entries) {
+        __atomic_store_n(io.sq_tail, io.sq_local, __ATOMIC_RELEASE);
+        syscall(SYS_io_uring_enter, io.ring, io.sq_local - *io.sq_head, 0, 0, NULL, 0);
+    }
+
+    sqe = &io.sqes[io.sq_local++ & io.sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    return sqe;
+}
+
+/* (Re)start the multishot accept of the listening socket */
+static void io_arm_accept()
+{
+    struct io_uring_sqe *sqe = io_sqe();
+
+    sqe->opcode     = IORING_OP_ACCEPT;
+    sqe->fd         = io.lfd;
+    sqe->ioprio     = IORING_ACCEPT_MULTISHOT;
+    sqe->file_index = IORING_FILE_INDEX_ALLOC;
+    sqe->user_data  = IO_TAG(IO_OP_ACCEPT, 0, 0, 0);
+}
+
+/* Start (or restart) the multishot recv of connection id */
+static void io_arm_recv(int id)
+{
+    struct io_uring_sqe *sqe = io_sqe();
+
+    sqe->opcode     = IORING_OP_RECV;
+    sqe->fd         = id;
+    sqe->flags      = IOSQE_FIXED_FILE|IOSQE_BUFFER_SELECT;
+    sqe->ioprio     = IORING_RECV_MULTISHOT;
+    sqe->buf_group  = 0;
+    sqe->user_data  = IO_TAG(IO_OP_RECV, io.gen[id], 0, id);
+}
+
+/* Set up an io_uring, or return false to make do with epoll */
+static bool io_uring_init()
+{
+    struct io_uring_params          p;
+    struct io_uring_rsrc_register   files;
+    struct io_uring_buf_reg         reg;
+    uint8_t *                       sq;
+    size_t                          size;
+    int                             i;
+
+    memset(&p, 0, sizeof(p));
+    p.flags = IORING_SETUP_SUBMIT_ALL|IORING_SETUP_COOP_TASKRUN|
+              IORING_SETUP_SINGLE_ISSUER|IORING_SETUP_DEFER_TASKRUN;
+
+    if ((io.ring = syscall(SYS_io_uring_setup, IO_ENTRIES, &p)) < 0) {
+        /* those last two are Linux 6.0 and 6.1 */
+        memset(&p, 0, sizeof(p));
+        p.flags = IORING_SETUP_SUBMIT_ALL|IORING_SETUP_COOP_TASKRUN;
+        if ((io.ring = syscall(SYS_io_uring_setup, IO_ENTRIES, &p)) < 0)
+            return false;
+    }
+
+    if (!(p.features & IORING_FEAT_SINGLE_MMAP) || !(p.features & IORING_FEAT_EXT_ARG))
+        goto fail;
+
+    /* the submission and completion queues share a mapping */
+    size = p.sq_off.array + p.sq_entries * sizeof(uint32_t);
+    if (size < p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe))
+        size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+
+    if ((sq = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE,
+                   io.ring, IORING_OFF_SQ_RING)) == MAP_FAILED)
+        goto fail;
+    if ((io.sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe),
+                        PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE,
+                        io.ring, IORING_OFF_SQES)) == MAP_FAILED)
+        goto fail;
+
+    io.sq_head    = (uint32_t *)(sq + p.sq_off.head);
+    io.sq_tail    = (uint32_t *)(sq + p.sq_off.tail);
+    io.sq_mask    = *(uint32_t *)(sq + p.sq_off.ring_mask);
+    io.sq_entries = p.sq_entries;
+    io.cq_head    = (uint32_t *)(sq + p.cq_off.head);
+    io.cq_tail    = (uint32_t *)(sq + p.cq_off.tail);
+    io.cq_mask    = *(uint32_t *)(sq + p.cq_off.ring_mask);
+    io.cqes       = (struct io_uring_cqe *)(sq + p.cq_off.cqes);
+    io.sq_local   = *io.sq_tail;
+
+    /* entry i of the submission queue is always sqes[i] */
+    for (i = 0; i < (int)p.sq_entries; ++i)
+        ((uint32_t *)(sq + p.sq_off.array))[i] = i;
+
+    /* an empty table of registered files, for accepted connections */
+    memset(&files, 0, sizeof(files));
+    files.nr    = IO_FILES;
+    files.flags = IORING_RSRC_REGISTER_SPARSE;
+    if (syscall(SYS_io_uring_register, io.ring, IORING_REGISTER_FILES2, &files, sizeof(files)) < 0)
+        goto fail;
+
+    /* and a ring of buffers for them to receive into */
+    size = IO_BUFS * sizeof(struct io_uring_buf);
+    if ((io.br = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS,
+                      -1, 0)) == MAP_FAILED ||
+        (io.bufs = mmap(NULL, (size_t)IO_BUFS * IO_BUF_SIZE, PROT_READ|PROT_WRITE,
+                        MAP_PRIVATE|MAP_ANONYMOUS, -1, 0)) == MAP_FAILED)
+        goto fail;
+
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr    = (uint64_t)(uintptr_t)io.br;
+    reg.ring_entries = IO_BUFS;
+    reg.bgid         = 0;
+    if (syscall(SYS_io_uring_register, io.ring, IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+        goto fail;
+
+    for (i = 0; i < IO_BUFS; ++i)
+        io_release(i);
+
+    io.gen = calloc(IO_FILES, sizeof(*io.gen));
+    io.starved = calloc(IO_FILES, sizeof(*io.starved));
+    if (!io.gen || !io.starved)
+        goto fail;
+
+    io.uring = true;
+    io_arm_accept();
+    return true;
+
+fail:
+    /* the mappings go with the ring, or with us; this only happens once */
+    close(io.ring);
+    io.ring = -1;
+    return false;
+}
+
+#endif /* IORING_SETUP_DEFER_TASKRUN */
+
+/* Start the I/O engine of a server child, listening on fd */
+bool io_init(int fd)
+{
+    io.lfd = fd;
+
+#ifdef IORING_SETUP_DEFER_TASKRUN
+    if (options.io_uring) {
+        if (io_uring_init())
+            return true;
+        log_msg(LOG_WARN, "io_uring not available (%s), using epoll", strerror(errno));
+        options.io_uring = false;
+    }
+#endif
+
+    /* a shared socket is watched exclusively, so that a connection wakes a
+     * single child (or thread) instead of all of them, unless we are asked for
+     * the herd; with --threads, even a --reuseport socket is shared */
+    return ev_init() && ev_watch_fd(fd, EVENT_LISTEN, (!options.reuseport || threaded) &&
+                                                      !options.herd);
+}
+
+/* Wait up to timeout milliseconds for completions, and store up to max of
+ * them in events[]. Returns the number of events, or -1 on error.
+ *
+ * With epoll, received data is read into scratch memory, which is the
+ * caller's to reset once it has been through the batch.
+ */
+int io_wait(io_event_t *events, int max, int timeout)
+{
+    int         i, j, k, n, fd, count = 0, fds[BALANCE_BATCH];
+    ssize_t     len;
+    event_t     ready[64];
+
+#ifdef IORING_SETUP_DEFER_TASKRUN
+    if (io.uring) {
+        struct io_uring_getevents_arg   arg;
+        struct __kernel_timespec        ts;
+        struct io_uring_cqe *           cqe;
+        uint32_t                        head, tail, bid;
+        uint64_t                        tag;
+
+        /* accepting again after a pause, or waiting no longer than that */
+        if (io.accept_at && io.lfd >= 0 && now_ms() >= io.accept_at) {
+            io.accept_at = 0;
+            io_arm_accept();
+        }
+        if (io.accept_at && (timeout < 0 || timeout > IO_ACCEPT_PAUSE))
+            timeout = IO_ACCEPT_PAUSE;
+        ts = (struct __kernel_timespec){ timeout / 1000, (timeout % 1000) * 1000000L };
+
+        /* submit everything queued since last time, and wait for something
+         * to happen, in a single system call */
+        memset(&arg, 0, sizeof(arg));
+        arg.ts = timeout >= 0 ? (uint64_t)(uintptr_t)&ts : 0;
+
+        __atomic_store_n(io.sq_tail, io.sq_local, __ATOMIC_RELEASE);
+        head = *io.cq_head;
+        n = head == __atomic_load_n(io.cq_tail, __ATOMIC_ACQUIRE) && timeout;
+        if (syscall(SYS_io_uring_enter, io.ring, io.sq_local - *io.sq_head, n,
+                    IORING_ENTER_GETEVENTS|IORING_ENTER_EXT_ARG, &arg, sizeof(arg)) < 0 &&
+            errno != EINTR && errno != ETIME && errno != EBUSY)
+            return -1;
+
+        tail = __atomic_load_n(io.cq_tail, __ATOMIC_ACQUIRE);
+        for (; head != tail && count < max; ++head) {
+            cqe = &io.cqes[head & io.cq_mask];
+            tag = cqe->user_data;
+            fd  = IO_TAG_ID(tag);
+            bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+
+            switch (IO_TAG_OP(tag)) {
+            case IO_OP_ACCEPT:
+                /* The multishot accept has ended. If it failed (with the table
+                 * of files full, say), it would fail again just as quickly:
+                 * give it a moment, or a closed connection, to clear up. */
+                if (!(cqe->flags & IORING_CQE_F_MORE) && io.lfd >= 0) {
+                    if (cqe->res >= 0)
+                        io_arm_accept();
+                    else if (!io.accept_at)
+                        io.accept_at = now_ms() + IO_ACCEPT_PAUSE;
+                }
+                if (cqe->res < 0)
+                    break;
+                fd = cqe->res;
+                io_arm_recv(fd);
+                events[count++] = (io_event_t){ IO_ACCEPT, fd, NULL, 0, -1 };
+                break;
+
+            case IO_OP_RECV:
+                /* left over from a connection that has since been closed */
+                if (IO_TAG_GEN(tag) != io.gen[fd]) {
+                    if (cqe->flags & IORING_CQE_F_BUFFER)
+                        io_release(bid);
+                    break;
+                }
+                if (cqe->res == -ENOBUFS) {
+                    /* out of buffers: try again once some come back */
+                    io.starved[io.nstarved++] = fd;
+                    break;
+                }
+                if (cqe->res > 0) {
+                    if (!(cqe->flags & IORING_CQE_F_MORE))
+                        io_arm_recv(fd);
+                    events[count++] = (io_event_t){ IO_RECV, fd, (char *)io.bufs +
+                                                    (size_t)bid * IO_BUF_SIZE, cqe->res, bid };
+                } else {
+                    events[count++] = (io_event_t){ IO_RECV, fd, NULL, cqe->res, -1 };
+                }
+                break;
+
+            case IO_OP_SEND:
+                io.sending--;
+                io_release(IO_TAG_BID(tag));
+                for (i = 0; i < io.nstarved; ++i)
+                    io_arm_recv(io.starved[i]);
+                io.nstarved = 0;
+                if (cqe->res < 0 && IO_TAG_GEN(tag) == io.gen[fd])
+                    events[count++] = (io_event_t){ IO_ERROR, fd, NULL, cqe->res, -1 };
+                break;
+            }
+        }
+        __atomic_store_n(io.cq_head, head, __ATOMIC_RELEASE);
+
+        return count;
+    }
+#endif
+
+    if (max > 64)
+        max = 64;
+
+    if ((n = ev_wait(ready, max, timeout)) < 0)
+        return -1;
+
+    for (i = 0; i < n && count < max; ++i) {
+        if (ready[i].type == EVENT_LISTEN && options.balance) {
+            /* take what the master has handed us, while there's room to
+             * report a whole message's worth */
+            for (k = -1; io.lfd >= 0 && count + BALANCE_BATCH <= max &&
+                         (k = balance_recv(io.lfd, fds)) > 0; ) {
+                for (j = 0; j < k; ++j) {
+                    if (!ev_watch_fd(fds[j], EVENT_CONN, false)) {
+                        close(fds[j]);
+                        continue;
+                    }
+                    events[count++] = (io_event_t){ IO_ACCEPT, fds[j], NULL, 0, -1 };
+                }
+            }
+            /* a master that has gone away won't hand us any more, so we may
+             * as well finish up */
+            if (!k)
+                draining = 1;
+            continue;
+        }
+        if (ready[i].type == EVENT_LISTEN) {
+            /* take pending connections until accept() runs dry (or there's no
+             * room to report them; the rest will still be there next time) */
+            while (io.lfd >= 0 && count < max && (fd = accept_connection(io.lfd)) >= 0) {
+                if (!ev_watch_fd(fd, EVENT_CONN, false)) {
+                    close(fd);
+                    continue;
+                }
+                events[count++] = (io_event_t){ IO_ACCEPT, fd, NULL, 0, -1 };
+            }
+            continue;
+        }
+
+        fd = ready[i].id;
+        events[count].buf = scratch_alloc(IO_BUF_SIZE);
+        if ((len = read(fd, events[count].buf, IO_BUF_SIZE)) < 0 &&
+            (errno == EAGAIN || errno == EINTR))
+            continue;
+
+        events[count].type = IO_RECV;
+        events[count].id   = fd;
+        events[count].len  = len < 0 ? -errno : len;
+        events[count].bid  = -1;
+        ++count;
+    }
+
+    return count;
+}
+
+/* Send len bytes from buf (which holds provided buffer bid, or -1) on
+ * connection id. With io_uring the send only completes later, and the buffer
+ * is released then; a failure is reported as an IO_ERROR event. Returns false
+ * if the connection is known to be broken already.
+ */
+bool io_send(int id, char *buf, int len, int bid)
+{
+#ifdef IORING_SETUP_DEFER_TASKRUN
+    if (io.uring) {
+        struct io_uring_sqe *sqe = io_sqe();
+
+        sqe->opcode     = IORING_OP_SEND;
+        sqe->fd         = id;
+        sqe->flags      = IOSQE_FIXED_FILE;
+        sqe->addr       = (uint64_t)(uintptr_t)buf;
+        sqe->len        = len;
+        sqe->msg_flags  = MSG_NOSIGNAL;
+        sqe->user_data  = IO_TAG(IO_OP_SEND, io.gen[id], bid, id);
+        io.sending++;
+        return true;
+    }
+#endif
+
+    return write(id, buf, len) >= 0;
+}
+
+/* Hand provided buffer bid back to the kernel, once done with it */
+void io_release(int bid)
+{
+#ifdef IORING_SETUP_DEFER_TASKRUN
+    struct io_uring_buf *b;
+    uint16_t            tail;
+
+    if (!io.br || bid < 0)
+        return;
+
+    tail    = io.br->tail;
+    b       = &io.br->bufs[tail & (IO_BUFS - 1)];
+    b->addr = (uint64_t)(uintptr_t)(io.bufs + (size_t)bid * IO_BUF_SIZE);
+    b->len  = IO_BUF_SIZE;
+    b->bid  = bid;
+    __atomic_store_n(&io.br->tail, (uint16_t)(tail + 1), __ATOMIC_RELEASE);
+#endif
+}
+
+/* Close connection id */
+void io_close(int id)
+{
+#ifdef IORING_SETUP_DEFER_TASKRUN
+    struct io_uring_sqe *sqe;
+    int                 i;
+
+    if (io.uring) {
+        /* stop its recv, and have whatever it still reports ignored, since
+         * the file's slot may well be reused by the time it does */
+        sqe = io_sqe();
+        sqe->opcode     = IORING_OP_ASYNC_CANCEL;
+        sqe->addr       = IO_TAG(IO_OP_RECV, io.gen[id], 0, id);
+        sqe->user_data  = IO_TAG(IO_OP_CANCEL, 0, 0, 0);
+        io.gen[id]++;
+
+        /* nor is it to be re-armed, if it was waiting for a buffer */
+        for (i = 0; i < io.nstarved; ++i)
+            if (io.starved[i] == id) {
+                io.starved[i] = io.starved[--io.nstarved];
+                break;
+            }
+
+        sqe = io_sqe();
+        sqe->opcode     = IORING_OP_CLOSE;
+        sqe->file_index = id + 1;
+        sqe->user_data  = IO_TAG(IO_OP_CLOSE, 0, 0, 0);
+        return;
+    }
+#endif
+
+    close(id);      /* also removes it from the event loop */
+}
+
+/* Stop accepting connections, and close the listening socket (once the last
+ * of our threads is done with it, with --threads) */
+void io_stop_accept()
+{
+#ifdef IORING_SETUP_DEFER_TASKRUN
+    struct io_uring_sqe *sqe;
+
+    if (io.uring) {
+        sqe = io_sqe();
+        sqe->opcode     = IORING_OP_ASYNC_CANCEL;
+        sqe->addr       = IO_TAG(IO_OP_ACCEPT, 0, 0, 0);
+        sqe->user_data  = IO_TAG(IO_OP_CANCEL, 0, 0, 0);
+    }
+#endif
+
+    if (threaded && !io.uring)
+        ev_unwatch_fd(io.lfd);
+    if (!threaded || __atomic_sub_fetch(&serve_accepting, 1, __ATOMIC_ACQ_REL) == 0)
+        close(io.lfd);
+    io.lfd = -1;
+}
+
+/* In the coroutine of a connection: wait for the next thing the I/O engine
+ * has for it. The event (and the data it points to) stays put until we wait
+ * again. */
+io_event_t *conn_recv(conn_t *conn)
+{
+    io_event_t *ev;
+
+    while (!(ev = conn->ev))
+        coro_yield();
+    conn->ev = NULL;
+    return ev;
+}
+
+/* The coroutine of a connection, with --coroutines: the same echo that serve()
+ * does inline, but written as the plain loop that a handler with more to do
+ * (and more to wait for) would be */
+static void serve_conn(void *arg)
+{
+    conn_t *        conn = arg;
+    io_event_t *    ev;
+    bool            ok;
+
+    do {
+        ev = conn_recv(conn);
+        TRACE(request__start, my_log_id, conn->fd, ev->len);
+        ok = ev->type != IO_ERROR && ev->len > 0 &&
+             io_send(conn->fd, ev->buf, ev->len, ev->bid);
+        TRACE(request__done, my_log_id, conn->fd, ok);
+        if (ok) {
+            conn->requests++;
+            STAT_ADD(requests, 1);
+        }
+    } while (ok);
+
+    io_release(ev->bid);
+    io_close(conn->fd);
+}
+
+/* A child's accept loop, which returns an exit status.
+ *
+ * Each child runs its own I/O engine over the listening socket and its open
+ * connections. The service itself is a humble echo: whatever a client sends,
+ * it gets back.
+ */
+int serve(int id, int fd)
+{
+    int         i, n, conn_id, timeout = HEARTBEAT_INTERVAL, maxconn = 0, live = 0;
+    io_event_t  events[64], *ev;
+    conn_t **   conns = NULL;   /* connections, by id */
+    conn_t **   grown;
+    conn_t *    conn;
+    uint64_t    woke = now_ns(), t = 0, now, deadline = 0;
+    bool        sampled, ok, full = false;
+
+    /* writing to a connection the client has closed raises SIGPIPE, which
+     * would kill us; we would rather see EPIPE */
+    signal(SIGPIPE, SIG_IGN);
+
+    if (!io_init(fd) || (options.coroutines && !coro_init(options.coroutines))) {
+        log_error("serve()");
+        return 1;
+    }
+    worker_ready(id);
+
+    while (1) {
+        stats_tick();
+        sampled = phase_sampled();
+
+        /* Draining: stop accepting, and see the connections we have through
+         * to the end, for as long as we are given; we hang up on any that are
+         * still open a little before the master runs out of patience (see
+         * TIMER_DRAIN). (Any connections still waiting in the listen queue are
+         * left for our siblings, or our successor.) */
+        if (draining && fd >= 0) {
+            TRACE(worker__drain, id);
+            serve_wake();
+            io_stop_accept();
+            fd = -1;
+            deadline = now_ms() + options.drain_timeout * 9 / 10;
+        }
+        if (fd < 0) {
+            now = now_ms();
+            timeout = now >= deadline ? 0 : deadline - now < HEARTBEAT_INTERVAL ?
+                      (int)(deadline - now) : HEARTBEAT_INTERVAL;
+        }
+
+        /* wake up at least once a second, to keep our stats fresh */
+        STAT_ADD(busy_ns, now_ns() - woke);
+        if (sampled)
+            t = ticks();
+        if ((n = io_wait(events, 64, timeout)) < 0) {
+            log_error("io_wait()");
+            return 1;
+        }
+        woke = now_ns();
+        if (sampled) {
+            phase_add(PHASE_WAIT, ticks() - t);
+            t = ticks();
+        }
+
+        for (i = 0; i < n; ++i) {
+            ev      = &events[i];
+            conn_id = ev->id;
+
+            if (ev->type == IO_ACCEPT) {
+                SLOT_ADD(accepted, 1);
+                SLOT_ADD(conns, 1);
+                if (conn_id >= maxconn) {
+                    if (!(grown = realloc(conns, (conn_id * 2 + 1) * sizeof(*conns)))) {
+                        io_close(conn_id);
+                        SLOT_ADD(conns, -1);
+                        continue;
+                    }
+                    conns = grown;
+                    memset(conns + maxconn, 0, (conn_id * 2 + 1 - maxconn) * sizeof(*conns));
+                    maxconn = conn_id * 2 + 1;
+                }
+                if (!(conn = mem_alloc(sizeof(*conn)))) {
+                    io_close(conn_id);
+                    SLOT_ADD(conns, -1);
+                    continue;
+                }
+                conn->fd       = conn_id;
+                conn->requests = 0;
+                conn->ev       = NULL;
+                conn->co       = NULL;
+
+                /* with every coroutine busy, turn the connection away,
+                 * rather than take more memory (though not quietly) */
+                if (options.coroutines && !(conn->co = coro_create(&serve_conn, conn))) {
+                    if (!full)
+                        log_msg(LOG_WARN, "Child %d: all %d coroutines busy, refusing connections",
+                                id, options.coroutines);
+                    full = true;
+                    io_close(conn_id);
+                    SLOT_ADD(conns, -1);
+                    mem_free(conn);
+                    continue;
+                }
+                conns[conn_id] = conn;
+                live++;
+                continue;
+            }
+
+            /* news of a connection closed earlier in this batch */
+            if (!(conn = conns[conn_id])) {
+                io_release(ev->bid);
+                continue;
+            }
+
+            /* a connection with a coroutine of its own handles it there; once
+             * the coroutine is done, so is the connection */
+            if (conn->co) {
+                conn->ev = ev;
+                if (!coro_resume(conn->co)) {
+                    conns[conn_id] = NULL;
+                    live--;
+                    SLOT_ADD(conns, -1);
+                    mem_free(conn);
+                }
+                continue;
+            }
+
+            /* A real server would queue whatever the socket cannot take right
+             * now; a client that doesn't read its echoes simply loses them */
+            TRACE(request__start, id, conn_id, ev->len);
+            ok = ev->type != IO_ERROR && ev->len > 0 &&
+                 io_send(conn->fd, ev->buf, ev->len, ev->bid);
+            TRACE(request__done, id, conn_id, ok);
+            if (!ok) {
+                io_release(ev->bid);
+                io_close(conn->fd);
+                conns[conn_id] = NULL;
+                live--;
+                SLOT_ADD(conns, -1);
+                mem_free(conn);
+            } else {
+                conn->requests++;
+                STAT_ADD(requests, 1);
+            }
+        }
+
+        /* each batch of requests is a unit of work, with scratch memory of
+         * its own */
+        scratch_reset();
+        if (sampled && n)
+            phase_add(PHASE_WORK, ticks() - t);
+
+        /* every connection we had has gone (and every echo been sent), or
+         * we are out of time: hang up on the rest, and go */
+        if (fd < 0 && ((!live && !io.sending) || now_ms() >= deadline)) {
+            for (conn_id = 0; conn_id < maxconn; ++conn_id) {
+                if (!(conn = conns[conn_id]))
+                    continue;
+                /* a coroutine is told its connection is done for, and
+                 * finishes (and hangs up) as it would for a broken one, which
+                 * hands its stack back to the pool */
+                if (conn->co) {
+                    conn->ev = &(io_event_t){ IO_ERROR, conn_id, NULL, -ECONNABORTED, -1 };
+                    coro_resume(conn->co);
+                } else {
+                    io_close(conn_id);
+                }
+                conns[conn_id] = NULL;
+                SLOT_ADD(conns, -1);
+                mem_free(conn);
+            }
+            return 0;
+        }
+    }
+}
+
+/* One thread of a server child, with --threads */
+static void *serve_thread(void *arg)
+{
+    serve_thread_t *    st = arg;
+    int                 status;
+
+    /* the main thread already has its arenas, from worker() */
+    my_thread = st->thread;
+    if (st->thread && !mem_init())
+        exit(1);
+    if (my_slot)
+        my_stats = my_slot + 1 + st->thread;
+
+    /* one thread failing takes the whole child down, for the master to
+     * replace */
+    if ((status = serve(st->id, st->fd)))
+        exit(status);
+    return NULL;
+}
+
+/* A server child's accept loop with --threads, which returns an exit status.
+ *
+ * The child runs options.threads copies of serve(), each with an I/O engine,
+ * arenas and a stats record of its own, all waiting on the same listening
+ * socket (exclusively, just as sibling processes would). The threads share
+ * nothing they write to but the log ring, so a child of M threads costs one
+ * address space rather than M of them, and serves much as M processes do. The
+ * master still only knows about the child.
+ */
+int serve_threaded(int id, int fd)
+{
+    pthread_attr_t  attr;
+    int             t, err;
+
+    if (!(serve_threads = calloc(options.threads, sizeof(*serve_threads))))
+        return 1;
+
+    threaded        = true;
+    serve_accepting = options.threads;
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr, THREAD_STACK);
+
+    for (t = 0; t < options.threads; ++t) {
+        serve_threads[t] = (serve_thread_t){ id, fd, t, pthread_self() };
+        if (t && (err = pthread_create(&serve_threads[t].tid, &attr, &serve_thread,
+                                       &serve_threads[t]))) {
+            errno = err;
+            log_error("pthread_create()");
+            return 1;
+        }
+    }
+    pthread_attr_destroy(&attr);
+
+    serve_thread(&serve_threads[0]);
+    for (t = 1; t < options.threads; ++t)
+        pthread_join(serve_threads[t].tid, NULL);
+
+    return 0;
+}
+
+/* Draining, with --threads: SIGTERM only interrupts whichever thread it
+ * happened to be delivered to, so pass it on. A thread tells the main thread
+ * (which has been there since the start), and the main thread tells the rest,
+ * all of which it started before it ever got here. */
+void serve_wake()
+{
+    int t;
+
+    if (!threaded)
+        return;
+
+    if (my_thread) {
+        if (!__atomic_exchange_n(&serve_woken, true, __ATOMIC_ACQ_REL))
+            pthread_kill(serve_threads[0].tid, SIGTERM);
+        return;
+    }
+
+    for (t = 1; t < options.threads; ++t)
+        pthread_kill(serve_threads[t].tid, SIGTERM);
+}
+
+/* SIGTERM handler of a serving (or dispatch) child */
+static void start_draining(int sig)
+{
+    (void)sig;
+    draining = 1;
+}
+
+/* Parse a list of CPUs like "0-3,8,10-11", as used by taskset(1) and in
+ * /sys/devices/system/cpu, into cpus[] (which may be NULL to just count).
+ * Returns the number of CPUs in the list, or -1 if it is malformed.
+ */
+int parse_cpulist(const char *list, int *cpus, int max)
+{
+    int     n = 0;
+    long    lo, hi;
+    char *  end;
+
+    while (*list) {
+        lo = hi = strtol(list, &end, 10);
+        if (end == list || lo < 0)
+            return -1;
+
+        if (*end == '-') {
+            list = end + 1;
+            hi = strtol(list, &end, 10);
+            if (end == list || hi < lo)
+                return -1;
+        }
+
+        for (; lo <= hi; ++lo, ++n)
+            if (cpus && n < max)
+                cpus[n] = lo;
+
+        if (*end == ',')
+            ++end;
+        else if (*end && *end != '\n')
+            return -1;
+        else if (*end)
+            break;
+
+        list = end;
+    }
+
+    return n;
+}
+
+/* Work out which CPU each child is to be pinned to, according to
+ * options.affinity. child(i) ends up on cpus[i % ncpus].
+ *
+ * The `cores' policy skips hyperthread siblings. Two logical CPUs on one
+ * physical core share its execution units and caches, so one worker per core
+ * usually does better than two that are fighting over them.
+ */
+bool placement_init()
+{
+    if (options.affinity == AFFINITY_NONE) {
+        if (options.numa != NUMA_NONE) {
+            log_msg(LOG_ERROR, "--numa: requires --cpu-affinity");
+            return false;
+        }
+        return true;
+    }
+
+#ifdef __linux__
+    int         cpu, first, n;
+    char        path[0xff], buf[0xff];
+    FILE *      f;
+    cpu_set_t   set;
+
+    if (options.affinity == AFFINITY_LIST) {
+        n = parse_cpulist(options.cpulist, NULL, 0);
+        if (!(cpus = calloc(n, sizeof(*cpus))))
+            return false;
+        ncpus = parse_cpulist(options.cpulist, cpus, n);
+        return true;
+    }
+
+    /* only CPUs we are allowed to run on, e.g. within our cpuset */
+    if (sched_getaffinity(0, sizeof(set), &set) < 0)
+        return false;
+    if (!(cpus = calloc(CPU_COUNT(&set), sizeof(*cpus))))
+        return false;
+
+    for (cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+        if (!CPU_ISSET(cpu, &set))
+            continue;
+
+        if (options.affinity == AFFINITY_CORES) {
+            /* a core is represented by the lowest numbered of its siblings */
+            snprintf(path, sizeof(path),
+                     "/sys/devices/system/cpu/cpu%d/topology/thread_siblings_list", cpu);
+            if ((f = fopen(path, "r"))) {
+                first = cpu;
+                if (fgets(buf, sizeof(buf), f))
+                    parse_cpulist(buf, &first, 1);
+                fclose(f);
+                if (first != cpu)
+                    continue;
+            }
+        }
+
+        cpus[ncpus++] = cpu;
+    }
+
+    return ncpus > 0;
+#else
+    log_msg(LOG_ERROR, "--cpu-affinity: not supported on this platform");
+    return false;
+#endif
+}
+
+/* Pin the calling child to its CPU, and its memory to that CPU's node.
+ *
+ * Memory policy only affects pages allocated from now on, which is why this is
+ * done first thing after fork(). Pages inherited from the master stay where
+ * they are until written to, when the copy is made on the local node.
+ */
+void place_child(int id)
+{
+#ifdef __linux__
+    int             cpu, node = -1;
+    char            path[0xff];
+    unsigned long   mask[16] = { 0 };
+    cpu_set_t       set;
+    DIR *           dir;
+    struct dirent * ent;
+
+    /* a worker group with CPUs of its own has been put on them already */
+    if (!ncpus || (group_of(id) >= 0 && options.groups[group_of(id)].cpus[0]))
+        return;
+
+    cpu = cpus[id % ncpus];
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+
+    if (sched_setaffinity(0, sizeof(set), &set) < 0)
+        log_msg(LOG_ERROR, "Child %d: sched_setaffinity(%d): %s", id, cpu, strerror(errno));
+
+    if (options.numa == NUMA_NONE)
+        return;
+
+    /* the node of a CPU appears as a `nodeN' link in its sysfs directory */
+    snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d", cpu);
+    if ((dir = opendir(path))) {
+        while ((ent = readdir(dir)))
+            if (sscanf(ent->d_name, "node%d", &node) == 1)
+                break;
+        closedir(dir);
+    }
+
+    if (node < 0 || node >= (int)(sizeof(mask) * 8))
+        return;
+
+    mask[node / (sizeof(*mask) * 8)] |= 1UL << (node % (sizeof(*mask) * 8));
+
+    if (syscall(SYS_set_mempolicy, options.numa == NUMA_BIND ? MPOL_BIND : MPOL_PREFERRED,
+                mask, sizeof(mask) * 8) < 0)
+        log_msg(LOG_ERROR, "Child %d: set_mempolicy(node %d): %s", id, node, strerror(errno));
+#endif
+}
+
+/* The worker group of slot id, or -1 if it is in none. Groups take slots in
+ * the order they were given: the first --group has slots 0 to COUNT - 1. */
+int group_of(int id)
+{
+    int g, first = 0;
+
+    for (g = 0; g < options.ngroups; first += options.groups[g++].count)
+        if (id < first + options.groups[g].count)
+            return g;
+
+    return -1;
+}
+
+/* Write a value to a file of a cgroup, and return whether that worked */
+static bool cgroup_write(const char *dir, const char *file, const char *value)
+{
+    char    path[PATH_MAX];
+    int     fd;
+    bool    ok;
+
+    snprintf(path, sizeof(path), "%s/%s", dir, file);
+    if ((fd = open(path, O_WRONLY|O_CLOEXEC)) < 0)
+        return false;
+    ok = write(fd, value, strlen(value)) == (ssize_t)strlen(value);
+    close(fd);
+    return ok;
+}
+
+/* Work out the CPU set of group g, from its cpus= */
+void group_cpuset(int g)
+{
+#ifdef __linux__
+    const group_t * grp = &options.groups[g];
+    int             cpu[CPU_SETSIZE], n;
+
+    CPU_ZERO(&group_cpus[g]);
+    if (!grp->cpus[0])
+        return;
+
+    n = parse_cpulist(grp->cpus, cpu, CPU_SETSIZE);
+    for (n = n < CPU_SETSIZE ? n : CPU_SETSIZE; n-- > 0; )
+        if (cpu[n] < CPU_SETSIZE)
+            CPU_SET(cpu[n], &group_cpus[g]);
+#endif
+}
+
+/* Write the limits of a group to its cgroup, dir. With old (on a reload), only
+ * the ones that differ from old are written, and those that are no longer set
+ * go back to the kernel's defaults. */
+void group_limits(const char *dir, const group_t *grp, const group_t *old)
+{
+    char value[0x40];
+
+#define GROUP_LIMIT(field, file, fmt, v, dfl) \
+    if (old ? grp->field != old->field : grp->field != 0) { \
+        if (grp->field) \
+            snprintf(value, sizeof(value), fmt, v); \
+        else \
+            strcpy(value, dfl); \
+        if (!cgroup_write(dir, file, value)) \
+            log_msg(LOG_WARN, "Master: cannot set " file " of %s", grp->name); \
+    }
+
+    GROUP_LIMIT(cpu_weight, "cpu.weight", "%d", grp->cpu_weight, "100");
+    GROUP_LIMIT(io_weight, "io.weight", "default %d", grp->io_weight, "default 100");
+    GROUP_LIMIT(memory_low, "memory.low", "%lld", (long long)grp->memory_low << 20, "0");
+    GROUP_LIMIT(memory_high, "memory.high", "%lld", (long long)grp->memory_high << 20, "max");
+#undef GROUP_LIMIT
+
+    /* an empty cpuset.cpus is the parent's */
+    if ((old ? strcmp(grp->cpus, old->cpus) : grp->cpus[0]) &&
+        !cgroup_write(dir, "cpuset.cpus", grp->cpus[0] ? grp->cpus : "\n"))
+        log_msg(LOG_WARN, "Master: cannot set cpuset.cpus of %s", grp->name);
+}
+
+/* Set up the worker groups: a cgroup (v2) for each, and their CPU sets.
+ *
+ * The cgroups go under our own, which must have been delegated to us (e.g.
+ * with systemd's Delegate=yes). Since a cgroup with processes of its own can't
+ * hand controllers down to its children (the `no internal processes' rule),
+ * the master first moves itself into a leaf of its own:
+ *
+ *   <our cgroup>/forking-daemon.master     the master (and the zygote)
+ *   <our cgroup>/<group>                   the children of each group
+ *
+ * Nothing here is essential. Without cgroups (or some of their controllers)
+ * the groups still get their nice levels, scheduling policies and CPUs, which
+ * a child sets for itself.
+ */
+bool groups_init()
+{
+    char            line[PATH_MAX], mnt[0x100], fs[0x20], base[PATH_MAX - 64];
+    char            dir[PATH_MAX];
+    FILE *          f;
+    char *          p;
+    int             g;
+    const group_t * grp;
+
+    if (!options.ngroups)
+        return true;
+
+#ifdef __linux__
+    for (g = 0; g < options.ngroups; ++g)
+        group_cpuset(g);
+
+    /* The unified (v2) hierarchy is usually /sys/fs/cgroup, but it is
+     * /sys/fs/cgroup/unified on hybrid systems, next to the v1 controllers */
+    mnt[0] = base[0] = '\0';
+    if ((f = fopen("/proc/mounts", "r"))) {
+        while (fgets(line, sizeof(line), f))
+            if (sscanf(line, "%*s %255s %31s", mnt, fs) == 2 && !strcmp(fs, "cgroup2"))
+                break;
+            else
+                mnt[0] = '\0';
+        fclose(f);
+    }
+
+    /* and "0::/path" is our place in it */
+    if (mnt[0] && (f = fopen("/proc/self/cgroup", "r"))) {
+        while (fgets(line, sizeof(line), f))
+            if (!strncmp(line, "0::", 3)) {
+                line[strcspn(line, "\n")] = '\0';
+                if (snprintf(base, sizeof(base), "%s%s", mnt,
+                             strcmp(line + 3, "/") ? line + 3 : "") >= (int)sizeof(base))
+                    base[0] = '\0';    /* too deep to hang our groups under */
+            }
+        fclose(f);
+    }
+
+    /* a master started by an upgrade is in the old master's leaf already */
+    if ((p = strrchr(base, '/')) && !strcmp(p, "/forking-daemon.master"))
+        *p = '\0';
+
+    if (!base[0]) {
+        log_msg(LOG_WARN, "Master: no cgroup v2 hierarchy for the worker groups");
+        return true;
+    }
+    snprintf(dir, sizeof(dir), "%s/forking-daemon.master", base);
+    if ((mkdir(dir, 0755) < 0 && errno != EEXIST) || !cgroup_write(dir, "cgroup.procs", "0")) {
+        log_msg(LOG_WARN, "Master: cannot move into %s: %s", dir, strerror(errno));
+        return true;
+    }
+
+    /* hand down whichever controllers we have been given */
+    cgroup_write(base, "cgroup.subtree_control", "+cpu");
+    cgroup_write(base, "cgroup.subtree_control", "+io");
+    cgroup_write(base, "cgroup.subtree_control", "+memory");
+    cgroup_write(base, "cgroup.subtree_control", "+cpuset");
+
+    for (g = 0; g < options.ngroups; ++g) {
+        grp = &options.groups[g];
+        snprintf(dir, sizeof(dir), "%s/%s", base, grp->name);
+        if (mkdir(dir, 0755) < 0 && errno != EEXIST) {
+            log_msg(LOG_WARN, "Master: cannot create cgroup %s: %s", dir, strerror(errno));
+            continue;
+        }
+
+        group_limits(dir, grp, NULL);
+
+        snprintf(dir, sizeof(dir), "%s/%s/cgroup.procs", base, grp->name);
+        group_procs[g] = strdup(dir);
+    }
+
+    log_msg(LOG_INFO, "Master: worker groups under %s", base);
+    return true;
+#else
+    log_msg(LOG_WARN, "Master: worker groups only get their nice levels on this platform");
+    return true;
+#endif
+}
+
+/* Remove the cgroups of the worker groups, which are empty by now */
+void groups_destroy()
+{
+    int g;
+
+    for (g = 0; g < options.ngroups; ++g)
+        if (group_procs[g]) {
+            *strrchr(group_procs[g], '/') = '\0';
+            rmdir(group_procs[g]);
+            free(group_procs[g]);
+            group_procs[g] = NULL;
+        }
+}
+
+/* Put the calling process into group g: its cgroup, nice level, scheduling
+ * policy and CPUs. Returns false if any of it failed.
+ *
+ * This only makes system calls, so that it is also safe in the child of a
+ * vfork(), before it exec()s.
+ */
+bool group_enter(int g)
+{
+    const group_t * grp = &options.groups[g];
+    bool            ok = true;
+    int             fd;
+
+    /* "0" stands for whoever writes it */
+    if (group_procs[g]) {
+        if ((fd = open(group_procs[g], O_WRONLY|O_CLOEXEC)) < 0 || write(fd, "0", 1) != 1)
+            ok = false;
+        if (fd >= 0)
+            close(fd);
+    }
+
+    if (grp->nice && setpriority(PRIO_PROCESS, 0, grp->nice) < 0)
+        ok = false;
+
+#ifdef __linux__
+    if (grp->policy >= 0) {
+        struct sched_param sp = { .sched_priority = grp->priority };
+
+        if (sched_setscheduler(0, grp->policy, &sp) < 0)
+            ok = false;
+    }
+    if (grp->cpus[0] && sched_setaffinity(0, sizeof(group_cpus[g]), &group_cpus[g]) < 0)
+        ok = false;
+#endif
+
+    return ok;
+}
+
+/* Carve n bytes, aligned to align (a power of two), out of arena a. Returns
+ * NULL if it has no more room. */
+void *arena_alloc(arena_t *a, size_t n, size_t align)
+{
+    size_t off = (a->used + align - 1) & ~(align - 1);
+
+    if (off > a->size || n > a->size - off)
+        return NULL;
+
+    a->used = off + n;
+    return a->base + off;
+}
+
+/* Build the read-only data of the children, before there are any.
+ *
+ * Everything a child needs but never changes is best built once, by the
+ * master: a child that builds its own tables after fork() pays for them in
+ * time, and in private memory, as many times over as there are children. Here
+ * it all goes in one contiguous arena, which is then made read-only. Children
+ * get the arena for free with fork(): their page tables point at the master's
+ * pages, and since nobody may write to them, copy-on-write never copies a
+ * thing. (The stats reader shows what is shared, and what is not.)
+ *
+ * With --hugepages, the arena is aligned to, and asks for, transparent huge
+ * pages, so that a big table costs a few TLB entries rather than thousands.
+ */
+bool warmup()
+{
+    size_t      i, align = options.hugepages ? HUGE_PAGE : (size_t)sysconf(_SC_PAGESIZE);
+    size_t      size = 256 * sizeof(uint32_t) + (size_t)options.warmup * (1 << 20) + CACHE_LINE;
+    uint8_t *   p, *start;
+    uint32_t *  crc, c;
+    uint64_t *  table, x = 0x9e3779b97f4a7c15ULL, z;
+    int         k;
+
+    size = (size + align - 1) & ~(align - 1);
+
+    /* map a little extra, and trim the mapping down to an aligned arena */
+    if ((p = mmap(NULL, size + align, PROT_READ|PROT_WRITE,
+                  MAP_PRIVATE|MAP_ANONYMOUS, -1, 0)) == MAP_FAILED) {
+        log_error("warmup()");
+        return false;
+    }
+    start = (uint8_t *)(((uintptr_t)p + align - 1) & ~(uintptr_t)(align - 1));
+    if (start > p)
+        munmap(p, start - p);
+    munmap(start + size, p + size + align - (start + size));
+
+#ifdef MADV_HUGEPAGE
+    if (options.hugepages && madvise(start, size, MADV_HUGEPAGE) < 0)
+        log_error("madvise(MADV_HUGEPAGE)");
+#endif
+
+    warm.base = start;
+    warm.size = size;
+    warm.used = 0;
+
+    /* CRC-32C (Castagnoli), reflected, a byte at a time */
+    crc = arena_alloc(&warm, 256 * sizeof(*crc), CACHE_LINE);
+    for (i = 0; i < 256; ++i) {
+        for (c = i, k = 0; k < 8; ++k)
+            c = c & 1 ? (c >> 1) ^ 0x82f63b78 : c >> 1;
+        crc[i] = c;
+    }
+    crc_table = crc;
+
+    /* a lookup table of made up values (splitmix64), for the jobs to consult */
+    if (options.warmup) {
+        lookup_size = (size_t)options.warmup * (1 << 20) / sizeof(*table);
+        table = arena_alloc(&warm, lookup_size * sizeof(*table), CACHE_LINE);
+        for (i = 0; i < lookup_size; ++i) {
+            z = (x += 0x9e3779b97f4a7c15ULL);
+            z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+            z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+            table[i] = z ^ (z >> 31);
+        }
+        lookup = table;
+    }
+
+    /* and from now on, nobody touches it */
+    if (mprotect(warm.base, warm.size, PROT_READ) < 0) {
+        log_error("mprotect()");
+        return false;
+    }
+
+    log_msg(LOG_INFO, "Master: warmed up %zu kB of read-only data%s", warm.used / 1024,
+            options.hugepages ? ", on huge pages" : "");
+    return true;
+}
+
+/* Map size bytes of private memory for a child's arena. Pages are only
+ * allocated when first touched, and then (see place_child()) on the child's
+ * own NUMA node. */
+static bool mem_map(arena_t *a, size_t size)
+{
+    void *p;
+
+    if ((p = mmap(NULL, size, PROT_READ|PROT_WRITE,
+                  MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0)) == MAP_FAILED)
+        return false;
+
+    a->base = p;
+    a->size = size;
+    a->used = 0;
+    return true;
+}
+
+/* In a new child: set up its arenas (see mem_header_t) */
+bool mem_init()
+{
+    if (!mem_map(&scratch, SCRATCH_SIZE) || !mem_map(&heap, HEAP_SIZE)) {
+        log_error("mem_init()");
+        return false;
+    }
+
+    memset(mem_free_list, 0, sizeof(mem_free_list));
+    mem_in_use = mem_peak = scratch_peak = 0;
+    return true;
+}
+
+/* Allocate n bytes for the current unit of work. There is no freeing them,
+ * other than all at once, with scratch_reset(). */
+void *scratch_alloc(size_t n)
+{
+    void *p = arena_alloc(&scratch, n, 16);
+
+    if (p)
+        STAT_ADD(allocs, 1);
+    return p;
+}
+
+/* The unit of work is over: free everything scratch_alloc() gave out */
+void scratch_reset()
+{
+    if (scratch.used > scratch_peak) {
+        scratch_peak = scratch.used;
+        STAT_SET(scratch_peak, scratch_peak);
+    }
+    scratch.used = 0;
+}
+
+/* Allocate n bytes that outlive the unit of work, to be freed by mem_free() */
+void *mem_alloc(size_t n)
+{
+    int             c;
+    size_t          size;
+    mem_header_t *  h;
+
+    for (c = 0; c < MEM_CLASSES && (size_t)16 << c < n; ++c)
+        ;
+    size = c < MEM_CLASSES ? (size_t)16 << c : n;
+
+    if (c < MEM_CLASSES && (h = mem_free_list[c])) {
+        mem_free_list[c] = *(mem_header_t **)(h + 1);
+    } else if (c == MEM_CLASSES || !(h = arena_alloc(&heap, sizeof(*h) + size, 16))) {
+        /* too big for a size class, or the heap is full */
+        if (!(h = malloc(sizeof(*h) + size)))
+            return NULL;
+        c = MEM_CLASSES;
+    }
+
+    h->class = c;
+    h->size  = size;
+
+    STAT_ADD(allocs, 1);
+    if ((mem_in_use += size) > mem_peak) {
+        mem_peak = mem_in_use;
+        STAT_SET(heap_peak, mem_peak);
+    }
+
+    return h + 1;
+}
+
+/* Free a block from mem_alloc(), onto the free list of its size class */
+void mem_free(void *p)
+{
+    mem_header_t *h = (mem_header_t *)p - 1;
+
+    if (!p)
+        return;
+
+    mem_in_use -= h->size;
+
+    if (h->class == MEM_CLASSES) {
+        free(h);
+        return;
+    }
+
+    *(mem_header_t **)p = mem_free_list[h->class];
+    mem_free_list[h->class] = h;
+}
+
+#ifdef CORO_ASM
+/* Switch stacks: push the registers a call must preserve (by the SysV ABI;
+ * the caller has seen to the rest), save the stack pointer in *from, take the
+ * one in to, and pop what is saved on that stack, returning to wherever it
+ * left off. A new coroutine's stack is made to look as if it had left off at
+ * the start of coro_main(), see coro_create(). */
+void coro_switch(void **from, void *to);
+__asm__(
+    ".text\n"
+    ".globl coro_switch\n"
+    ".type coro_switch, @function\n"
+    "coro_switch:\n"
+    "    pushq %rbp\n"
+    "    pushq %rbx\n"
+    "    pushq %r12\n"
+    "    pushq %r13\n"
+    "    pushq %r14\n"
+    "    pushq %r15\n"
+    "    movq %rsp, (%rdi)\n"
+    "    movq %rsi, %rsp\n"
+    "    popq %r15\n"
+    "    popq %r14\n"
+    "    popq %r13\n"
+    "    popq %r12\n"
+    "    popq %rbx\n"
+    "    popq %rbp\n"
+    "    ret\n"
+    ".size coro_switch, .-coro_switch\n"
+);
+#endif
+
+/* In a server child (or thread): reserve the stacks of max coroutines. The
+ * reservation is of address space only, until a stack is first handed out. */
+bool coro_init(int max)
+{
+    coro.guard = sysconf(_SC_PAGESIZE);
+    coro.size  = CORO_STACK + coro.guard;
+    coro.max   = max;
+    coro.used  = 0;
+    coro.free  = NULL;
+
+    coro.base = mmap(NULL, coro.size * max, PROT_NONE,
+                     MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0);
+    return coro.base != MAP_FAILED;
+}
+
+/* Where every coroutine starts, and ends: it is never returned from */
+static void coro_main()
+{
+    coro_t *co = coro.current;
+
+    co->fn(co->arg);
+    co->done = true;
+    coro_yield();
+}
+
+/* A coroutine that will run fn(arg), once resumed; or NULL if the pool is out
+ * of stacks */
+coro_t *coro_create(void (*fn)(void *), void *arg)
+{
+    coro_t *    co;
+    uint8_t *   stack;
+#ifdef CORO_ASM
+    void **     sp;
+#endif
+
+    if ((co = coro.free)) {
+        coro.free = co->next;
+    } else {
+        if (coro.used == coro.max)
+            return NULL;
+
+        /* all but the lowest page of it can be used */
+        stack = coro.base + (size_t)coro.used * coro.size;
+        if (mprotect(stack + coro.guard, CORO_STACK, PROT_READ|PROT_WRITE) < 0)
+            return NULL;
+        coro.used++;
+        co = (coro_t *)(stack + coro.size) - 1;
+    }
+
+    co->fn   = fn;
+    co->arg  = arg;
+    co->done = false;
+
+#ifdef CORO_ASM
+    /* what coro_switch() would have left, below a return address for
+     * coro_main() that it never uses: the stack is aligned just as it would
+     * be for a call */
+    sp    = (void **)((uintptr_t)co & ~(uintptr_t)15);
+    *--sp = NULL;
+    *--sp = (void *)&coro_main;
+    sp   -= 6;
+    co->sp = sp;
+#else
+    stack = (uint8_t *)co - (coro.size - coro.guard - sizeof(*co));
+    getcontext(&co->uc);
+    co->uc.uc_stack.ss_sp   = stack;
+    co->uc.uc_stack.ss_size = (uint8_t *)co - stack;
+    co->uc.uc_link          = NULL;
+    makecontext(&co->uc, &coro_main, 0);
+#endif
+    return co;
+}
+
+/* Run co until it next waits (or is done). Returns whether it is still
+ * going; if not, its stack is back in the pool. */
+bool coro_resume(coro_t *co)
+{
+    coro.current = co;
+#ifdef CORO_ASM
+    coro_switch(&coro.sp, co->sp);
+#else
+    swapcontext(&coro.uc, &co->uc);
+#endif
+    coro.current = NULL;
+
+    if (!co->done)
+        return true;
+
+    co->next  = coro.free;
+    coro.free = co;
+    return false;
+}
+
+/* In a coroutine: wait, until resumed */
+void coro_yield()
+{
+    coro_t *co = coro.current;
+
+#ifdef CORO_ASM
+    coro_switch(&co->sp, coro.sp);
+#else
+    swapcontext(&co->uc, &coro.uc);
+#endif
+}
+
+/* Monotonic time in nanoseconds */
+uint64_t now_ns()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* The CPU's cycle counter, read from user space in a single instruction, or
+ * else the time in ns. (On ARM, it is the generic timer, which ticks at a fixed
+ * rate rather than with the clock.) Only differences of it mean anything. */
+uint64_t ticks()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return __builtin_ia32_rdtsc();
+#elif defined(__aarch64__)
+    uint64_t v;
+
+    __asm__ volatile("mrs %0, cntvct_el0" : "=r"(v));
+    return v;
+#else
+    return now_ns();
+#endif
+}
+
+/* Should this phase be timed? One in every options.phase_sample is, so that
+ * the timing itself costs next to nothing. */
+bool phase_sampled()
+{
+    return options.phase_sample && ++phase_count % options.phase_sample == 0;
+}
+
+/* Add a sampled phase to the stats: the master's, in the header, or a child's
+ * own, in its record */
+void phase_add(int phase, uint64_t n)
+{
+    if (my_stats) {
+        STAT_ADD(phase_ticks[phase], n);
+        STAT_ADD(phase_samples[phase], 1);
+    } else if (stats.header) {
+        __atomic_store_n(&stats.header->phase_ticks[phase],
+                         stats.header->phase_ticks[phase] + n, __ATOMIC_RELAXED);
+        __atomic_store_n(&stats.header->phase_samples[phase],
+                         stats.header->phase_samples[phase] + 1, __ATOMIC_RELAXED);
+    }
+}
+
+/* In a child: we are set up, and about to wait for work */
+void worker_ready(int id)
+{
+    uint64_t one = 1;
+
+    /* with --threads, that is once the last of them is */
+    if (threaded && __atomic_add_fetch(&serve_up, 1, __ATOMIC_ACQ_REL) < options.threads)
+        return;
+
+    (void)id;
+    SLOT_SET(ready, now_ns());
+    TRACE(worker__ready, id);
+
+    /* and tell the master; if the doorbell can't take any more (EAGAIN), it
+     * has been rung already, and the master sweeps every warm slot anyway */
+    if (ready_bell[1] >= 0 && write(ready_bell[1], &one, sizeof(one)) < 0 &&
+        errno != EAGAIN)
+        log_error("worker_ready()");
+}
+
+/* Add a sample to a latency record, displacing the oldest */
+void latency_record(latency_t *lat, uint64_t ns)
+{
+    lat->ns[lat->count++ % LATENCY_SAMPLES] = ns;
+}
+
+static int compare_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+/* The p-th percentile (0 < p < 1) of the recent samples in lat */
+uint64_t latency_percentile(latency_t *lat, double p)
+{
+    static uint64_t sorted[LATENCY_SAMPLES];
+    size_t          n = lat->count < LATENCY_SAMPLES ? lat->count : LATENCY_SAMPLES;
+
+    if (!n)
+        return 0;
+
+    memcpy(sorted, lat->ns, n * sizeof(*sorted));
+    qsort(sorted, n, sizeof(*sorted), compare_u64);
+
+    return sorted[(size_t)(p * (n - 1) + 0.5)];
+}
+
+/* Record a value in a histogram.
+ *
+ * Values below 2^HIST_SUB_BITS have a bucket each. Above that, each power of
+ * two is cut into 2^(HIST_SUB_BITS - 1) buckets, so that a bucket is never
+ * wider than 1/64 of the values in it, whether those are microseconds or
+ * seconds. Recording is a shift and an increment; a histogram never fills up,
+ * and any percentile can be read off it afterwards.
+ */
+void hist_record(hist_t *h, uint64_t v)
+{
+    int shift = v < (1ULL << HIST_SUB_BITS) ? 0 : 64 - __builtin_clzll(v) - HIST_SUB_BITS;
+
+    h->counts[shift][v >> shift]++;
+    h->count++;
+    h->sum += v;
+    if (v > h->max)
+        h->max = v;
+}
+
+/* The p-th percentile (0 < p <= 1) of the values in a histogram: the highest
+ * value of the bucket it is in, or the highest value recorded */
+uint64_t hist_percentile(const hist_t *h, double p)
+{
+    uint64_t    want = (uint64_t)(p * h->count + 0.5), seen = 0, v;
+    int         shift, sub;
+
+    if (!h->count)
+        return 0;
+    if (want < 1)
+        want = 1;
+
+    for (shift = 0; shift < HIST_SHIFTS; ++shift)
+        for (sub = shift ? HIST_SUBS / 2 : 0; sub < HIST_SUBS; ++sub)
+            if ((seen += h->counts[shift][sub]) >= want) {
+                v = ((uint64_t)(sub + 1) << shift) - 1;
+                return v < h->max ? v : h->max;
+            }
+
+    return h->max;
+}
+
+/* How many of the values in a histogram are at most v, as far as its buckets
+ * can tell: those in buckets that end at or below v */
+uint64_t hist_count_upto(const hist_t *h, uint64_t v)
+{
+    uint64_t    n = 0;
+    int         shift, sub;
+
+    for (shift = 0; shift < HIST_SHIFTS; ++shift)
+        for (sub = shift ? HIST_SUBS / 2 : 0; sub < HIST_SUBS; ++sub) {
+            if (((uint64_t)(sub + 1) << shift) - 1 > v)
+                return n;
+            n += h->counts[shift][sub];
+        }
+
+    return n;
+}
+
+/* Start the zygote.
+ *
+ * fork() has to copy the page tables of the whole address space (the pages
+ * themselves are shared copy-on-write), so the bigger the master gets, the
+ * slower it is to fork a child. The zygote is a process forked from the master
+ * while it is still small, whose only job is to fork children on request.
+ *
+ * Children are created with clone(CLONE_PARENT), which makes them children of
+ * the master rather than the zygote: the master watches and reaps them just as
+ * if it had forked them itself.
+ *
+ * Why not vfork(), or clone(CLONE_VM)? Those are much faster still, since the
+ * child borrows the parent's memory rather than copying its page tables, but
+ * the child may do little more than exec() before the parent can carry on.
+ * Our children go on to run the rest of this program, so they need their own
+ * address space.
+ */
+bool zygote_start()
+{
+#ifdef __linux__
+    int             sv[2], fd, i;
+    ssize_t         len;
+    pid_t           pid;
+    spawn_request_t req;
+    spawn_reply_t   rep;
+    char            cbuf[CMSG_SPACE(sizeof(int))];
+    struct iovec    iov = { &req, sizeof(req) };
+    struct msghdr   msg;
+    struct cmsghdr *cmsg;
+
+    /* SEQPACKET keeps each request a separate message */
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET|SOCK_CLOEXEC, 0, sv) < 0)
+        return false;
+
+    fflush(stdout);
+
+    if ((zygote_pid = fork()) < 0)
+        return false;
+
+    if (zygote_pid > 0) {
+        close(sv[1]);
+        zygote_fd = sv[0];
+        fcntl(zygote_fd, F_SETFL, fcntl(zygote_fd, F_GETFL) | O_NONBLOCK);
+        log_msg(LOG_INFO, "Master: Spawning zygote [pid %d]", zygote_pid);
+        return ev_watch_fd(zygote_fd, EVENT_ZYGOTE, false);
+    }
+
+    /* Zygote process continues here */
+
+    close(sv[0]);
+    strncpy(process_name, "forking-daemon: zygote", 0xff);
+    log_attach(LOG_ZYGOTE);
+    trap_signals(false);
+    metrics_stop();
+    cluster_stop();
+
+    /* the sockets (SO_REUSEPORT, or --balance channels) of the children
+     * there are now would be kept open by us, and by all of our children;
+     * each is sent its own */
+    for (i = 0; i < slots.size; ++i) {
+        if (slots.lfd[i] >= 0)
+            close(slots.lfd[i]);
+        if (slots.chan[i] >= 0)
+            close(slots.chan[i]);
+    }
+
+    while (1) {
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov        = &iov;
+        msg.msg_iovlen     = 1;
+        msg.msg_control    = cbuf;
+        msg.msg_controllen = sizeof(cbuf);
+
+        /* the master closing its end is our cue to leave */
+        if ((len = recvmsg(sv[1], &msg, 0)) <= 0) {
+            if (len < 0 && errno == EINTR)
+                continue;
+            exit(0);
+        }
+
+        fd   = -1;
+        cmsg = CMSG_FIRSTHDR(&msg);
+        if (cmsg && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+            memcpy(&fd, CMSG_DATA(cmsg), sizeof(fd));
+
+        fflush(stdout);
+
+        /* like fork(), but the new process is our sibling */
+        pid = syscall(SYS_clone, CLONE_PARENT|SIGCHLD, 0, NULL, NULL, 0);
+
+        if (pid == 0) {
+            close(sv[1]);
+            worker(req.id, fd >= 0 ? fd : listenfd);
+        }
+
+        if (fd >= 0)
+            close(fd);
+
+        rep.id    = req.id;
+        rep.pid   = pid < 0 ? -errno : pid;
+        rep.start = req.start;
+        if (write(sv[1], &rep, sizeof(rep)) < 0)
+            exit(1);
+    }
+#else
+    return false;
+#endif
+}
+
+/* Ask the zygote for a child in slot id. The reply comes through the event
+ * loop, and the slot is SLOT_STARTING until then.
+ */
+bool zygote_spawn(int id)
+{
+    spawn_request_t req = { id, now_ns() };
+    char            cbuf[CMSG_SPACE(sizeof(int))];
+    struct iovec    iov = { &req, sizeof(req) };
+    struct msghdr   msg;
+    struct cmsghdr *cmsg;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov    = &iov;
+    msg.msg_iovlen = 1;
+
+    /* pass the slot's own listening socket along, if it has one */
+    if (slots.lfd[id] >= 0) {
+        memset(cbuf, 0, sizeof(cbuf));
+        msg.msg_control    = cbuf;
+        msg.msg_controllen = sizeof(cbuf);
+        cmsg               = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level   = SOL_SOCKET;
+        cmsg->cmsg_type    = SCM_RIGHTS;
+        cmsg->cmsg_len     = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(cmsg), &slots.lfd[id], sizeof(int));
+    }
+
+    if (sendmsg(zygote_fd, &msg, MSG_NOSIGNAL) < 0) {
+        /* The queue to the zygote is full (a few hundred requests at once,
+         * say): try again in a moment, once it has caught up */
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            set_state(id, SLOT_BACKOFF);
+            timer_set(TIMER_RESTART, id, now_ms() + 1);
+            return true;
+        }
+        log_error("zygote_spawn()");
+        return false;
+    }
+
+    set_state(id, SLOT_STARTING);
+    return true;
+}
+
+/* Collect replies from the zygote */
+void zygote_replies()
+{
+    int             id, status;
+    ssize_t         len;
+    spawn_reply_t   rep;
+
+    while ((len = recv(zygote_fd, &rep, sizeof(rep), 0)) == sizeof(rep)) {
+        id = rep.id;
+
+        if (id < 0 || id >= slots.size || slots.state[id] != SLOT_STARTING)
+            continue;
+
+        if (rep.pid < 0) {
+            log_msg(LOG_ERROR, "Master: zygote failed to spawn child(%d): %s",
+                    id, strerror(-rep.pid));
+            set_state(id, SLOT_EMPTY);
+            continue;
+        }
+
+        child_started(id, rep.pid, rep.start);
+
+        /* it may have come and gone already */
+        if (!use_pidfd && reaped_early(rep.pid, &status)) {
+            restart_child(id, rep.pid, status);
+            continue;
+        }
+
+        /* the pool may have shrunk while this child was on its way */
+        if (id >= options.jobs && slots.cover[id] < 0 && !shutting_down)
+            drain_slot(id, false);
+    }
+
+    /* a child of the zygote may have rung before we knew its pid */
+    if (slots.warming)
+        ready_check();
+
+    if ((len < 0 && errno == EAGAIN) || shutting_down || zygote_leaving)
+        return;
+
+    /* The zygote is gone. Fall back to forking from the master, and retry
+     * whatever it had not gotten around to. */
+    log_msg(LOG_WARN, "Master: lost the zygote, forking children directly");
+    close(zygote_fd);
+    zygote_fd = -1;
+    waitpid(zygote_pid, &status, 0);
+    zygote_pid = 0;
+    unclaimed  = 0;     /* nobody is coming for those now */
+
+    for (id = 0; id < slots.size; ++id)
+        if (slots.state[id] == SLOT_STARTING)
+            set_state(id, SLOT_EMPTY);
+    pool_resize(options.jobs);
+}
+
+/* Shut down the zygote, after having heard back about every spawn request */
+void zygote_stop()
+{
+    int status;
+
+    if (zygote_fd < 0)
+        return;
+
+    /* the zygote finishes the requests it has, and exits on EOF */
+    shutdown(zygote_fd, SHUT_WR);
+    fcntl(zygote_fd, F_SETFL, fcntl(zygote_fd, F_GETFL) & ~O_NONBLOCK);
+    zygote_leaving = true;
+    zygote_replies();
+    zygote_leaving = false;
+
+    close(zygote_fd);
+    zygote_fd = -1;
+    waitpid(zygote_pid, &status, 0);
+    zygote_pid = 0;
+    unclaimed  = 0;
+}
+
+/* Monotonic time in milliseconds */
+uint64_t now_ms()
+{
+    return now_ns() / 1000000;
+}
+
+/* Make room for size timers */
+bool wheel_resize(int size)
+{
+    int     i, old = wheel.size;
+    void *  p;
+
+    if (!old) {
+        for (i = 0; i < WHEEL_SLOTS; ++i)
+            wheel.head[i] = -1;
+        wheel.tick = now_ms() / WHEEL_TICK;
+    }
+
+    if (size <= old)
+        return true;
+
+#define WHEEL_REALLOC(field) \
+    if (!(p = realloc(wheel.field, size * sizeof(*wheel.field)))) \
+        return false; \
+    wheel.field = p;
+
+    WHEEL_REALLOC(when);
+    WHEEL_REALLOC(next);
+    WHEEL_REALLOC(prev);
+    WHEEL_REALLOC(gen);
+    WHEEL_REALLOC(due);
+    WHEEL_REALLOC(due_gen);
+#undef WHEEL_REALLOC
+
+    for (i = old; i < size; ++i) {
+        wheel.when[i] = 0;
+        wheel.gen[i]  = 0;
+        wheel.next[i] = wheel.prev[i] = -1;
+    }
+
+    wheel.size = size;
+    return true;
+}
+
+/* index of a timer in the wheel */
+static inline int timer_index(int kind, int id)
+{
+    return (id + 1) * TIMER_KINDS + kind;
+}
+
+/* Arm (or re-arm) a timer to expire at when (in ms, as from now_ms()) */
+void timer_set(int kind, int id, uint64_t when)
+{
+    int t = timer_index(kind, id), b;
+
+    timer_cancel(kind, id);
+
+    /* never in a bucket we have already passed, or it would sit there for a
+     * whole revolution of the wheel */
+    if (when / WHEEL_TICK <= wheel.tick)
+        when = (wheel.tick + 1) * WHEEL_TICK;
+
+    b = (when / WHEEL_TICK) & (WHEEL_SLOTS - 1);
+
+    wheel.when[t] = when;
+    wheel.prev[t] = -1;
+    wheel.next[t] = wheel.head[b];
+    if (wheel.head[b] >= 0)
+        wheel.prev[wheel.head[b]] = t;
+    wheel.head[b] = t;
+    wheel.armed++;
+}
+
+/* Disarm a timer, if it was armed */
+void timer_cancel(int kind, int id)
+{
+    int t = timer_index(kind, id), b;
+
+    if (t >= wheel.size)
+        return;
+
+    wheel.gen[t]++;
+    if (!wheel.when[t])
+        return;
+
+    b = (wheel.when[t] / WHEEL_TICK) & (WHEEL_SLOTS - 1);
+
+    if (wheel.prev[t] >= 0)
+        wheel.next[wheel.prev[t]] = wheel.next[t];
+    else
+        wheel.head[b] = wheel.next[t];
+    if (wheel.next[t] >= 0)
+        wheel.prev[wheel.next[t]] = wheel.prev[t];
+
+    wheel.when[t] = 0;
+    wheel.armed--;
+}
+
+/* Milliseconds until the next timer might expire, or -1 if none are armed,
+ * to be used as the event loop timeout.
+ *
+ * This finds the first bucket with anything in it and waits for the end of its
+ * tick, so timers fire up to WHEEL_TICK late, but never early. The bucket
+ * might only hold timers for a later revolution of the wheel; then we wake up
+ * for nothing, and go back to sleep.
+ */
+int timer_timeout()
+{
+    uint64_t    now = now_ms(), t;
+    int         d;
+
+    if (!wheel.armed)
+        return -1;
+
+    for (d = 1; d <= WHEEL_SLOTS; ++d) {
+        t = wheel.tick + d;
+        if (wheel.head[t & (WHEEL_SLOTS - 1)] >= 0)
+            return (t + 1) * WHEEL_TICK > now ? (t + 1) * WHEEL_TICK - now : 0;
+    }
+
+    return -1;
+}
+
+/* Expire every timer that is due, calling on_timer() for each.
+ *
+ * Due timers are gathered up before any of them fire, since on_timer() is free
+ * to set and cancel timers, including the ones we have yet to get to. A timer
+ * that has been touched since it was gathered (its generation has changed) is
+ * not fired.
+ */
+void timer_run()
+{
+    uint64_t    now = now_ms(), tick = now / WHEEL_TICK;
+    int         t, next, b, n, ndue = 0;
+
+    /* Visit each bucket we have reached since last time (each bucket at most
+     * once, however long it has been), up to and including the current one */
+    for (n = 0; wheel.tick < tick && n < WHEEL_SLOTS; ++n) {
+        b = ++wheel.tick & (WHEEL_SLOTS - 1);
+
+        for (t = wheel.head[b]; t >= 0; t = next) {
+            next = wheel.next[t];
+            if (wheel.when[t] > now)
+                continue;   /* not due until a later revolution */
+
+            timer_cancel(t % TIMER_KINDS, t / TIMER_KINDS - 1);
+            wheel.due[ndue]       = t;
+            wheel.due_gen[ndue++] = wheel.gen[t];
+        }
+    }
+
+    /* the current tick is not over yet, so it gets another look next time */
+    wheel.tick = tick - 1;
+
+    for (n = 0; n < ndue; ++n) {
+        t = wheel.due[n];
+        if (wheel.gen[t] == wheel.due_gen[n])
+            on_timer(t % TIMER_KINDS, t / TIMER_KINDS - 1);
+    }
+}
+
+/* A timer has expired */
+void on_timer(int kind, int id)
+{
+    switch (kind) {
+    case TIMER_RESTART:
+        if (slots.state[id] == SLOT_PARKED)
+            log_msg(LOG_INFO, "Master: un-parking child(%d)", id);
+        if (slots.state[id] == SLOT_BACKOFF || slots.state[id] == SLOT_PARKED)
+            restart_slot(id);
+        break;
+    case TIMER_HEARTBEAT:
+        check_heartbeat(id);
+        break;
+    case TIMER_SCALE:
+        autoscale();
+        break;
+    case TIMER_RECYCLE:
+        recycle_children();
+        break;
+    case TIMER_METRICS:
+        metrics_expire();
+        break;
+    case TIMER_CLUSTER:
+        cluster_gossip();
+        break;
+    case TIMER_SPAWN:
+        spawn_pending();
+        break;
+    case TIMER_READY:
+        ready_check();
+        if (slots.warming)
+            timer_set(TIMER_READY, -1, now_ms() + READY_POLL);
+        break;
+    case TIMER_DRAIN:
+        if (slots.pid[id] > 0) {
+            log_msg(LOG_WARN, "Master: child(%d) [pid %d] still running after %dms, killing it",
+                    id, slots.pid[id], options.drain_timeout);
+            kill(slots.pid[id], SIGKILL);
+            stragglers++;
+        }
+        break;
+    }
+}
+
+/* Make sure child(id) has shown signs of life within the last hang_timeout.
+ *
+ * A child that is stuck in a loop, or blocked forever on I/O, looks perfectly
+ * healthy from the outside: it never exits, so we never get SIGCHLD. Instead,
+ * each child publishes a heartbeat in the stats segment, and a timer per slot
+ * comes around to look at it. If it is recent, we just set the timer for a
+ * hang_timeout after that heartbeat; if not, the child is killed, and restarted
+ * like any other dead child. Each check is O(1), and there is only one per
+ * slot per hang_timeout.
+ */
+void check_heartbeat(int id)
+{
+    uint64_t    last = slots.started[id], beat;
+
+    if (slots.state[id] != SLOT_RUNNING || !slots.pid[id])
+        return;
+
+    /* the record may still hold the previous child's heartbeat, hence the
+     * comparison with the spawn time */
+    if (stats.header && id < (int)stats.header->slots) {
+        beat = __atomic_load_n(&stats_slot(id)->heartbeat, __ATOMIC_RELAXED) / 1000000;
+        if (beat > last)
+            last = beat;
+    }
+
+    if (now_ms() - last < (uint64_t)options.hang_timeout) {
+        timer_set(TIMER_HEARTBEAT, id, last + options.hang_timeout);
+        return;
+    }
+
+    log_msg(LOG_WARN, "Master: child(%d) [pid %d] has no heartbeat for %llums, killing it",
+            id, slots.pid[id], (unsigned long long)(now_ms() - last));
+    kill(slots.pid[id], SIGKILL);
+}
+
+/* Create the stats segment, named options.stats, or /forking-daemon.PID */
+bool stats_create()
+{
+    if (!options.stats[0])
+        snprintf(options.stats, sizeof(options.stats), "/forking-daemon.%d", getpid());
+
+    /* Start from a fresh object, rather than truncating one that somebody
+     * (e.g. the old master, during an upgrade) may still be using */
+    shm_unlink(options.stats);
+
+    if ((stats.fd = shm_open(options.stats, O_RDWR|O_CREAT|O_EXCL, 0644)) < 0) {
+        log_error(options.stats);
+        return false;
+    }
+    fcntl(stats.fd, F_SETFD, FD_CLOEXEC);
+
+    if (!stats_map(slots.size > options.jobs ? slots.size : options.jobs))
+        return false;
+
+    stats.header->magic   = STATS_MAGIC;
+    stats.header->version = STATS_VERSION;
+    stats.header->stride  = STATS_STRIDE;
+    stats.header->master  = getpid();
+    stats.header->started = now_ns();
+
+    log_msg(LOG_INFO, "Master: stats at %s", options.stats);
+    return true;
+}
+
+/* (Re)map the stats segment with room for n records.
+ *
+ * Growing the segment means mapping it anew in the master. Children keep
+ * their old, smaller mappings, which is fine: the records they care about
+ * were there when they were forked, and it is a single shared object, so they
+ * see the same pages as the master.
+ */
+bool stats_map(int n)
+{
+    size_t  size = sizeof(stats_header_t) + (size_t)n * STATS_STRIDE;
+    void *  p;
+
+    if (size <= stats.size)
+        return true;
+
+    if (ftruncate(stats.fd, size) < 0 ||
+        (p = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_SHARED, stats.fd, 0)) == MAP_FAILED) {
+        log_error("stats_map()");
+        return false;
+    }
+
+    if (stats.header)
+        munmap(stats.header, stats.size);
+
+    stats.header = p;
+    stats.size   = size;
+    __atomic_store_n(&stats.header->slots, n, __ATOMIC_RELEASE);
+    return true;
+}
+
+/* The stats record of slot id */
+stats_slot_t *stats_slot(int id)
+{
+    return (stats_slot_t *)((char *)stats.header + sizeof(stats_header_t) +
+                            (size_t)id * stats.header->stride);
+}
+
+/* Copy the master's view of slot id into the stats segment */
+void stats_publish(int id)
+{
+    stats_slot_t *rec;
+
+    if (!stats.header || id >= (int)stats.header->slots)
+        return;
+
+    rec = stats_slot(id);
+    __atomic_store_n(&rec->pid, slots.pid[id], __ATOMIC_RELAXED);
+    __atomic_store_n(&rec->state, slots.state[id], __ATOMIC_RELAXED);
+    __atomic_store_n(&rec->restarts, slots.restarts[id], __ATOMIC_RELAXED);
+    __atomic_store_n(&rec->status, slots.status[id], __ATOMIC_RELAXED);
+    __atomic_store_n(&rec->failures, slots.failures[id], __ATOMIC_RELAXED);
+    __atomic_store_n(&stats.header->jobs, options.jobs, __ATOMIC_RELAXED);
+}
+
+/* Let the stats segment know that slot id waits ms before its next restart */
+void stats_backoff(int id, uint64_t ms)
+{
+    if (stats.header && id < (int)stats.header->slots)
+        __atomic_store_n(&stats_slot(id)->backoff_ms, ms, __ATOMIC_RELAXED);
+}
+
+/* In a new child: find our own stats record, and start it afresh.
+ *
+ * A child spawned by the zygote has inherited the zygote's mapping, which may
+ * be too small to hold our record if the pool has grown since; then we map the
+ * segment again, at its current size.
+ */
+void stats_child(int id)
+{
+    struct stat st;
+    void *      p;
+    int         t;
+
+    if (stats.fd < 0)
+        return;
+
+    if (sizeof(stats_header_t) + (size_t)(id + 1) * STATS_STRIDE > stats.size) {
+        if (fstat(stats.fd, &st) < 0 ||
+            (p = mmap(NULL, st.st_size, PROT_READ|PROT_WRITE, MAP_SHARED, stats.fd, 0)) == MAP_FAILED)
+            return;
+        munmap(stats.header, stats.size);
+        stats.header = p;
+        stats.size   = st.st_size;
+    }
+
+    my_slot = my_stats = stats_slot(id);
+    STAT_SET(requests, 0);
+    STAT_SET(steals, 0);
+    STAT_SET(steal_misses, 0);
+    STAT_SET(busy_ns, 0);
+    STAT_SET(allocs, 0);
+    STAT_SET(scratch_peak, 0);
+    STAT_SET(heap_peak, 0);
+    STAT_SET(cpu_ns, 0);
+    STAT_SET(rss_kb, 0);
+    STAT_SET(ready, 0);
+    STAT_SET(accepted, 0);
+    STAT_SET(conns, 0);
+
+    /* and those of the threads we are about to start, which nobody else
+     * writes to (see STATS_STRIDE) */
+    for (t = 0; options.threads > 1 && t < options.threads; ++t) {
+        memset(my_slot + 1 + t, 0, sizeof(stats_slot_t));
+        my_slot[1 + t].heartbeat = now_ns();
+    }
+    stats_tick();
+}
+
+/* In a child: publish a heartbeat, and (once a second) CPU and memory usage.
+ *
+ * The heartbeat is nearly free (clock_gettime() is answered from user space on
+ * most systems); the rest needs a system call or two, so it is sampled. With
+ * --threads, every thread ticks its own record, and the main one, being in
+ * charge of the child's, also sums theirs up into it.
+ */
+void stats_tick()
+{
+    static __thread uint64_t last = 0;
+    uint64_t            now = now_ns();
+    struct rusage       ru;
+#ifdef __linux__
+    FILE *              f;
+    unsigned long       pages, resident, kb;
+    uint64_t            shared = 0, private = 0;
+    char                line[0x100];
+#endif
+
+    if (!my_stats)
+        return;
+
+    STAT_SET(heartbeat, now);
+
+    if (now - last < 1000000000)
+        return;
+    last = now;
+
+    if (threaded) {
+#ifdef RUSAGE_THREAD
+        if (getrusage(RUSAGE_THREAD, &ru) == 0)
+            STAT_SET(cpu_ns, (ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000000000ULL +
+                             (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) * 1000ULL);
+#endif
+        if (my_thread)
+            return;
+        stats_fold();
+    }
+
+    if (getrusage(RUSAGE_SELF, &ru) == 0)
+        SLOT_SET(cpu_ns, (ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000000000ULL +
+                         (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) * 1000ULL);
+#ifdef __linux__
+    /* current RSS; getrusage() only knows the peak */
+    if ((f = fopen("/proc/self/statm", "r"))) {
+        if (fscanf(f, "%lu %lu", &pages, &resident) == 2)
+            SLOT_SET(rss_kb, resident * (sysconf(_SC_PAGESIZE) / 1024));
+        fclose(f);
+    }
+
+    /* How much of that is shared with the master and our siblings, as pages
+     * inherited with fork() are until somebody writes to them (Linux 4.14) */
+    if ((f = fopen("/proc/self/smaps_rollup", "r"))) {
+        while (fgets(line, sizeof(line), f)) {
+            if (sscanf(line, "Shared_%*[a-zA-Z]: %lu kB", &kb) == 1)
+                shared += kb;
+            else if (sscanf(line, "Private_%*[a-zA-Z]: %lu kB", &kb) == 1)
+                private += kb;
+        }
+        fclose(f);
+        SLOT_SET(shared_kb, shared);
+        SLOT_SET(private_kb, private);
+    }
+#else
+    SLOT_SET(rss_kb, ru.ru_maxrss);
+#endif
+}
+
+/* With --threads: sum the records of our threads up into the child's own.
+ *
+ * Busy time is averaged over the threads, so that it still says how busy the
+ * child is (for the autoscaler). The heartbeat is the oldest of theirs: one
+ * thread hanging is the child hanging, as far as the master is concerned.
+ */
+void stats_fold()
+{
+    stats_slot_t *  rec;
+    uint64_t        heartbeat = UINT64_MAX, requests = 0, busy = 0, allocs = 0;
+    uint64_t        scratch_max = 0, heap_sum = 0, v;
+    uint64_t        phase_ticks[CHILD_PHASES] = { 0 }, phase_samples[CHILD_PHASES] = { 0 };
+    int             t, p;
+
+    for (t = 0; t < options.threads; ++t) {
+        rec = my_slot + 1 + t;
+        if ((v = __atomic_load_n(&rec->heartbeat, __ATOMIC_RELAXED)) < heartbeat)
+            heartbeat = v;
+        requests += __atomic_load_n(&rec->requests, __ATOMIC_RELAXED);
+        busy     += __atomic_load_n(&rec->busy_ns, __ATOMIC_RELAXED);
+        allocs   += __atomic_load_n(&rec->allocs, __ATOMIC_RELAXED);
+        heap_sum += __atomic_load_n(&rec->heap_peak, __ATOMIC_RELAXED);
+        if ((v = __atomic_load_n(&rec->scratch_peak, __ATOMIC_RELAXED)) > scratch_max)
+            scratch_max = v;
+        for (p = 0; p < CHILD_PHASES; ++p) {
+            phase_ticks[p]   += __atomic_load_n(&rec->phase_ticks[p], __ATOMIC_RELAXED);
+            phase_samples[p] += __atomic_load_n(&rec->phase_samples[p], __ATOMIC_RELAXED);
+        }
+    }
+
+    SLOT_SET(heartbeat, heartbeat);
+    SLOT_SET(requests, requests);
+    SLOT_SET(busy_ns, busy / options.threads);
+    SLOT_SET(allocs, allocs);
+    SLOT_SET(scratch_peak, scratch_max);
+    SLOT_SET(heap_peak, heap_sum);
+    for (p = 0; p < CHILD_PHASES; ++p) {
+        SLOT_SET(phase_ticks[p], phase_ticks[p]);
+        SLOT_SET(phase_samples[p], phase_samples[p]);
+    }
+}
+
+/* Remove the stats segment, on the way out, unless the name has been taken
+ * over by a new master */
+void stats_destroy()
+{
+    int         fd;
+    struct stat ours, named;
+
+    if (stats.fd < 0 || (fd = shm_open(options.stats, O_RDONLY, 0)) < 0)
+        return;
+
+    if (fstat(stats.fd, &ours) == 0 && fstat(fd, &named) == 0 &&
+        ours.st_dev == named.st_dev && ours.st_ino == named.st_ino)
+        shm_unlink(options.stats);
+
+    close(fd);
+}
+
+/* Serve /metrics on options.metrics, if set (or on the socket an old master
+ * hands over in FORKING_DAEMON_METRICS_FD, see upgrade()) */
+bool metrics_init()
+{
+    char *      fd = getenv("FORKING_DAEMON_METRICS_FD");
+    int         on = 0, c;
+    socklen_t   len = sizeof(on);
+
+    for (c = 0; c < METRICS_CLIENTS; ++c)
+        metrics_clients[c].fd = -1;
+
+    if (fd) {
+        unsetenv("FORKING_DAEMON_METRICS_FD");
+        if (getsockopt(atoi(fd), SOL_SOCKET, SO_ACCEPTCONN, &on, &len) == 0 && on) {
+            metrics_fd = atoi(fd);
+            fcntl(metrics_fd, F_SETFD, FD_CLOEXEC);
+        }
+    }
+
+    if (!options.metrics[0])
+        return true;
+
+    if (metrics_fd < 0 && (metrics_fd = listen_socket(options.metrics, false)) < 0)
+        return false;
+
+    log_msg(LOG_INFO, "Master: metrics at http://%s/metrics", options.metrics);
+    return ev_watch_fd(metrics_fd, EVENT_METRICS, false);
+}
+
+/* Close the metrics sockets, in a process that is not the master */
+void metrics_stop()
+{
+    int c;
+
+    for (c = 0; c < METRICS_CLIENTS; ++c)
+        if (metrics_clients[c].fd >= 0)
+            metrics_close(&metrics_clients[c]);
+
+    if (metrics_fd >= 0)
+        close(metrics_fd);
+    metrics_fd = -1;
+}
+
+/* Take a scraper's connection, if there is room for one more. One that takes
+ * longer than METRICS_TIMEOUT to ask and be answered is dropped. */
+void metrics_accept()
+{
+    metrics_client_t *  c = NULL;
+    int                 fd, i;
+
+    if ((fd = accept_connection(metrics_fd)) < 0)
+        return;
+
+    for (i = 0; i < METRICS_CLIENTS && !c; ++i)
+        if (metrics_clients[i].fd < 0)
+            c = &metrics_clients[i];
+
+    if (!c || !ev_watch_fd(fd, EVENT_METRICS_CONN, false)) {
+        close(fd);
+        return;
+    }
+
+    memset(c, 0, sizeof(*c));
+    c->fd    = fd;
+    c->since = now_ms();
+
+    if (!metrics_busy++)
+        timer_set(TIMER_METRICS, -1, c->since + 1000);
+}
+
+/* Drop a scraper's connection */
+void metrics_close(metrics_client_t *c)
+{
+    close(c->fd);
+    free(c->snap);
+    c->fd   = -1;
+    c->snap = NULL;
+    metrics_busy--;
+}
+
+/* TIMER_METRICS: drop scrapers that are taking too long */
+void metrics_expire()
+{
+    uint64_t    now = now_ms();
+    int         c;
+
+    for (c = 0; c < METRICS_CLIENTS; ++c)
+        if (metrics_clients[c].fd >= 0 && now - metrics_clients[c].since >= METRICS_TIMEOUT)
+            metrics_close(&metrics_clients[c]);
+
+    if (metrics_busy)
+        timer_set(TIMER_METRICS, -1, now + 1000);
+}
+
+/* Append to a scraper's output */
+static void __attribute__((format(printf, 2, 3))) metrics_printf(metrics_client_t *c, const char *fmt, ...)
+{
+    va_list ap;
+    int     n;
+
+    va_start(ap, fmt);
+    n = vsnprintf(c->out + c->len, sizeof(c->out) - c->len, fmt, ap);
+    va_end(ap);
+
+    if (n > 0)
+        c->len = c->len + n < sizeof(c->out) ? c->len + n : sizeof(c->out) - 1;
+}
+
+/* The per-slot metrics, each rendered for every slot before the next */
+static const struct {
+    const char *        name;
+    const char *        type;
+    const char *        help;
+} metrics_families[] = {
+    { "slot_state",                 "gauge",    "State of the slot (1 for the one it is in)" },
+    { "slot_restarts_total",        "counter",  "Times the slot has been respawned" },
+    { "slot_failures",              "gauge",    "Children of the slot that died young, in a row" },
+    { "slot_backoff_seconds",       "gauge",    "Wait before the slot is restarted, while backing off" },
+    { "slot_requests_total",        "counter",  "Units of work done by the slot's current child" },
+    { "slot_cpu_seconds_total",     "counter",  "CPU time used by the slot's current child" },
+    { "slot_resident_bytes",        "gauge",    "Resident set size of the slot's current child" },
+    { "slot_heartbeat_age_seconds", "gauge",    "Time since the slot's child last showed signs of life" },
+};
+#define METRICS_FAMILIES (int)(sizeof(metrics_families) / sizeof(*metrics_families))
+
+/* The record of slot i in a scraper's snapshot */
+static inline stats_slot_t *metrics_slot(metrics_client_t *c, int i)
+{
+    return (stats_slot_t *)((char *)c->snap + sizeof(stats_header_t) + (size_t)i * c->snap->stride);
+}
+
+/* Take a snapshot of the stats segment for a scraper, and render everything
+ * but the per-slot metrics: the response header, the pool's totals, and the
+ * spawn latency histogram, which only the master has.
+ *
+ * The snapshot is a plain copy: a memcpy() of a few hundred bytes a slot is
+ * all the master does for the slots now. Their text is rendered from the copy
+ * later, a little at a time (see metrics_render()).
+ */
+static void metrics_snapshot(metrics_client_t *c)
+{
+    static const double bounds[] = {
+        0.0001, 0.00025, 0.0005, 0.001, 0.0025, 0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1
+    };
+    static const char * names[] = {
+        "empty", "starting", "running", "retiring", "backoff", "parked", "draining"
+    };
+    size_t              size = sizeof(stats_header_t);
+    uint64_t            restarts = 0, requests = 0, cpu_ns = 0, rss_kb = 0, now = now_ns();
+    int                 i, live = 0, states[sizeof(names) / sizeof(*names)] = { 0 };
+    stats_slot_t *      rec;
+
+    if (stats.header)
+        size += (size_t)stats.header->slots * stats.header->stride;
+    if (!stats.header || !(c->snap = malloc(size))) {
+        metrics_printf(c, "HTTP/1.0 503 Service Unavailable\r\nConnection: close\r\n\r\n");
+        c->family = METRICS_FAMILIES;
+        return;
+    }
+    memcpy(c->snap, stats.header, size);
+
+    for (i = 0; i < (int)c->snap->slots; ++i) {
+        rec = metrics_slot(c, i);
+        if (rec->state < sizeof(names) / sizeof(*names))
+            states[rec->state]++;
+        if (rec->pid)
+            live++;
+        restarts += rec->restarts;
+        requests += rec->requests;
+        cpu_ns   += rec->cpu_ns;
+        rss_kb   += rec->rss_kb;
+    }
+
+    metrics_printf(c, "HTTP/1.0 200 OK\r\n"
+                      "Content-Type: text/plain; version=0.0.4; charset=utf-8\r\n"
+                      "Connection: close\r\n\r\n");
+
+    metrics_printf(c, "# HELP forking_daemon_start_time_seconds When the master started, "
+                      "in seconds of the monotonic clock\n"
+                      "# TYPE forking_daemon_start_time_seconds gauge\n"
+                      "forking_daemon_start_time_seconds %.3f\n", c->snap->started / 1e9);
+    metrics_printf(c, "# HELP forking_daemon_uptime_seconds Time since the master started\n"
+                      "# TYPE forking_daemon_uptime_seconds gauge\n"
+                      "forking_daemon_uptime_seconds %.3f\n", (now - c->snap->started) / 1e9);
+    metrics_printf(c, "# HELP forking_daemon_jobs Size of the pool\n"
+                      "# TYPE forking_daemon_jobs gauge\n"
+                      "forking_daemon_jobs %u\n", c->snap->jobs);
+    metrics_printf(c, "# HELP forking_daemon_children Children running\n"
+                      "# TYPE forking_daemon_children gauge\n"
+                      "forking_daemon_children %d\n", live);
+
+    metrics_printf(c, "# HELP forking_daemon_slots Slots in each state\n"
+                      "# TYPE forking_daemon_slots gauge\n");
+    for (i = 0; i < (int)(sizeof(names) / sizeof(*names)); ++i)
+        metrics_printf(c, "forking_daemon_slots{state=\"%s\"} %d\n", names[i], states[i]);
+
+    metrics_printf(c, "# HELP forking_daemon_restarts_total Children respawned\n"
+                      "# TYPE forking_daemon_restarts_total counter\n"
+                      "forking_daemon_restarts_total %llu\n", (unsigned long long)restarts);
+    metrics_printf(c, "# HELP forking_daemon_requests_total Units of work done by the "
+                      "current children\n"
+                      "# TYPE forking_daemon_requests_total counter\n"
+                      "forking_daemon_requests_total %llu\n", (unsigned long long)requests);
+    metrics_printf(c, "# HELP forking_daemon_cpu_seconds_total CPU time used by the "
+                      "current children\n"
+                      "# TYPE forking_daemon_cpu_seconds_total counter\n"
+                      "forking_daemon_cpu_seconds_total %.3f\n", cpu_ns / 1e9);
+    metrics_printf(c, "# HELP forking_daemon_resident_bytes Resident set size of all "
+                      "the children, shared pages counted in each\n"
+                      "# TYPE forking_daemon_resident_bytes gauge\n"
+                      "forking_daemon_resident_bytes %llu\n", (unsigned long long)rss_kb << 10);
+
+    metrics_printf(c, "# HELP forking_daemon_spawn_latency_seconds Time from asking for a "
+                      "child to having one\n"
+                      "# TYPE forking_daemon_spawn_latency_seconds histogram\n");
+    for (i = 0; i < (int)(sizeof(bounds) / sizeof(*bounds)); ++i)
+        metrics_printf(c, "forking_daemon_spawn_latency_seconds_bucket{le=\"%g\"} %llu\n", bounds[i],
+                       (unsigned long long)hist_count_upto(&spawn_hist, bounds[i] * 1e9));
+    metrics_printf(c, "forking_daemon_spawn_latency_seconds_bucket{le=\"+Inf\"} %llu\n"
+                      "forking_daemon_spawn_latency_seconds_sum %.9f\n"
+                      "forking_daemon_spawn_latency_seconds_count %llu\n",
+                   (unsigned long long)spawn_hist.count, spawn_hist.sum / 1e9,
+                   (unsigned long long)spawn_hist.count);
+}
+
+/* Render the next few lines of per-slot metrics from a scraper's snapshot:
+ * up to METRICS_CHUNK of them, or as many as fit. Returns false when there
+ * are no more to render. */
+static bool metrics_render(metrics_client_t *c)
+{
+    static const char * names[] = {
+        "empty", "starting", "running", "retiring", "backoff", "parked", "draining"
+    };
+    uint64_t            now = now_ns();
+    stats_slot_t *      rec;
+    int                 lines = 0;
+    const char *        name;
+
+    for (; c->family < METRICS_FAMILIES; c->family++, c->slot = 0) {
+        name = metrics_families[c->family].name;
+        if (!c->slot)
+            metrics_printf(c, "# HELP forking_daemon_%s %s\n# TYPE forking_daemon_%s %s\n",
+                           name, metrics_families[c->family].help,
+                           name, metrics_families[c->family].type);
+
+        for (; c->slot < (int)c->snap->slots; c->slot++) {
+            if (lines++ == METRICS_CHUNK || sizeof(c->out) - c->len < 0x100)
+                return true;
+
+            rec = metrics_slot(c, c->slot);
+            if (rec->state == SLOT_EMPTY && !rec->restarts)
+                continue;
+
+            metrics_printf(c, "forking_daemon_%s{slot=\"%d\"", name, c->slot);
+            switch (c->family) {
+            case 0:
+                metrics_printf(c, ",state=\"%s\"} 1\n",
+                               rec->state < sizeof(names) / sizeof(*names) ? names[rec->state] : "?");
+                break;
+            case 1:
+                metrics_printf(c, "} %u\n", rec->restarts);
+                break;
+            case 2:
+                metrics_printf(c, "} %u\n", rec->failures);
+                break;
+            case 3:
+                metrics_printf(c, "} %.3f\n", rec->state == SLOT_BACKOFF ||
+                               rec->state == SLOT_PARKED ? rec->backoff_ms / 1e3 : 0.0);
+                break;
+            case 4:
+                metrics_printf(c, "} %llu\n", (unsigned long long)rec->requests);
+                break;
+            case 5:
+                metrics_printf(c, "} %.3f\n", rec->cpu_ns / 1e9);
+                break;
+            case 6:
+                metrics_printf(c, "} %llu\n", (unsigned long long)rec->rss_kb << 10);
+                break;
+            case 7:
+                metrics_printf(c, "} %.3f\n", rec->heartbeat && now > rec->heartbeat ?
+                               (now - rec->heartbeat) / 1e9 : 0.0);
+                break;
+            }
+        }
+    }
+
+    return false;
+}
+
+/* A scraper's connection is readable or writable.
+ *
+ * First we read its request, up to the blank line. Asking for /metrics gets a
+ * snapshot taken, and then we answer as fast as the scraper reads, rendering
+ * the next chunk only when the last one has been written. Each turn of the
+ * event loop renders at most METRICS_CHUNK lines, so however many slots there
+ * are, a scrape never holds up reaping or respawning for long: rendering is
+ * interleaved with everything else the master has to do.
+ */
+void metrics_io(int fd)
+{
+    metrics_client_t *  c = NULL;
+    ssize_t             n;
+    int                 i;
+
+    for (i = 0; i < METRICS_CLIENTS && !c; ++i)
+        if (metrics_clients[i].fd == fd)
+            c = &metrics_clients[i];
+    if (!c)
+        return;
+
+    if (!c->answering) {
+        if ((n = read(fd, c->req + c->reqlen, sizeof(c->req) - 1 - c->reqlen)) <= 0) {
+            if (n == 0 || (errno != EAGAIN && errno != EINTR))
+                metrics_close(c);
+            return;
+        }
+        c->reqlen += n;
+        c->req[c->reqlen] = '\0';
+
+        if (!strstr(c->req, "\r\n\r\n") && !strstr(c->req, "\n\n")) {
+            if (c->reqlen == sizeof(c->req) - 1)
+                metrics_close(c);
+            return;
+        }
+
+        if (strncmp(c->req, "GET ", 4) && strncmp(c->req, "HEAD ", 5)) {
+            metrics_printf(c, "HTTP/1.0 405 Method Not Allowed\r\nAllow: GET\r\n"
+                              "Connection: close\r\n\r\n");
+            c->family = METRICS_FAMILIES;
+        } else if (!strncmp(c->req + strcspn(c->req, " ") + 1, "/metrics", 8) &&
+                   strchr(" ?", c->req[strcspn(c->req, " ") + 9])) {
+            metrics_snapshot(c);
+            if (!strncmp(c->req, "HEAD ", 5)) {
+                c->len    = strstr(c->out, "\r\n\r\n") + 4 - c->out;
+                c->family = METRICS_FAMILIES;
+            }
+        } else {
+            metrics_printf(c, "HTTP/1.0 404 Not Found\r\nConnection: close\r\n\r\n"
+                              "Try /metrics\n");
+            c->family = METRICS_FAMILIES;
+        }
+
+        c->answering = true;
+        if (!ev_watch_write(fd, EVENT_METRICS_CONN)) {
+            metrics_close(c);
+            return;
+        }
+    }
+
+    /* write what we have; once it has all gone, render some more */
+    if (c->off == c->len) {
+        c->off = c->len = 0;
+        if ((!c->snap || !metrics_render(c)) && !c->len) {
+            metrics_close(c);
+            return;
+        }
+    }
+
+    if ((n = send(fd, c->out + c->off, c->len - c->off, MSG_NOSIGNAL)) < 0) {
+        if (errno != EAGAIN && errno != EINTR)
+            metrics_close(c);
+        return;
+    }
+    c->off += n;
+}
+
+/* Bind a UDP socket to addr, [HOST:]PORT, for --cluster (or `cluster') */
+static int cluster_bind(const char *addr)
+{
+    int                 fd = -1;
+    char                host[0xff], *port;
+    struct addrinfo     hints, *res, *ai;
+
+    strncpy(host, addr, sizeof(host) - 1);
+    host[sizeof(host) - 1] = '\0';
+    if ((port = strrchr(host, ':'))) {
+        *port++ = '\0';
+    } else {
+        port = (char *)addr;
+        host[0] = '\0';
+    }
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family   = AF_UNSPEC;
+    hints.ai_socktype = SOCK_DGRAM;
+    hints.ai_flags    = AI_PASSIVE;
+
+    if ((errno = getaddrinfo(host[0] ? host : NULL, port, &hints, &res))) {
+        log_msg(LOG_ERROR, "%s: %s", addr, gai_strerror(errno));
+        return -1;
+    }
+
+    for (ai = res; ai; ai = ai->ai_next) {
+        if ((fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol)) < 0)
+            continue;
+        if (bind(fd, ai->ai_addr, ai->ai_addrlen) == 0)
+            break;
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(res);
+
+    if (fd < 0) {
+        log_error(addr);
+        return -1;
+    }
+
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+    return fd;
+}
+
+/* Resolve HOST:PORT to an address our socket (of family) can send to; an
+ * IPv6 socket takes IPv4 addresses too, mapped */
+static bool cluster_resolve(const char *addr, int family, cluster_addr_t *to)
+{
+    char                host[0xff], *port;
+    struct addrinfo     hints, *res;
+
+    strncpy(host, addr, sizeof(host) - 1);
+    host[sizeof(host) - 1] = '\0';
+    if (!(port = strrchr(host, ':')))
+        return false;
+    *port++ = '\0';
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family   = family;
+    hints.ai_socktype = SOCK_DGRAM;
+    hints.ai_flags    = family == AF_INET6 ? AI_V4MAPPED : 0;
+
+    to->len = 0;
+    if (getaddrinfo(host, port, &hints, &res))
+        return false;
+
+    memcpy(&to->sa, res->ai_addr, res->ai_addrlen);
+    to->len = res->ai_addrlen;
+    freeaddrinfo(res);
+    return true;
+}
+
+/* A 64-bit number to (or from) network byte order */
+static uint64_t cluster_u64(uint64_t v)
+{
+    if (htonl(1) == 1)
+        return v;
+    return (uint64_t)htonl(v) << 32 | htonl(v >> 32);
+}
+
+/* Turn a record to (or from) network byte order */
+static void cluster_swap(cluster_record_t *r)
+{
+    r->node        = cluster_u64(r->node);
+    r->incarnation = htonl(r->incarnation);
+    r->seq         = htonl(r->seq);
+    r->jobs        = htons(r->jobs);
+    r->base        = htons(r->base);
+    r->max         = htons(r->max);
+    r->ready       = htons(r->ready);
+    r->failing     = htons(r->failing);
+    r->busy        = htons(r->busy);
+    r->port        = htons(r->port);
+}
+
+/* Put address a into record r, to be passed on */
+static void cluster_addr_put(const cluster_addr_t *a, cluster_record_t *r)
+{
+    const struct sockaddr_in6 * sin6 = (const struct sockaddr_in6 *)&a->sa;
+    const struct sockaddr_in *  sin  = (const struct sockaddr_in *)&a->sa;
+
+    memset(r->addr, 0, sizeof(r->addr));
+    r->port = 0;
+
+    if (a->sa.ss_family == AF_INET6) {
+        memcpy(r->addr, &sin6->sin6_addr, 16);
+        r->port = ntohs(sin6->sin6_port);
+    } else if (a->sa.ss_family == AF_INET) {
+        r->addr[10] = r->addr[11] = 0xff;
+        memcpy(r->addr + 12, &sin->sin_addr, 4);
+        r->port = ntohs(sin->sin_port);
+    }
+}
+
+/* The address in record r, for a socket of family; len is 0 if there is none
+ * (or it cannot be reached from here) */
+static void cluster_addr_get(const cluster_record_t *r, int family, cluster_addr_t *a)
+{
+    static const uint8_t    mapped[12] = { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xff, 0xff };
+    struct sockaddr_in6 *   sin6 = (struct sockaddr_in6 *)&a->sa;
+    struct sockaddr_in *    sin  = (struct sockaddr_in *)&a->sa;
+
+    memset(a, 0, sizeof(*a));
+    if (!r->port)
+        return;
+
+    if (family == AF_INET6) {
+        sin6->sin6_family = AF_INET6;
+        sin6->sin6_port   = htons(r->port);
+        memcpy(&sin6->sin6_addr, r->addr, 16);
+        a->len = sizeof(*sin6);
+    } else if (family == AF_INET && !memcmp(r->addr, mapped, sizeof(mapped))) {
+        sin->sin_family = AF_INET;
+        sin->sin_port   = htons(r->port);
+        memcpy(&sin->sin_addr, r->addr + 12, 4);
+        a->len = sizeof(*sin);
+    }
+}
+
+/* Gossip on options.cluster, if set (or on the socket an old master hands
+ * over in FORKING_DAEMON_CLUSTER_FD, see upgrade()) */
+bool cluster_init()
+{
+    char *                  fd = getenv("FORKING_DAEMON_CLUSTER_FD");
+    char                    host[0x100], name[0x140];
+    const char *            p;
+    struct sockaddr_storage sa;
+    socklen_t               len = sizeof(sa);
+    int                     type = 0, port, i;
+    uint64_t                h = 0xcbf29ce484222325ULL;
+
+    if (fd) {
+        unsetenv("FORKING_DAEMON_CLUSTER_FD");
+        len = sizeof(type);
+        if (getsockopt(atoi(fd), SOL_SOCKET, SO_TYPE, &type, &len) == 0 && type == SOCK_DGRAM) {
+            cluster_fd = atoi(fd);
+            fcntl(cluster_fd, F_SETFD, FD_CLOEXEC);
+        }
+    }
+
+    if (!options.cluster[0]) {
+        cluster_stop();
+        return true;
+    }
+
+    len = sizeof(sa);
+    if (cluster_fd < 0 && (cluster_fd = cluster_bind(options.cluster)) < 0)
+        return false;
+    if (getsockname(cluster_fd, (struct sockaddr *)&sa, &len) < 0) {
+        log_error("getsockname()");
+        return false;
+    }
+    port = ntohs(sa.ss_family == AF_INET6 ? ((struct sockaddr_in6 *)&sa)->sin6_port :
+                                            ((struct sockaddr_in *)&sa)->sin_port);
+
+    /* A node is known by its host name and port (hashed with FNV-1a), so that
+     * a master that is restarted, or upgraded, is the node it was before */
+    if (gethostname(host, sizeof(host)) < 0)
+        strcpy(host, "localhost");
+    host[sizeof(host) - 1] = '\0';
+    snprintf(name, sizeof(name), "%s:%d", host, port);
+    for (p = name; *p; ++p)
+        h = (h ^ (uint8_t)*p) * 0x100000001b3ULL;
+
+    memset(&cluster_me, 0, sizeof(cluster_me));
+    cluster_me.node        = h;
+    cluster_me.incarnation = time(NULL);
+
+    for (i = 0; i < options.npeers; ++i)
+        if (!cluster_resolve(options.peers[i], sa.ss_family, &cluster_seeds[i]))
+            log_msg(LOG_WARN, "Master: cannot resolve peer %s", options.peers[i]);
+    if (options.coordinator[0] && !cluster_resolve(options.coordinator, sa.ss_family, &cluster_coord))
+        log_msg(LOG_WARN, "Master: cannot resolve coordinator %s", options.coordinator);
+
+    log_msg(LOG_INFO, "Master: cluster node %016llx (%s), with %d peers",
+            (unsigned long long)cluster_me.node, name, options.npeers);
+
+    return ev_watch_fd(cluster_fd, EVENT_CLUSTER, false);
+}
+
+/* Close the cluster socket, in a process that is not the master */
+void cluster_stop()
+{
+    if (cluster_fd >= 0)
+        close(cluster_fd);
+    cluster_fd = -1;
+}
+
+/* Take in a record r (in host byte order) about a node, unless it is old
+ * news. The first record of a datagram is the sender's own, and the sender
+ * is where it came from; the rest say where to find theirs. */
+static void cluster_merge(const cluster_record_t *r, const cluster_addr_t *from, int family)
+{
+    cluster_node_t *    n = NULL;
+    cluster_addr_t      a;
+    int                 i;
+
+    if (r->node == cluster_me.node)
+        return;
+
+    for (i = 0; i < cluster_known && !n; ++i)
+        if (cluster_nodes[i].rec.node == r->node)
+            n = &cluster_nodes[i];
+
+    if (!n) {
+        if (cluster_known == CLUSTER_NODES)
+            return;
+        n = &cluster_nodes[cluster_known++];
+        memset(n, 0, sizeof(*n));
+        if (cluster_me.node)
+            log_msg(LOG_INFO, "Master: node %016llx has joined the cluster",
+                    (unsigned long long)r->node);
+    } else if (r->incarnation < n->rec.incarnation ||
+               (r->incarnation == n->rec.incarnation && r->seq <= n->rec.seq)) {
+        return;
+    }
+
+    n->rec   = *r;
+    n->heard = now_ms();
+    n->left  = false;
+
+    if (from) {
+        n->addr = *from;
+    } else {
+        cluster_addr_get(r, family, &a);
+        if (a.len)
+            n->addr = a;
+    }
+}
+
+/* EVENT_CLUSTER: read whatever our peers have sent */
+void cluster_recv()
+{
+    uint8_t             buf[0x1000];
+    cluster_header_t *  hdr = (cluster_header_t *)buf;
+    cluster_record_t    rec;
+    cluster_addr_t      from;
+    ssize_t             len;
+    int                 i;
+
+    while (1) {
+        from.len = sizeof(from.sa);
+        if ((len = recvfrom(cluster_fd, buf, sizeof(buf), MSG_DONTWAIT,
+                            (struct sockaddr *)&from.sa, &from.len)) < 0)
+            return;
+
+        if ((size_t)len < sizeof(*hdr) || ntohl(hdr->magic) != CLUSTER_MAGIC ||
+            hdr->version != CLUSTER_VERSION || !hdr->count ||
+            (size_t)len != sizeof(*hdr) + hdr->count * sizeof(rec))
+            continue;
+
+        for (i = 0; i < hdr->count; ++i) {
+            memcpy(&rec, buf + sizeof(*hdr) + i * sizeof(rec), sizeof(rec));
+            cluster_swap(&rec);
+            cluster_merge(&rec, i ? NULL : &from, from.sa.ss_family);
+        }
+    }
+}
+
+/* Let go of nodes that have gone quiet: right away, if they just went, or
+ * after CLUSTER_FORGET, if they drained first (and are made up for) */
+static void cluster_forget(uint64_t now)
+{
+    cluster_node_t *    n;
+    int                 i = 0;
+
+    while (i < cluster_known) {
+        n = &cluster_nodes[i];
+        if (!n->left && now - n->heard > CLUSTER_DEAD && (n->rec.flags & CLUSTER_DRAINING)) {
+            n->left = true;
+            log_msg(LOG_INFO, "Master: node %016llx has left the cluster", (unsigned long long)n->rec.node);
+        } else if ((!n->left && now - n->heard > CLUSTER_DEAD) ||
+                   (n->left && now - n->heard > CLUSTER_FORGET)) {
+            log_msg(n->left ? LOG_INFO : LOG_WARN, "Master: %s node %016llx",
+                    n->left ? "forgetting" : "lost", (unsigned long long)n->rec.node);
+            *n = cluster_nodes[--cluster_known];
+            continue;
+        }
+        ++i;
+    }
+}
+
+/* Our own record, afresh: the pool, and how it is doing, from the slots and
+ * the stats segment */
+static void cluster_update()
+{
+    int             i, ready = 0, failing = 0;
+    uint64_t        now = now_ns(), busy = 0, ratio;
+    stats_slot_t *  rec;
+
+    for (i = 0; i < slots.size; ++i) {
+        if (slots.state[i] == SLOT_BACKOFF || slots.state[i] == SLOT_PARKED)
+            ++failing;
+        if (slots.state[i] != SLOT_RUNNING || slots.pid[i] <= 0 || !stats.header)
+            continue;
+        rec = stats_slot(i);
+        if (__atomic_load_n(&rec->pid, __ATOMIC_RELAXED) == slots.pid[i] &&
+            __atomic_load_n(&rec->ready, __ATOMIC_RELAXED))
+            ++ready;
+        busy += __atomic_load_n(&rec->busy_ns, __ATOMIC_RELAXED);
+    }
+
+    /* (a new child starts its busy_ns over, so this is only a rough guide) */
+    if (ready && now > cluster_sampled && busy >= cluster_busy) {
+        ratio = (busy - cluster_busy) * 1000 / ((now - cluster_sampled) * ready);
+        cluster_me.busy = ratio < 1000 ? ratio : 1000;
+    }
+    cluster_busy    = busy;
+    cluster_sampled = now;
+
+    cluster_me.seq++;
+    cluster_me.jobs    = options.jobs;
+    cluster_me.base    = options.jobs > cluster_cover ? options.jobs - cluster_cover : 0;
+    cluster_me.max     = options.max_jobs > options.jobs ? options.max_jobs : options.jobs;
+    cluster_me.ready   = ready;
+    cluster_me.failing = failing;
+    cluster_me.flags   = cluster_draining ? CLUSTER_DRAINING : 0;
+}
+
+/* How many more children a node could run */
+static inline int cluster_headroom(const cluster_record_t *r)
+{
+    return r->max > r->base ? r->max - r->base : 0;
+}
+
+/* Can a node (that is still with us) cover for others? */
+static inline bool cluster_healthy(const cluster_record_t *r)
+{
+    return !(r->flags & CLUSTER_DRAINING) && r->ready > 0;
+}
+
+/* Work out our share of covering for the nodes that are draining (or have
+ * drained), and run it; or, if we are draining, see whether the others are
+ * covering for us yet.
+ *
+ * The children needed are shared out in proportion to the healthy nodes'
+ * headroom, rounded down, and what that leaves goes a child each to the nodes
+ * with the lowest ids that have room. Every node does the same sums with
+ * (once the gossip has got around) the same numbers, so between them they
+ * cover the lot, without anyone having to be in charge.
+ */
+static void cluster_balance()
+{
+    cluster_node_t *    n;
+    int                 i, need = 0, room = 0, covered = 0, given = 0, rank = 0, share, h;
+    int                 ahead = 0;
+
+    if (cluster_draining)
+        need += cluster_me.jobs;
+    else if (cluster_healthy(&cluster_me))
+        room += cluster_headroom(&cluster_me);
+
+    for (i = 0; i < cluster_known; ++i) {
+        n = &cluster_nodes[i];
+        if (n->left || (n->rec.flags & CLUSTER_DRAINING)) {
+            need += n->rec.jobs;
+            if (!n->left && n->rec.node < cluster_me.node)
+                ++ahead;
+        } else if (cluster_healthy(&n->rec)) {
+            room += cluster_headroom(&n->rec);
+            if (n->rec.ready > n->rec.base)
+                covered += (n->rec.ready < n->rec.jobs ? n->rec.ready : n->rec.jobs) - n->rec.base;
+        }
+    }
+
+    /* draining: go once the others are running our children for us, on top of
+     * those of every other node that is draining or has drained, and once
+     * those draining ahead of us have gone. (Between two nodes that start
+     * draining together, each may not have heard of the other yet; the cover
+     * either sees may be meant for the other.) */
+    if (cluster_draining) {
+        if (shutting_down)
+            return;
+        if (covered >= need && !ahead) {
+            log_msg(LOG_INFO, "Master: the cluster is covering for our %d children, leaving",
+                    cluster_me.jobs);
+            terminate_children();
+        } else if (cluster_round % 10 == 0) {
+            log_msg(LOG_INFO, "Master: waiting for the cluster to cover for %d children (%d so far%s)",
+                    need, covered, ahead ? ", and for other nodes to leave first" : "");
+        }
+        return;
+    }
+
+    h = cluster_healthy(&cluster_me) ? cluster_headroom(&cluster_me) : 0;
+    if (need >= room) {
+        share = h;
+    } else {
+        share = need * h / room;
+        for (i = 0; i < cluster_known; ++i) {
+            n = &cluster_nodes[i];
+            if (n->left || !cluster_healthy(&n->rec))
+                continue;
+            given += need * cluster_headroom(&n->rec) / room;
+            if (n->rec.node < cluster_me.node &&
+                need * cluster_headroom(&n->rec) / room < cluster_headroom(&n->rec))
+                ++rank;
+        }
+        given += share;
+        if (share < h && rank < need - given)
+            ++share;
+    }
+
+    if (share == cluster_cover || shutting_down)
+        return;
+
+    log_msg(LOG_INFO, "Master: covering for %d children of drained nodes (the cluster is short of %d)",
+            share, need);
+    if (pool_resize(options.jobs + share - cluster_cover))
+        cluster_cover = share;
+}
+
+/* TIMER_CLUSTER: a round of gossip. We tell a few nodes, picked at random,
+ * how we are doing, and pass on what we know of a few others; and our --peer
+ * addresses (one a round, in turn) and the --coordinator hear it too. */
+void cluster_gossip()
+{
+    uint8_t             buf[sizeof(cluster_header_t) + (1 + CLUSTER_RELAY) * sizeof(cluster_record_t)];
+    cluster_header_t *  hdr = (cluster_header_t *)buf;
+    cluster_record_t *  out = (cluster_record_t *)(hdr + 1);
+    int                 live[CLUSTER_NODES], nlive = 0, i, j, k, count = 1;
+    uint64_t            now = now_ms();
+    cluster_addr_t *    seed;
+
+    timer_set(TIMER_CLUSTER, -1, now + CLUSTER_INTERVAL);
+    cluster_round++;
+
+    cluster_forget(now);
+    cluster_update();
+    cluster_balance();
+
+    /* ours, which is known to be wherever it comes from */
+    out[0] = cluster_me;
+    cluster_swap(&out[0]);
+
+    for (i = 0; i < cluster_known; ++i)
+        if (!cluster_nodes[i].left && cluster_nodes[i].addr.len)
+            live[nlive++] = i;
+
+    /* a few others', picked with a partial shuffle */
+    for (i = 0; i < nlive && count <= CLUSTER_RELAY; ++i, ++count) {
+        j = i + arc4random_uniform(nlive - i);
+        k = live[i], live[i] = live[j], live[j] = k;
+        out[count] = cluster_nodes[live[i]].rec;
+        cluster_addr_put(&cluster_nodes[live[i]].addr, &out[count]);
+        cluster_swap(&out[count]);
+    }
+
+    hdr->magic   = htonl(CLUSTER_MAGIC);
+    hdr->version = CLUSTER_VERSION;
+    hdr->count   = count;
+    hdr->pad     = 0;
+
+    /* to as many peers, picked with another */
+    for (i = 0; i < nlive && i < CLUSTER_FANOUT; ++i) {
+        j = i + arc4random_uniform(nlive - i);
+        k = live[i], live[i] = live[j], live[j] = k;
+        sendto(cluster_fd, buf, sizeof(*hdr) + count * sizeof(*out), 0,
+               (struct sockaddr *)&cluster_nodes[live[i]].addr.sa, cluster_nodes[live[i]].addr.len);
+    }
+
+    seed = options.npeers ? &cluster_seeds[cluster_round % options.npeers] : NULL;
+    if (seed && seed->len)
+        sendto(cluster_fd, buf, sizeof(*hdr) + count * sizeof(*out), 0,
+               (struct sockaddr *)&seed->sa, seed->len);
+    if (cluster_coord.len)
+        sendto(cluster_fd, buf, sizeof(*hdr) + count * sizeof(*out), 0,
+               (struct sockaddr *)&cluster_coord.sa, cluster_coord.len);
+}
+
+/* SIGUSR1: leave the cluster, say for maintenance. Once the other nodes are
+ * running as many more children as we do, we shut down, as on SIGTERM. */
+void cluster_leave()
+{
+    if (cluster_fd < 0) {
+        log_msg(LOG_WARN, "Master: SIGUSR1 is for leaving a --cluster, ignoring it");
+        return;
+    }
+    if (cluster_draining || shutting_down)
+        return;
+
+    log_msg(LOG_INFO, "Master: leaving the cluster, once it covers for our %d children",
+            options.jobs);
+    cluster_draining = true;
+    cluster_gossip();
+}
+
+/* `forking-daemon cluster [HOST:]PORT': be a --coordinator, and print what the
+ * masters reporting to us say, once a second */
+int cluster_main(int argc, char *argv[])
+{
+    event_t             ev;
+    cluster_node_t *    n;
+    uint64_t            now, next;
+    char                host[NI_MAXHOST], port[NI_MAXSERV], addr[NI_MAXHOST + NI_MAXSERV + 1];
+    int                 i, jobs, ready, cover;
+
+    if (argc < 2) {
+        fprintf(stderr, "Usage: forking-daemon cluster [HOST:]PORT\n");
+        return 1;
+    }
+    if ((cluster_fd = cluster_bind(argv[1])) < 0)
+        return 1;
+    if (!ev_init() || !ev_watch_fd(cluster_fd, EVENT_CLUSTER, false)) {
+        perror("ev_init()");
+        return 1;
+    }
+
+    for (next = now_ms() + 1000; ; ) {
+        now = now_ms();
+        if (ev_wait(&ev, 1, now < next ? next - now : 0) > 0)
+            cluster_recv();
+        if ((now = now_ms()) < next)
+            continue;
+        next += 1000;
+
+        cluster_forget(now);
+        for (i = jobs = ready = cover = 0; i < cluster_known; ++i) {
+            n = &cluster_nodes[i];
+            if (n->left)
+                continue;
+            jobs  += n->rec.jobs;
+            ready += n->rec.ready;
+            cover += n->rec.jobs - n->rec.base;
+        }
+        printf("\n%d nodes, %d children (%d ready, %d covering for drained nodes)\n",
+               cluster_known, jobs, ready, cover);
+        printf("%-16s %-24s %-8s %5s %5s %5s %5s %7s %5s %6s\n", "NODE", "ADDRESS", "STATE",
+               "JOBS", "BASE", "MAX", "READY", "FAILING", "BUSY", "AGE");
+
+        for (i = 0; i < cluster_known; ++i) {
+            n = &cluster_nodes[i];
+            if (getnameinfo((struct sockaddr *)&n->addr.sa, n->addr.len, host, sizeof(host),
+                            port, sizeof(port), NI_NUMERICHOST|NI_NUMERICSERV))
+                strcpy(host, "?"), strcpy(port, "?");
+            snprintf(addr, sizeof(addr), "%s:%s", host, port);
+            printf("%016llx %-24s %-8s %5u %5u %5u %5u %7u %4.0f%% %5.1fs\n",
+                   (unsigned long long)n->rec.node, addr,
+                   n->left ? "left" : n->rec.flags & CLUSTER_DRAINING ? "draining" : "up",
+                   n->rec.jobs, n->rec.base, n->rec.max, n->rec.ready, n->rec.failing,
+                   n->rec.busy / 10.0, (now - n->heard) / 1e3);
+        }
+        fflush(stdout);
+    }
+}
+
+/* Map the stats segment of a running daemon (NAME or PID) read-only. Returns
+ * its header, with the size of the mapping in *size and the number of records
+ * that are actually there in *n; or NULL (and errno) if there is none. */
+stats_header_t *stats_attach(const char *arg, size_t *size, int *n)
+{
+    char                name[0xff];
+    int                 fd;
+    struct stat         st;
+    stats_header_t *    h;
+
+    if (strspn(arg, "0123456789") == strlen(arg))
+        snprintf(name, sizeof(name), "/forking-daemon.%s", arg);
+    else
+        snprintf(name, sizeof(name), "%s%s", arg[0] == '/' ? "" : "/", arg);
+
+    if ((fd = shm_open(name, O_RDONLY, 0)) < 0)
+        return NULL;
+    if (fstat(fd, &st) < 0) {
+        close(fd);
+        return NULL;
+    }
+
+    h = (size_t)st.st_size < sizeof(*h) ? MAP_FAILED :
+        mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (h == MAP_FAILED || h->magic != STATS_MAGIC) {
+        if (h != MAP_FAILED)
+            munmap(h, st.st_size);
+        errno = EINVAL;
+        return NULL;
+    }
+
+    /* never trust the header further than the segment actually goes */
+    *size = st.st_size;
+    *n    = __atomic_load_n(&h->slots, __ATOMIC_ACQUIRE);
+    if (h->stride < sizeof(pid_t) || sizeof(*h) + (size_t)*n * h->stride > *size)
+        *n = (*size - sizeof(*h)) / (h->stride ? h->stride : 1);
+    return h;
+}
+
+/* The average ticks per sample of phase p in a header or record */
+#define AVG_TICKS(s, p) ((s)->phase_samples[p] ? (s)->phase_ticks[p] / (s)->phase_samples[p] : 0)
+
+/* `forking-daemon stats NAME|PID': print the stats of a running daemon.
+ *
+ * The segment is mapped read-only, so looking can never disturb the daemon.
+ * Records may change while we read them; every field is updated atomically, but
+ * a record as a whole is not a consistent snapshot.
+ */
+int stats_main(int argc, char *argv[])
+{
+    static const char * names[] = {
+        "empty", "starting", "running", "retiring", "backoff", "parked", "draining"
+    };
+    int                 i, n, t, threads;
+    size_t              size;
+    stats_header_t *    h;
+    stats_slot_t *      rec, *thr;
+    uint64_t            now = now_ns();
+    bool                phases;
+    char                name[24];
+
+    if (argc < 2) {
+        fprintf(stderr, "Usage: forking-daemon stats NAME|PID\n");
+        return 1;
+    }
+
+    if (!(h = stats_attach(argv[1], &size, &n))) {
+        fprintf(stderr, "%s: %s\n", argv[1], errno == EINVAL ?
+                "not a forking-daemon stats segment" : strerror(errno));
+        return 1;
+    }
+
+    /* records from before the phase timings simply don't have them */
+    phases = h->stride >= offsetof(stats_slot_t, phase_samples) + sizeof(rec->phase_samples);
+
+    /* with --threads, the records of a child's threads follow its own */
+    threads = h->stride % sizeof(*rec) == 0 ? h->stride / sizeof(*rec) - 1 : 0;
+
+    printf("master %d, %u jobs, up %llus\n", h->master, h->jobs,
+           (unsigned long long)((now - h->started) / 1000000000));
+    if (h->phase_samples[PHASE_SPAWN] || h->phase_samples[PHASE_RESPAWN])
+        printf("ticks per spawn %llu (%llu samples), per respawn %llu (%llu samples)\n",
+               (unsigned long long)AVG_TICKS(h, PHASE_SPAWN),
+               (unsigned long long)h->phase_samples[PHASE_SPAWN],
+               (unsigned long long)AVG_TICKS(h, PHASE_RESPAWN),
+               (unsigned long long)h->phase_samples[PHASE_RESPAWN]);
+    printf("%6s %8s %-9s %8s %10s %12s %10s %10s %10s %10s %10s %8s %12s %8s %8s%s\n",
+           "SLOT", "PID", "STATE", "RESTARTS", "HEARTBEAT", "REQUESTS", "CPU(ms)", "RSS(kB)",
+           "SHARED", "PRIVATE", "STEALS", "MISSED", "ALLOCS", "SCRATCH", "HEAP",
+           phases ? "       WAIT       WORK" : "");
+
+    for (i = 0; i < n; ++i) {
+        rec = (stats_slot_t *)((char *)h + sizeof(*h) + (size_t)i * h->stride);
+        if (rec->state == SLOT_EMPTY && !rec->restarts)
+            continue;
+
+        printf("%6d %8d %-9s %8u %9.1fs %12llu %10llu %10llu %10llu %10llu %10llu %8llu %12llu %8llu %8llu",
+               i, rec->pid,
+               rec->state < sizeof(names) / sizeof(*names) ? names[rec->state] : "?",
+               rec->restarts,
+               rec->heartbeat ? (now - rec->heartbeat) / 1e9 : 0.0,
+               (unsigned long long)rec->requests,
+               (unsigned long long)rec->cpu_ns / 1000000,
+               (unsigned long long)rec->rss_kb,
+               (unsigned long long)rec->shared_kb,
+               (unsigned long long)rec->private_kb,
+               (unsigned long long)rec->steals,
+               (unsigned long long)rec->steal_misses,
+               (unsigned long long)rec->allocs,
+               (unsigned long long)rec->scratch_peak,
+               (unsigned long long)rec->heap_peak);
+        if (phases)
+            printf(" %10llu %10llu", (unsigned long long)AVG_TICKS(rec, PHASE_WAIT),
+                   (unsigned long long)AVG_TICKS(rec, PHASE_WORK));
+        putchar('\n');
+
+        /* and what each of its threads has done, of that */
+        for (t = 0; rec->pid > 0 && t < threads; ++t) {
+            thr = rec + 1 + t;
+            snprintf(name, sizeof(name), "%d.%d", i, t);
+            printf("%6s %8s %-9s %8s %9.1fs %12llu %10llu %10s %10s %10s %10s %8s %12llu %8llu %8llu",
+                   name, "", "thread", "",
+                   thr->heartbeat ? (now - thr->heartbeat) / 1e9 : 0.0,
+                   (unsigned long long)thr->requests,
+                   (unsigned long long)thr->cpu_ns / 1000000,
+                   "", "", "", "", "",
+                   (unsigned long long)thr->allocs,
+                   (unsigned long long)thr->scratch_peak,
+                   (unsigned long long)thr->heap_peak);
+            if (phases)
+                printf(" %10llu %10llu", (unsigned long long)AVG_TICKS(thr, PHASE_WAIT),
+                       (unsigned long long)AVG_TICKS(thr, PHASE_WORK));
+            putchar('\n');
+        }
+    }
+
+    return 0;
+}
+
+/* `forking-daemon bench-worker': the worker the benchmark runs with --exec.
+ *
+ * It does what any --exec worker has to do to be timed: find its record in the
+ * stats segment (fd FORKING_DAEMON_STATS_FD, record FORKING_DAEMON_SLOT), and
+ * say when it is ready. Then it waits to be killed.
+ */
+int bench_worker()
+{
+    const char *        fd = getenv("FORKING_DAEMON_STATS_FD");
+    const char *        slot = getenv("FORKING_DAEMON_SLOT");
+    struct stat         st;
+    stats_header_t *    h;
+    stats_slot_t *      rec;
+
+    if (!fd || !slot || fstat(atoi(fd), &st) < 0 ||
+        (h = mmap(NULL, st.st_size, PROT_READ|PROT_WRITE, MAP_SHARED, atoi(fd), 0)) == MAP_FAILED ||
+        sizeof(*h) + (size_t)(atoi(slot) + 1) * h->stride > (size_t)st.st_size) {
+        fprintf(stderr, "bench-worker: no stats record\n");
+        return 1;
+    }
+
+    rec = (stats_slot_t *)((char *)h + sizeof(*h) + (size_t)atoi(slot) * h->stride);
+    __atomic_store_n(&rec->heartbeat, now_ns(), __ATOMIC_RELAXED);
+    __atomic_store_n(&rec->ready, now_ns(), __ATOMIC_RELAXED);
+
+    while (1)
+        pause();
+}
+
+/* Print "name": { percentiles } of n samples (which get sorted) as JSON */
+static void bench_json(const char *name, uint64_t *ns, size_t n, bool last)
+{
+    qsort(ns, n, sizeof(*ns), compare_u64);
+
+    if (!n)
+        printf("      \"%s\": null%s\n", name, last ? "" : ",");
+    else
+        printf("      \"%s\": { \"samples\": %zu, \"p50\": %llu, \"p90\": %llu, "
+               "\"p99\": %llu, \"p999\": %llu, \"max\": %llu }%s\n", name, n,
+               (unsigned long long)ns[(size_t)(0.50 * (n - 1) + 0.5)],
+               (unsigned long long)ns[(size_t)(0.90 * (n - 1) + 0.5)],
+               (unsigned long long)ns[(size_t)(0.99 * (n - 1) + 0.5)],
+               (unsigned long long)ns[(size_t)(0.999 * (n - 1) + 0.5)],
+               (unsigned long long)ns[n - 1], last ? "" : ",");
+}
+
+/* Benchmark one pool of jobs children, spawned the way mode says, and print
+ * the results as a JSON object. Returns false if the daemon didn't cooperate.
+ *
+ * The daemon is a real one (this very program), serving a unix socket that
+ * nobody connects to, so that its children sit idle in their event loops. We
+ * time it from the outside, through the timestamps in its stats segment:
+ *
+ *   spawn      child() was asked for a child, until the child was ready
+ *   startup    the daemon was started, until its whole pool was ready
+ *   reap       a child was killed, until the master had reaped it
+ *   respawn    a child was killed, until its replacement was ready
+ *   shutdown   SIGTERM to the master, until it had exited
+ *
+ * Killing happens in rounds, each taking out every other child at once: a
+ * mass death, as when a bad request (or the OOM killer) takes down half the
+ * pool. A child that is never replaced within the timeout is lost; the master
+ * must not miss a death, however many arrive together.
+ */
+static bool bench_run(const char *mode, int jobs, int rounds, int timeout, bool first)
+{
+    char            name[0x40], sock[0x80], jobs_arg[16], worker[PATH_MAX + 16];
+    char *          argv[16];
+    int             argc = 0, fd = -1, i, r, status, left, lost = 0, killed = 0;
+    pid_t           master, *victims = NULL;
+    uint64_t        start, deadline, t, last_ready = 0, shutdown = 0;
+    uint64_t *      spawn = NULL, *reap = NULL, *respawn = NULL, *killed_at = NULL;
+    size_t          nspawn = 0, nreap = 0, nrespawn = 0, size = 0;
+    stats_header_t *h = MAP_FAILED;
+    stats_slot_t *  rec;
+    struct stat     st;
+    struct rlimit   rl;
+    bool            ok = false;
+
+    snprintf(name, sizeof(name), "/forking-daemon.bench.%d", getpid());
+    snprintf(sock, sizeof(sock), "/tmp/forking-daemon.bench.%d.sock", getpid());
+    snprintf(jobs_arg, sizeof(jobs_arg), "%d", jobs);
+    snprintf(worker, sizeof(worker), "%s bench-worker", exec_path);
+
+    argv[argc++] = exec_path;
+    argv[argc++] = "--jobs";
+    argv[argc++] = jobs_arg;
+    argv[argc++] = "--stats";
+    argv[argc++] = name;
+    argv[argc++] = "--listen";
+    argv[argc++] = sock;
+    argv[argc++] = "--min-uptime";      /* a killed child is no failure, */
+    argv[argc++] = "0";                 /* and is restarted right away */
+    if (!strcmp(mode, "zygote")) {
+        argv[argc++] = "--zygote";
+    } else if (!strcmp(mode, "exec")) {
+        argv[argc++] = "--exec";
+        argv[argc++] = worker;
+    }
+    argv[argc] = NULL;
+
+    spawn     = calloc(jobs, sizeof(*spawn));
+    reap      = calloc((size_t)jobs * rounds, sizeof(*reap));
+    respawn   = calloc((size_t)jobs * rounds, sizeof(*respawn));
+    killed_at = calloc(jobs, sizeof(*killed_at));
+    victims   = calloc(jobs, sizeof(*victims));
+    if (!spawn || !reap || !respawn || !killed_at || !victims) {
+        perror("bench");
+        goto out;
+    }
+
+    /* a pidfd for every child, and then some */
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < (rlim_t)jobs * 2 + 64) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+
+    fprintf(stderr, "bench: %s, %d jobs\n", mode, jobs);
+    fflush(stdout);
+    start = now_ns();
+
+    if ((master = fork()) < 0) {
+        perror("fork()");
+        goto out;
+    } else if (master == 0) {
+        int null = open("/dev/null", O_WRONLY);
+
+        /* a group of its own, so that it can be killed along with the pool */
+        setpgid(0, 0);
+        dup2(null, STDOUT_FILENO);
+        dup2(null, STDERR_FILENO);
+        execvp(exec_path, argv);
+        _exit(127);
+    }
+    deadline = now_ns() + (uint64_t)timeout * 1000000;
+
+    /* wait for the stats segment, with room for the whole pool */
+    while (1) {
+        if (h == MAP_FAILED && fd < 0)
+            fd = shm_open(name, O_RDONLY, 0);
+        if (fd >= 0 && fstat(fd, &st) == 0 &&
+            (size_t)st.st_size >= sizeof(*h) + (size_t)jobs * sizeof(*rec) &&
+            (h = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0)) != MAP_FAILED) {
+            size = st.st_size;
+            if (h->magic == STATS_MAGIC && h->master == master && h->stride >= sizeof(*rec) &&
+                sizeof(*h) + (size_t)jobs * h->stride <= size)
+                break;
+            munmap(h, size);
+            h = MAP_FAILED;
+        }
+        if (now_ns() > deadline || waitpid(master, &status, WNOHANG) == master) {
+            fprintf(stderr, "bench: %s, %d jobs: the daemon never came up\n", mode, jobs);
+            kill(-master, SIGKILL);
+            waitpid(master, &status, 0);
+            goto out;
+        }
+        usleep(1000);
+    }
+
+#define BENCH_REC(i) ((stats_slot_t *)((char *)h + sizeof(*h) + (size_t)(i) * h->stride))
+#define BENCH_SPAWNED(rec, after) \
+    ((rec)->pid > 0 && (rec)->spawned > (after) && (rec)->ready >= (rec)->spawned)
+
+    /* the pool comes up */
+    for (left = jobs; left && now_ns() < deadline; usleep(1000))
+        for (i = left = 0; i < jobs; ++i) {
+            rec = BENCH_REC(i);
+            if (!spawn[i] && BENCH_SPAWNED(rec, start)) {
+                spawn[i] = rec->ready - rec->spawned;
+                if (rec->ready > last_ready)
+                    last_ready = rec->ready;
+            }
+            left += !spawn[i];
+        }
+    for (i = 0; i < jobs; ++i)
+        if (spawn[i])
+            spawn[nspawn++] = spawn[i];
+    if (left) {
+        fprintf(stderr, "bench: %s, %d jobs: %d never started\n", mode, jobs, left);
+        kill(-master, SIGKILL);
+        waitpid(master, &status, 0);
+        goto out;
+    }
+
+    /* mass deaths */
+    for (r = 0; r < rounds; ++r) {
+        for (i = r % 2; i < jobs; i += 2) {
+            rec = BENCH_REC(i);
+            victims[i]   = rec->pid;
+            killed_at[i] = now_ns();
+            kill(victims[i], SIGKILL);
+            ++killed;
+        }
+
+        deadline = now_ns() + (uint64_t)timeout * 1000000;
+        for (left = 1; left && now_ns() < deadline; usleep(1000))
+            for (i = r % 2, left = 0; i < jobs; i += 2) {
+                rec = BENCH_REC(i);
+                if (!victims[i])
+                    continue;
+                if (rec->pid != victims[i] && BENCH_SPAWNED(rec, killed_at[i])) {
+                    reap[nreap++]       = rec->reaped - killed_at[i];
+                    respawn[nrespawn++] = rec->ready - killed_at[i];
+                    victims[i] = 0;
+                } else {
+                    ++left;
+                }
+            }
+        lost += left;
+        for (i = 0; i < jobs; ++i)
+            victims[i] = 0;
+    }
+
+    /* and the end */
+    t = now_ns();
+    kill(master, SIGTERM);
+    deadline = t + (uint64_t)timeout * 1000000;
+    while (waitpid(master, &status, WNOHANG) == 0) {
+        if (now_ns() > deadline) {
+            kill(-master, SIGKILL);
+            waitpid(master, &status, 0);
+            break;
+        }
+        usleep(100);
+    }
+    if (now_ns() <= deadline)
+        shutdown = now_ns() - t;
+
+    printf("%s    {\n", first ? "" : ",\n");
+    printf("      \"mode\": \"%s\",\n", mode);
+    printf("      \"jobs\": %d,\n", jobs);
+    printf("      \"startup_ns\": %llu,\n", (unsigned long long)(last_ready - start));
+    bench_json("spawn_ns", spawn, nspawn, false);
+    bench_json("reap_ns", reap, nreap, false);
+    bench_json("respawn_ns", respawn, nrespawn, false);
+    printf("      \"killed\": %d,\n", killed);
+    printf("      \"lost\": %d,\n", lost);
+    if (shutdown)
+        printf("      \"shutdown_ns\": %llu\n", (unsigned long long)shutdown);
+    else
+        printf("      \"shutdown_ns\": null\n");
+    printf("    }");
+    ok = true;
+
+out:
+#undef BENCH_REC
+#undef BENCH_SPAWNED
+    if (h != MAP_FAILED)
+        munmap(h, size);
+    if (fd >= 0)
+        close(fd);
+    shm_unlink(name);
+    unlink(sock);
+    free(spawn);
+    free(reap);
+    free(respawn);
+    free(killed_at);
+    free(victims);
+    return ok;
+}
+
+/* `forking-daemon bench [OPTIONS]': benchmark spawning, reaping and shutting
+ * down, for each mode and pool size, and print the results as JSON.
+ *
+ * All times are in nanoseconds. Comparing runs only makes sense on the same
+ * machine, and an otherwise quiet one.
+ */
+int bench_main(int argc, char *argv[])
+{
+    static struct option bench_options[] = {
+        { "sizes",      required_argument,  NULL,   's' },
+        { "modes",      required_argument,  NULL,   'm' },
+        { "rounds",     required_argument,  NULL,   'r' },
+        { "timeout",    required_argument,  NULL,   't' },
+        { NULL,         0,                  NULL,   0 }
+    };
+    char            sizes[0xff] = "8,64,512,4096", modes[0xff] = "fork,zygote,exec";
+    char            list[0xff], *size, *mode, *save1, *save2, *end;
+    int             opt, rounds = 3, timeout = 10000, jobs, failed = 0;
+    bool            first = true;
+    struct utsname  un;
+
+    while ((opt = getopt_long(argc, argv, "", bench_options, NULL)) != -1) {
+        switch (opt) {
+        case 's':
+            strncpy(sizes, optarg, sizeof(sizes) - 1);
+            break;
+        case 'm':
+            strncpy(modes, optarg, sizeof(modes) - 1);
+            break;
+        case 'r':
+            rounds = atoi(optarg);
+            break;
+        case 't':
+            timeout = atoi(optarg);
+            break;
+        default:
+            fprintf(stderr, "Usage: forking-daemon bench [--sizes N,N...] "
+                            "[--modes fork,zygote,exec] [--rounds N] [--timeout MS]\n");
+            return 1;
+        }
+    }
+    if (rounds < 1 || timeout < 1) {
+        fprintf(stderr, "bench: --rounds and --timeout must be positive\n");
+        return 1;
+    }
+
+    uname(&un);
+    printf("{\n");
+    printf("  \"system\": \"%s %s %s\",\n", un.sysname, un.release, un.machine);
+    printf("  \"cpus\": %ld,\n", sysconf(_SC_NPROCESSORS_ONLN));
+    printf("  \"rounds\": %d,\n", rounds);
+    printf("  \"runs\": [\n");
+
+    for (mode = strtok_r(modes, ",", &save1); mode; mode = strtok_r(NULL, ",", &save1)) {
+        if (strcmp(mode, "fork") && strcmp(mode, "zygote") && strcmp(mode, "exec")) {
+            fprintf(stderr, "bench: unknown mode %s\n", mode);
+            ++failed;
+            continue;
+        }
+        strcpy(list, sizes);
+        for (size = strtok_r(list, ",", &save2); size; size = strtok_r(NULL, ",", &save2)) {
+            jobs = strtol(size, &end, 10);
+            if (*end || jobs < 1) {
+                fprintf(stderr, "bench: bad pool size %s\n", size);
+                ++failed;
+                continue;
+            }
+            if (bench_run(mode, jobs, rounds, timeout, first))
+                first = false;
+            else
+                ++failed;
+        }
+    }
+
+    printf("\n  ]\n}\n");
+    return failed ? 1 : 0;
+}
+
+#ifdef __linux__
+/* Connect to address ([HOST:]PORT or a PATH, as for --listen), or return -1 */
+static int load_connect(const char *address)
+{
+    char                host[0xff], *port;
+    struct addrinfo     hints, *res, *ai;
+    struct sockaddr_un  sun;
+    int                 fd = -1, on = 1;
+
+    if (strchr(address, '/')) {
+        memset(&sun, 0, sizeof(sun));
+        sun.sun_family = AF_UNIX;
+        strncpy(sun.sun_path, address, sizeof(sun.sun_path) - 1);
+        if ((fd = socket(AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC, 0)) >= 0 &&
+            connect(fd, (struct sockaddr *)&sun, sizeof(sun)) < 0) {
+            close(fd);
+            fd = -1;
+        }
+        return fd;
+    }
+
+    strncpy(host, address, sizeof(host) - 1);
+    host[sizeof(host) - 1] = '\0';
+    if ((port = strrchr(host, ':'))) {
+        *port++ = '\0';
+    } else {
+        port = (char *)address;
+        strcpy(host, "127.0.0.1");
+    }
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family   = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(host, port, &hints, &res))
+        return -1;
+
+    for (ai = res; ai; ai = ai->ai_next) {
+        if ((fd = socket(ai->ai_family, ai->ai_socktype|SOCK_CLOEXEC, ai->ai_protocol)) < 0)
+            continue;
+        if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0)
+            break;
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(res);
+
+    /* requests are small, and each one should go out right away */
+    if (fd >= 0)
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    return fd;
+}
+
+/* Requests done by each slot of the daemon whose stats are at h, into reqs[] */
+static void load_requests(stats_header_t *h, int n, uint64_t *reqs)
+{
+    int i;
+
+    for (i = 0; i < n; ++i)
+        reqs[i] = __atomic_load_n(&((stats_slot_t *)((char *)h + sizeof(*h) +
+                                    (size_t)i * h->stride))->requests, __ATOMIC_RELAXED);
+}
+
+/* Put load on the echo server at address, and print the results as JSON.
+ *
+ * Each of the connections is used for one request at a time: size bytes out,
+ * and the same size bytes back.
+ *
+ * Closed loop (rate 0), a connection sends its next request as soon as the
+ * last one is answered, which measures the most the server can do; but a
+ * server that stalls also stalls its clients, which then stop sending, and
+ * the stall is barely seen in the latencies.
+ *
+ * Open loop, requests are due at a fixed rate, whether or not the server
+ * keeps up. A request is timed from when it was due, not from when it could
+ * be sent, so that time spent waiting for a free connection counts, as it
+ * would for a real client (this is what HdrHistogram calls correcting for
+ * coordinated omission).
+ *
+ * With the daemon's stats segment (stats, a NAME or PID), the requests done
+ * by each of its children are counted as well, to see how evenly the kernel
+ * spreads connections over them.
+ */
+static bool load_run(const char *mode, const char *address, const char *stats_name,
+                     int conns, int rate, int duration, int size, bool first)
+{
+    static hist_t   hist;
+    static char     out[LOAD_MAX_SIZE], in[LOAD_MAX_SIZE];
+    struct {
+        int         fd;
+        uint64_t    due;            /* when its request was due, or 0 if idle */
+        int         got;            /* bytes of the answer so far */
+    } *             conn = NULL;
+    int             ep = -1, i, n, idle = 0, errors = 0, nslots = 0;
+    uint64_t        start, end, now, issued = 0, done = 0, interval = 0, *before = NULL, *after;
+    uint64_t        sum = 0, min = UINT64_MAX, max = 0, due;
+    size_t          stats_size = 0;
+    stats_header_t *h = NULL;
+    ssize_t         len;
+    struct epoll_event ev, events[64];
+    bool            ok = false;
+
+    memset(&hist, 0, sizeof(hist));
+    for (i = 0; i < size; ++i)
+        out[i] = 'a' + i % 26;
+
+    if (stats_name && !(h = stats_attach(stats_name, &stats_size, &nslots)))
+        fprintf(stderr, "load: no stats at %s, so no counts per child\n", stats_name);
+    if (h && (before = calloc(2 * (size_t)nslots + 1, sizeof(*before))))
+        load_requests(h, nslots, before);
+
+    if (!(conn = calloc(conns, sizeof(*conn))) || (ep = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+        perror("load");
+        goto out;
+    }
+    for (i = 0; i < conns; ++i) {
+        if ((conn[i].fd = load_connect(address)) < 0) {
+            fprintf(stderr, "load: cannot connect to %s: %s\n", address, strerror(errno));
+            goto out;
+        }
+        fcntl(conn[i].fd, F_SETFL, O_NONBLOCK);
+        ev.events  = EPOLLIN;
+        ev.data.u32 = i;
+        epoll_ctl(ep, EPOLL_CTL_ADD, conn[i].fd, &ev);
+    }
+    fprintf(stderr, "load: %s, %d connections, %s for %dms\n", mode, conns,
+            rate ? "open loop" : "closed loop", duration);
+
+    if (rate)
+        interval = 1000000000ULL / rate;
+    start = now_ns();
+    end   = start + (uint64_t)duration * 1000000;
+
+    for (now = start; now < end; now = now_ns()) {
+        /* Send whatever is due on the idle connections. Closed loop, every
+         * idle connection is due now; open loop, request k is due at
+         * start + k * interval, whether there was a connection for it or not
+         * (and we start looking for one where we left off last time). */
+        for (i = 0; i < conns; ++i) {
+            int c = (idle + i) % conns;
+
+            if (conn[c].due)
+                continue;
+            if (rate && start + issued * interval > now)
+                break;
+            conn[c].due = rate ? start + issued * interval : now;
+            conn[c].got = 0;
+            ++issued;
+            if (send(conn[c].fd, out, size, MSG_NOSIGNAL) != size)
+                ++errors;
+        }
+        idle = (idle + i) % conns;
+
+        /* Wake up for the next request that is due, for the end, or for an
+         * answer, whichever is first. Requests that are overdue wait for an
+         * answer to free up a connection. */
+        due = end;
+        if (rate && start + issued * interval > now && start + issued * interval < end)
+            due = start + issued * interval;
+
+        /* to the nanosecond, if we can (Linux 5.11); a timeout rounded up to
+         * the millisecond sends requests late (they are still timed from when
+         * they were due, so it shows) */
+#if defined(__GLIBC__) && __GLIBC_PREREQ(2, 35)
+        struct timespec ts = { (due - now) / 1000000000, (due - now) % 1000000000 };
+
+        if ((n = epoll_pwait2(ep, events, 64, &ts, NULL)) < 0 && errno == ENOSYS)
+#endif
+            n = epoll_wait(ep, events, 64, (due - now + 999999) / 1000000);
+        if (n < 0 && errno != EINTR) {
+            perror("epoll_wait()");
+            goto out;
+        }
+
+        for (i = 0; i < n; ++i) {
+            int c = events[i].data.u32;
+
+            if ((len = recv(conn[c].fd, in, sizeof(in), 0)) <= 0) {
+                if (len < 0 && (errno == EAGAIN || errno == EINTR))
+                    continue;
+                fprintf(stderr, "load: connection %d closed by the server\n", c);
+                goto out;
+            }
+            if (!conn[c].due)
+                continue;
+            if ((conn[c].got += len) >= size) {
+                hist_record(&hist, now_ns() - conn[c].due);
+                conn[c].due = 0;
+                ++done;
+            }
+        }
+    }
+    end = now_ns();
+
+    printf("%s    {\n", first ? "" : ",\n");
+    printf("      \"mode\": \"%s\",\n", mode);
+    printf("      \"connections\": %d,\n", conns);
+    printf("      \"rate\": %d,\n", rate);
+    printf("      \"size\": %d,\n", size);
+    printf("      \"duration_ns\": %llu,\n", (unsigned long long)(end - start));
+    printf("      \"requests\": %llu,\n", (unsigned long long)done);
+    printf("      \"errors\": %d,\n", errors);
+    printf("      \"unanswered\": %llu,\n", (unsigned long long)(issued - done));
+    printf("      \"unsent\": %llu,\n", (unsigned long long)
+           (rate && (end - start) / interval > issued ? (end - start) / interval - issued : 0));
+    printf("      \"throughput\": %.1f,\n", done / ((end - start) / 1e9));
+    printf("      \"latency_ns\": { \"p50\": %llu, \"p90\": %llu, \"p99\": %llu, "
+           "\"p999\": %llu, \"max\": %llu }", (unsigned long long)hist_percentile(&hist, 0.50),
+           (unsigned long long)hist_percentile(&hist, 0.90),
+           (unsigned long long)hist_percentile(&hist, 0.99),
+           (unsigned long long)hist_percentile(&hist, 0.999), (unsigned long long)hist.max);
+
+    /* each child's share of the requests: skew is the busiest child's share
+     * over an even one (1.0 is perfectly even) */
+    if (before) {
+        after = before + nslots;
+        load_requests(h, nslots, after);
+        for (i = n = 0; i < nslots; ++i) {
+            /* a child that was replaced meanwhile started again from zero */
+            after[i] = after[i] >= before[i] ? after[i] - before[i] : after[i];
+            if (!__atomic_load_n(&((stats_slot_t *)((char *)h + sizeof(*h) +
+                                   (size_t)i * h->stride))->pid, __ATOMIC_RELAXED))
+                continue;
+            sum += after[i];
+            min  = after[i] < min ? after[i] : min;
+            max  = after[i] > max ? after[i] : max;
+            after[n++] = after[i];
+        }
+        printf(",\n      \"workers\": { \"count\": %d, \"min\": %llu, \"max\": %llu, "
+               "\"skew\": %.3f, \"requests\": [", n,
+               (unsigned long long)(n ? min : 0), (unsigned long long)max,
+               sum ? (double)max * n / sum : 0);
+        for (i = 0; i < n; ++i)
+            printf("%s%llu", i ? ", " : "", (unsigned long long)after[i]);
+        printf("] }");
+    }
+    printf("\n    }");
+    ok = true;
+
+out:
+    if (conn)
+        for (i = 0; i < conns; ++i)
+            if (conn[i].fd > 0)
+                close(conn[i].fd);
+    if (ep >= 0)
+        close(ep);
+    if (h)
+        munmap(h, stats_size);
+    free(before);
+    free(conn);
+    return ok;
+}
+
+/* Start a daemon serving address in the given accept mode, for --compare, and
+ * wait for all of its children to be ready. Returns its pid, or -1. */
+static pid_t load_daemon(const char *mode, const char *address, const char *stats_name,
+                         int jobs, int timeout)
+{
+    char            jobs_arg[16];
+    char *          argv[16];
+    int             argc = 0, i, n, ready, status;
+    pid_t           master;
+    uint64_t        deadline = now_ns() + (uint64_t)timeout * 1000000;
+    size_t          size;
+    stats_header_t *h;
+    stats_slot_t *  rec;
+
+    snprintf(jobs_arg, sizeof(jobs_arg), "%d", jobs);
+    argv[argc++] = exec_path;
+    argv[argc++] = "--jobs";
+    argv[argc++] = jobs_arg;
+    argv[argc++] = "--listen";
+    argv[argc++] = (char *)address;
+    argv[argc++] = "--stats";
+    argv[argc++] = (char *)stats_name;
+    if (!strcmp(mode, "reuseport"))
+        argv[argc++] = "--reuseport";
+    else if (!strcmp(mode, "herd"))
+        argv[argc++] = "--herd";
+    else if (!strcmp(mode, "io_uring"))
+        argv[argc++] = "--io-uring";
+    argv[argc] = NULL;
+
+    if ((master = fork()) < 0) {
+        perror("fork()");
+        return -1;
+    } else if (master == 0) {
+        int null = open("/dev/null", O_WRONLY);
+
+        /* a group of its own, so that it can be killed along with the pool */
+        setpgid(0, 0);
+        dup2(null, STDOUT_FILENO);
+        dup2(null, STDERR_FILENO);
+        execvp(exec_path, argv);
+        _exit(127);
+    }
+
+    /* the stats segment tells us when every child is serving */
+    for (ready = 0; !ready && now_ns() < deadline; usleep(10000)) {
+        if (waitpid(master, &status, WNOHANG) == master)
+            break;
+        if (!(h = stats_attach(stats_name, &size, &n)))
+            continue;
+        if (h->master == master && n >= jobs)
+            for (i = 0, ready = 1; i < jobs; ++i) {
+                rec = (stats_slot_t *)((char *)h + sizeof(*h) + (size_t)i * h->stride);
+                if (h->stride < sizeof(*rec) || rec->pid <= 0 || !rec->ready)
+                    ready = 0;
+            }
+        munmap(h, size);
+    }
+
+    if (!ready) {
+        fprintf(stderr, "load: the %s daemon never came up\n", mode);
+        kill(-master, SIGKILL);
+        waitpid(master, &status, 0);
+        return -1;
+    }
+    return master;
+}
+
+/* `forking-daemon load [OPTIONS] ADDRESS': put load on a running server; or,
+ * with --compare, on one started for each accept mode in turn:
+ *
+ *   exclusive  one shared socket, watched with EPOLLEXCLUSIVE (the default)
+ *   herd       one shared socket, waking every child (--herd)
+ *   reuseport  a socket per child (--reuseport)
+ *   io_uring   one shared socket, served with io_uring (--io-uring)
+ *
+ * Results are printed as JSON, as for `forking-daemon bench'.
+ */
+int load_main(int argc, char *argv[])
+{
+    static struct option load_options[] = {
+        { "connections",    required_argument,  NULL,   'c' },
+        { "rate",           required_argument,  NULL,   'R' },
+        { "duration",       required_argument,  NULL,   'd' },
+        { "size",           required_argument,  NULL,   's' },
+        { "stats",          required_argument,  NULL,   'S' },
+        { "compare",        no_argument,        NULL,   'C' },
+        { "modes",          required_argument,  NULL,   'm' },
+        { "jobs",           required_argument,  NULL,   'j' },
+        { NULL,             0,                  NULL,   0 }
+    };
+    char            modes[0xff] = "exclusive,herd,reuseport,io_uring";
+    char            address[0x40], stats_name[0x40], *mode, *save;
+    const char *    stats_arg = NULL;
+    int             opt, conns = 64, rate = 0, duration = 5000, size = 64, jobs = 4;
+    int             failed = 0, status, one = 1;
+    bool            compare = false, first = true;
+    struct sockaddr_in sin = { .sin_family = AF_INET };
+    socklen_t       len = sizeof(sin);
+    struct utsname  un;
+    pid_t           master;
+
+    while ((opt = getopt_long(argc, argv, "c:R:d:s:j:", load_options, NULL)) != -1) {
+        switch (opt) {
+        case 'c': conns = atoi(optarg); break;
+        case 'R': rate = atoi(optarg); break;
+        case 'd': duration = atoi(optarg); break;
+        case 's': size = atoi(optarg); break;
+        case 'S': stats_arg = optarg; break;
+        case 'C': compare = true; break;
+        case 'm': strncpy(modes, optarg, sizeof(modes) - 1); break;
+        case 'j': jobs = atoi(optarg); break;
+        default:
+            failed = 1;
+        }
+    }
+    if (failed || conns < 1 || rate < 0 || duration < 1 || size < 1 || size > LOAD_MAX_SIZE ||
+        jobs < 1 || (!compare && optind != argc - 1) || (compare && optind != argc)) {
+        fprintf(stderr, "Usage: forking-daemon load [-c CONNS] [-R RATE] [-d MS] [-s BYTES]\n"
+                        "                           [--stats NAME|PID] ADDRESS\n"
+                        "       forking-daemon load --compare [--modes LIST] [-j JOBS] ...\n");
+        return 1;
+    }
+
+    uname(&un);
+    printf("{\n");
+    printf("  \"system\": \"%s %s %s\",\n", un.sysname, un.release, un.machine);
+    printf("  \"cpus\": %ld,\n", sysconf(_SC_NPROCESSORS_ONLN));
+    printf("  \"runs\": [\n");
+    fflush(stdout);
+
+    if (!compare) {
+        failed = !load_run("server", argv[optind], stats_arg, conns, rate, duration, size, true);
+    } else {
+        /* a free port on the loopback interface, for all the daemons in turn */
+        if ((opt = socket(AF_INET, SOCK_STREAM, 0)) < 0 ||
+            setsockopt(opt, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) < 0 ||
+            bind(opt, (struct sockaddr *)&sin, sizeof(sin)) < 0 ||
+            getsockname(opt, (struct sockaddr *)&sin, &len) < 0) {
+            perror("load");
+            return 1;
+        }
+        close(opt);
+        snprintf(address, sizeof(address), "127.0.0.1:%d", ntohs(sin.sin_port));
+        snprintf(stats_name, sizeof(stats_name), "/forking-daemon.load.%d", getpid());
+
+        for (mode = strtok_r(modes, ",", &save); mode; mode = strtok_r(NULL, ",", &save)) {
+            if (strcmp(mode, "exclusive") && strcmp(mode, "herd") &&
+                strcmp(mode, "reuseport") && strcmp(mode, "io_uring")) {
+                fprintf(stderr, "load: unknown mode %s\n", mode);
+                ++failed;
+                continue;
+            }
+            if ((master = load_daemon(mode, address, stats_name, jobs, 10000)) < 0) {
+                ++failed;
+                continue;
+            }
+
+            if (load_run(mode, address, stats_name, conns, rate, duration, size, first))
+                first = false;
+            else
+                ++failed;
+            fflush(stdout);
+
+            kill(master, SIGTERM);
+            waitpid(master, &status, 0);
+        }
+    }
+
+    printf("\n  ]\n}\n");
+    return failed ? 1 : 0;
+}
+#else
+int load_main(int argc, char *argv[])
+{
+    fprintf(stderr, "load: only on Linux, for now (it uses epoll)\n");
+    return 1;
+}
+#endif /* __linux__ */
+
+/* Map the log segment and start the logger thread.
+ *
+ * The segment is never named: only our children (and the zygote) ever write to
+ * it, and they inherit it across fork() (or, with --exec, as a descriptor). It
+ * has room for every ring we could need, but only the pages that are written
+ * to take up any memory.
+ */
+bool log_start()
+{
+    sigset_t    all, old;
+    int         err;
+
+    logs.size  = (size_t)LOG_RINGS * sizeof(log_ring_t);
+#ifdef __linux__
+    /* on Linux, from a memfd, which --exec workers can map for themselves */
+    if ((logs.fd = memfd_create("forking-daemon.log", MFD_CLOEXEC)) < 0 ||
+        ftruncate(logs.fd, logs.size) < 0) {
+        perror("log_start()");
+        return false;
+    }
+#endif
+    logs.rings = mmap(NULL, logs.size, PROT_READ|PROT_WRITE,
+                      logs.fd < 0 ? MAP_SHARED|MAP_ANONYMOUS|MAP_NORESERVE : MAP_SHARED|MAP_NORESERVE,
+                      logs.fd, 0);
+    if (logs.rings == MAP_FAILED) {
+        logs.rings = NULL;
+        perror("log_start()");
+        return false;
+    }
+    logs.used = 2;
+
+    /* The thread must not take any of the signals the event loop is waiting
+     * for, so it starts with all of them blocked, and never unblocks them. */
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    err = pthread_create(&logs.thread, NULL, &log_thread, NULL);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+    if (err) {
+        fprintf(stderr, "pthread_create(): %s\n", strerror(err));
+        return false;
+    }
+
+    log_attach(LOG_MASTER);
+    return true;
+}
+
+/* Write whatever is left in the rings, and stop the logger thread */
+void log_stop()
+{
+    if (!logs.rings)
+        return;
+
+    __atomic_store_n(&logs.stop, true, __ATOMIC_RELEASE);
+    pthread_join(logs.thread, NULL);
+
+    /* anything said from here on goes straight to stdio */
+    my_log = NULL;
+}
+
+/* Switch a newly forked process (LOG_MASTER, LOG_ZYGOTE or a slot id) over to
+ * a ring of its own. Every fork() must be followed by this before anything is
+ * logged, since the ring inherited from the parent has a writer already. */
+void log_attach(int id)
+{
+    my_log    = NULL;
+    my_log_id = id;
+    my_log_pid = getpid();
+
+    if (logs.rings && id + 2 < LOG_RINGS) {
+        my_log = &logs.rings[id + 2];
+        my_log->owner = my_log_pid;
+    }
+}
+
+/* Note the number of slots, so the logger thread knows which rings to look at.
+ * Rings are never given up, since a retiring child may still be writing to
+ * one; they are reused when the slot is. */
+void log_resize(int size)
+{
+    if (logs.rings && size + 2 > (int)__atomic_load_n(&logs.used, __ATOMIC_RELAXED))
+        __atomic_store_n(&logs.used, size + 2 < LOG_RINGS ? size + 2 : LOG_RINGS,
+                         __ATOMIC_RELEASE);
+}
+
+/* Log a message (printf() style, without the trailing newline).
+ *
+ * This is the only part of logging that a worker ever pays for: formatting the
+ * text into the next free record of its ring, and moving the tail along. There
+ * are no locks and no system calls (clock_gettime() is answered from the vDSO).
+ * If the logger has fallen behind and the ring is full, the message is
+ * dropped and counted, rather than waited on.
+ *
+ * The one exception is a child with --threads, whose threads share its ring:
+ * they take turns at it, under log_lock. (They hardly ever log.)
+ */
+void log_msg(int level, const char *fmt, ...)
+{
+    va_list         ap;
+    log_record_t *  rec;
+    struct timespec ts;
+    uint32_t        tail;
+    int             n;
+
+    va_start(ap, fmt);
+
+    /* before the log segment exists (and after it is gone), or for a process
+     * without a ring, there is nothing for it but stdio */
+    if (!my_log) {
+        vfprintf(level == LOG_INFO ? stdout : stderr, fmt, ap);
+        fputc('\n', level == LOG_INFO ? stdout : stderr);
+        va_end(ap);
+        return;
+    }
+
+    if (threaded)
+        pthread_mutex_lock(&log_lock);
+
+    tail = my_log->ring.tail;
+    if (tail - __atomic_load_n(&my_log->ring.head, __ATOMIC_ACQUIRE) >= LOG_DEPTH) {
+        __atomic_add_fetch(&my_log->dropped, 1, __ATOMIC_RELAXED);
+        if (threaded)
+            pthread_mutex_unlock(&log_lock);
+        va_end(ap);
+        return;
+    }
+
+    rec = &my_log->records[tail % LOG_DEPTH];
+    clock_gettime(CLOCK_REALTIME, &ts);
+    rec->time  = (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+    rec->pid   = my_log_pid;
+    rec->id    = my_log_id;
+    rec->level = level;
+
+    n = vsnprintf(rec->text, LOG_TEXT, fmt, ap);
+    rec->len = n < 0 ? 0 : n < LOG_TEXT ? n : LOG_TEXT - 1;
+    va_end(ap);
+
+    /* publish the record */
+    __atomic_store_n(&my_log->ring.tail, tail + 1, __ATOMIC_RELEASE);
+    if (threaded)
+        pthread_mutex_unlock(&log_lock);
+}
+
+/* Like perror() */
+void log_error(const char *what)
+{
+    log_msg(LOG_ERROR, "%s: %s", what, strerror(errno));
+}
+
+/* SIGHUP: reopen the logfile, so that it can be rotated.
+ *
+ * The new file takes the place of the old on stdout and stderr with dup2(),
+ * which swaps them atomically: the logger thread's next writev() simply goes
+ * to the new file. Workers never write to the file at all, so they don't have
+ * to be told.
+ */
+void log_reopen()
+{
+    int fd;
+
+    if (!options.daemonize)
+        return;
+
+    if ((fd = open(options.logfile, O_WRONLY|O_APPEND|O_CREAT, 0644)) < 0) {
+        log_error(options.logfile);
+        return;
+    }
+    dup2(fd, STDOUT_FILENO);
+    dup2(fd, STDERR_FILENO);
+    close(fd);
+
+    log_msg(LOG_INFO, "Master: reopened %s", options.logfile);
+}
+
+/* Format the prefix of a line of the log into buf: the time, the process and
+ * the level */
+static size_t log_prefix(char *buf, size_t size, uint64_t time, pid_t pid, int id, int level)
+{
+    static time_t   last = 0;
+    static char     date[32];
+    static const char * levels[] = { "", "warning: ", "error: " };
+    time_t          sec = time / 1000000000;
+    struct tm       tm;
+    char            who[32];
+
+    /* the date only changes once a second */
+    if (sec != last) {
+        localtime_r(&sec, &tm);
+        strftime(date, sizeof(date), "%Y-%m-%d %H:%M:%S", &tm);
+        last = sec;
+    }
+
+    if (id == LOG_MASTER)
+        snprintf(who, sizeof(who), "master");
+    else if (id == LOG_ZYGOTE)
+        snprintf(who, sizeof(who), "zygote");
+    else
+        snprintf(who, sizeof(who), "child(%d)", id);
+
+    return snprintf(buf, size, "%s.%03d %s[%d] %s", date, (int)(time / 1000000 % 1000),
+                    who, pid, levels[level]);
+}
+
+/* The logger thread.
+ *
+ * Every LOG_FLUSH ms (or right away, if there was a full batch last time) it
+ * goes round the rings, turns their records into lines, and writes as many as
+ * LOG_BATCH of them with a single writev(). A record's text is written from
+ * the ring itself; only then is the ring's head moved past it, which gives the
+ * record back to its writer.
+ *
+ * Lines from different processes may be out of order by up to LOG_FLUSH ms;
+ * every line carries its time.
+ *
+ * This thread never touches stdio, or anything else a child also uses, so it
+ * holds no locks that a child forked from the master could find taken.
+ */
+static void *log_thread(void *arg)
+{
+    static char         prefix[LOG_BATCH][128]; /* a prefix, or a whole drop notice */
+    static struct iovec iov[LOG_BATCH * 3];
+    static uint64_t     seen[LOG_RINGS];    /* drops already reported */
+    static uint32_t     heads[LOG_RINGS];
+    int                 touched[LOG_BATCH], ntouched;
+    struct timespec     ts = { 0, LOG_FLUSH * 1000000L }, now;
+    log_ring_t *        lr;
+    log_record_t *      rec;
+    uint64_t            dropped;
+    uint32_t            tail;
+    int                 i, r, n, lines, used;
+    bool                stop, full;
+
+    do {
+        stop  = __atomic_load_n(&logs.stop, __ATOMIC_ACQUIRE);
+        used  = __atomic_load_n(&logs.used, __ATOMIC_ACQUIRE);
+        n = lines = ntouched = 0;
+
+        for (r = 0; r < used && lines < LOG_BATCH - 1; ++r) {
+            lr   = &logs.rings[r];
+            tail = __atomic_load_n(&lr->ring.tail, __ATOMIC_ACQUIRE);
+            heads[r] = lr->ring.head;
+
+            if ((dropped = __atomic_load_n(&lr->dropped, __ATOMIC_RELAXED)) != seen[r]) {
+                clock_gettime(CLOCK_REALTIME, &now);
+                iov[n].iov_base = prefix[lines];
+                iov[n].iov_len  = log_prefix(prefix[lines], sizeof(prefix[lines]) - 40,
+                                             (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec,
+                                             lr->owner, r - 2, LOG_WARN);
+                iov[n].iov_len += snprintf(prefix[lines] + iov[n].iov_len, 40,
+                                           "%llu messages dropped\n",
+                                           (unsigned long long)(dropped - seen[r]));
+                ++n, ++lines;
+                seen[r] = dropped;
+            }
+
+            if (heads[r] == tail)
+                continue;
+
+            for (; heads[r] != tail && lines < LOG_BATCH; ++heads[r], ++lines) {
+                rec = &lr->records[heads[r] % LOG_DEPTH];
+                iov[n].iov_base   = prefix[lines];
+                iov[n++].iov_len  = log_prefix(prefix[lines], sizeof(prefix[lines]),
+                                               rec->time, rec->pid, rec->id, rec->level);
+                iov[n].iov_base   = rec->text;
+                iov[n++].iov_len  = rec->len;
+                iov[n].iov_base   = "\n";
+                iov[n++].iov_len  = 1;
+            }
+            touched[ntouched++] = r;
+        }
+        full = lines >= LOG_BATCH - 1;
 
-    return 0;
+        /* a log that can't be written to is a log that can't complain about
+         * it, either; the lines are dropped */
+        for (i = 0; i < n; i += IOV_MAX)
+            if (writev(STDOUT_FILENO, iov + i, n - i < IOV_MAX ? n - i : IOV_MAX) < 0)
+                break;
+
+        for (i = 0; i < ntouched; ++i)
+            __atomic_store_n(&logs.rings[touched[i]].ring.head, heads[touched[i]],
+                             __ATOMIC_RELEASE);
+
+        if (!full && !stop)
+            nanosleep(&ts, NULL);
+    } while (full || !stop);
+
+    return arg;
 }
 
-/* Forks a child process, and returns true if successful.
- * The forked child blocks and randomly dies.
+/* Create the dispatch segment, if there is to be one.
  *
- * If this program did any work, the main communication between parent and child
- * could take place through a pipe(2).
+ * It is only named for as long as it takes to open it, since nobody but our
+ * children (who inherit the descriptor) has any business with it.
  */
-bool child(int id)
+bool dispatch_create()
 {
-    pid_t   pid;
+    char    name[0xff];
+    int     i;
 
-    /* see main() for discussion on fork() */
-    pid = fork();
+    if (!options.dispatch)
+        return true;
 
-    if (pid < 0) {
+    snprintf(name, sizeof(name), "/forking-daemon.%d.dispatch", getpid());
+    shm_unlink(name);
+
+    if ((dispatch.fd = shm_open(name, O_RDWR|O_CREAT|O_EXCL, 0600)) < 0) {
+        log_error(name);
         return false;
-    } else if (pid > 0) {
-        printf("Master: Spawning child(%d) [pid %d]\n", id, pid);
-        children[id] = pid; /* record the child pid */
-        return true;
     }
+    shm_unlink(name);
+    fcntl(dispatch.fd, F_SETFD, FD_CLOEXEC);
 
-    /* Child process continues here */
+    /* an eventfd is a doorbell in a single descriptor; elsewhere, a pipe */
+#ifdef __linux__
+    if ((dispatch.bell[0] = dispatch.bell[1] = eventfd(0, 0)) < 0) {
+#else
+    if (pipe(dispatch.bell) < 0) {
+#endif
+        log_error("dispatch_create()");
+        return false;
+    }
+    for (i = 0; i < 2; ++i) {
+        fcntl(dispatch.bell[i], F_SETFL, fcntl(dispatch.bell[i], F_GETFL) | O_NONBLOCK);
+        fcntl(dispatch.bell[i], F_SETFD, FD_CLOEXEC);
+    }
 
-    /* Give our child a name */
-    snprintf(process_name, 0xff, "forking-daemon: child(%d)", id);
+    if (!dispatch_map(slots.size > options.jobs ? slots.size : options.jobs))
+        return false;
 
-    /* Children processes are exact (almost) copies of the parent!
-     * Including signal traps! Our parent has a SIGTERM handler, and this child
-     * will dutifully execute the handler on SIGTERM unless we reset all
-     * signals back to their default handlers */
-    if (!trap_signals(false)) {
-        fprintf(stderr, "Child %d: trap_signals() failed!\n", id);
-        exit(1);
-    }
+    /* as far as the children know, we start out asleep */
+    dispatch.header->master_waiting = 1;
 
-    /* Block, and randomly die.
-     * If you're on Linux, arc4random() is why you need to link to libbsd
-     * (because it works, and I'm lazy) */
-    while (1) {
-        arc4random_stir();
-        if (arc4random() % 20)
-            sleep(1);
-        else
-            break;
+    return ev_watch_fd(dispatch.bell[0], EVENT_DISPATCH, false);
+}
+
+/* (Re)map the dispatch segment with room for n slots, as stats_map() does */
+bool dispatch_map(int n)
+{
+    uint32_t    depth = options.dispatch;
+    size_t      stride, size, old;
+    void *      p;
+
+    stride = sizeof(dispatch_slot_t) + depth * (2 * sizeof(job_t) + sizeof(done_t) + DISPATCH_BLOCK);
+    stride = (stride + CACHE_LINE - 1) & ~(size_t)(CACHE_LINE - 1);
+    size   = sizeof(dispatch_header_t) + (size_t)n * stride;
+    old    = dispatch.size ? (dispatch.size - sizeof(dispatch_header_t)) / stride : 0;
+
+    if (size <= dispatch.size)
+        return true;
+
+    if (ftruncate(dispatch.fd, size) < 0 ||
+        (p = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_SHARED, dispatch.fd, 0)) == MAP_FAILED) {
+        log_error("dispatch_map()");
+        return false;
     }
 
-    exit(0);
+    if (dispatch.header)
+        munmap(dispatch.header, dispatch.size);
+
+    dispatch.header = p;
+    dispatch.size   = size;
+    dispatch.header->stride = stride;
+    dispatch.header->depth  = depth;
+    __atomic_store_n(&dispatch.header->slots, n, __ATOMIC_RELEASE);
+
+    /* the free lists of payload blocks, which only the master ever sees */
+    if (!(p = realloc(dispatch.free, (size_t)n * depth * sizeof(*dispatch.free))))
+        return false;
+    dispatch.free = p;
+    if (!(p = realloc(dispatch.nfree, n * sizeof(*dispatch.nfree))))
+        return false;
+    dispatch.nfree = p;
+    memset(dispatch.nfree + old, 0, (n - old) * sizeof(*dispatch.nfree));
+    if (!(p = realloc(dispatch.since, n * sizeof(*dispatch.since))))
+        return false;
+    dispatch.since = p;
+    memset(dispatch.since + old, 0, (n - old) * sizeof(*dispatch.since));
+
+    return true;
 }
 
-/* Populate our array of custom handler objects */
-void register_signals()
+/* The dispatch record of slot id */
+dispatch_slot_t *dispatch_slot(int id)
 {
-    int i = 0;
+    return (dispatch_slot_t *)((char *)dispatch.header + sizeof(dispatch_header_t) +
+                               (size_t)id * dispatch.header->stride);
+}
+
+static inline job_t *dispatch_jobs(dispatch_slot_t *ds)
+{
+    return (job_t *)(ds + 1);
+}
+
+static inline done_t *dispatch_done(dispatch_slot_t *ds)
+{
+    return (done_t *)(dispatch_jobs(ds) + dispatch.header->depth);
+}
 
-    sigpairs[i].signal            = SIGCHLD;
-    sigpairs[i].action.sa_handler = &restart_children;
-    /* Don't send SIGCHLD when a process has been frozen (e.g. Ctrl-Z) */
-    sigpairs[i].action.sa_flags   = SA_NOCLDSTOP;
+static inline job_t *dispatch_deque(dispatch_slot_t *ds)
+{
+    return (job_t *)(dispatch_done(ds) + dispatch.header->depth);
+}
+
+/* Payload block b, which belongs to slot b / depth */
+static inline uint8_t *dispatch_payload(uint32_t b)
+{
+    uint32_t depth = dispatch.header->depth;
 
-    sigpairs[++i].signal          = SIGINT;
-    sigpairs[i].action.sa_handler = &terminate_children;
+    return (uint8_t *)(dispatch_deque(dispatch_slot(b / depth)) + depth) +
+           (size_t)(b % depth) * DISPATCH_BLOCK;
+}
 
-    sigpairs[++i].signal          = SIGTERM;
-    sigpairs[i].action.sa_handler = &terminate_children;
+/* Sleep while *addr == val (but no more than ms milliseconds) */
+static void ring_sleep(uint32_t *addr, uint32_t val, int ms)
+{
+#ifdef __linux__
+    struct timespec ts = { ms / 1000, (ms % 1000) * 1000000L };
 
-    /* setting sigcount now is easier than doing it dynamically */
-    sigcount = ++i;
+    syscall(SYS_futex, addr, FUTEX_WAIT, val, &ts, NULL, 0);
+#else
+    /* no portable futex; poll, which will do for a demonstration */
+    usleep(1000);
+#endif
 }
 
-/* When passed true, traps signals and assigns handlers as defined in sigpairs[]
- * When passed false, resets all trapped signals back to their default behavior.
- */
-int trap_signals(bool on)
+/* Wake whoever is sleeping on addr */
+static void ring_wake(uint32_t *addr)
 {
-    int i;
-    struct sigaction dfl;       /* the handler object */
+#ifdef __linux__
+    syscall(SYS_futex, addr, FUTEX_WAKE, 1, NULL, NULL, 0);
+#endif
+}
 
-    dfl.sa_handler = SIG_DFL;   /* for resetting to default behavior */
+/* Ring the master's doorbell */
+static void dispatch_ring()
+{
+    uint64_t one = 1;
 
-    /* Loop through all registered signals and either set to the new handler
-     * or reset them back to the default */
-    for (i = 0; i < sigcount; ++i) {
-        /* notice that the second parameter takes the address of the handler */
-        if (sigaction(sigpairs[i].signal, on ? &sigpairs[i].action : &dfl, NULL) < 0)
-            return false;
+    /* if it can't take any more, it has been rung already */
+    if (write(dispatch.bell[1], &one, sizeof(one)) < 0)
+        return;
+}
+
+/* Collect the finished jobs of slot id, and return their payload blocks to
+ * the free list of the slot they belong to. Returns the number collected. */
+static uint32_t dispatch_collect(int id)
+{
+    uint32_t            n, head, tail, block, owner, depth = dispatch.header->depth;
+    dispatch_slot_t *   ds = dispatch_slot(id);
+    done_t *            done = dispatch_done(ds);
+
+    head = ds->done.head;
+    tail = __atomic_load_n(&ds->done.tail, __ATOMIC_ACQUIRE);
+
+    for (n = 0; head != tail; ++head) {
+        block = done[head & (depth - 1)].block;
+        owner = block / depth;
+        if (done[head & (depth - 1)].seq <= dispatch.since[owner])
+            continue;   /* a thief's leftover from before a reset */
+        dispatch.free[owner * depth + dispatch.nfree[owner]++] = block;
+        ++n;
     }
 
-    return true;
+    __atomic_store_n(&ds->done.head, tail, __ATOMIC_RELEASE);
+    dispatch.completed += n;
+    return n;
 }
 
-/* Master's SIGCHLD handler.
- *
- * When a process is fork()ed by a process, the new process is an exact copy
- * of the old process, except for a few values, one of which is that the parent
- * pid of the child is that of the process that forked it.
- *
- * When this child exits, the signal SIGCHLD is sent to the parent process to
- * alert it. By default, the signal is ignored, but we can take this opportunity
- * to restart any children that have died.
+/* Before spawning a child in slot id: empty its rings, take back all of its
+ * payload blocks, and give it a full ring of jobs to start with.
  *
- * There are many ways to determine which children have died, but the most
- * portable method is to use the wait() family of system calls.
- *
- * A dead child process releases its memory, but sticks around so that any
- * interested parties can determine how they died (exit status). Calling wait()
- * in the master collects the status of the first available dead process, and
- * removes it from the process table.
+ * Whatever the last child in the slot left behind is simply dropped; this
+ * program has no jobs that anybody would miss. Some of them may yet be done by
+ * a thief, but anything done for a slot before its last reset is ignored.
  *
- * If wait() is never called by the parent, the dead child sticks around as a
- * "zombie" process, marked with status `Z' in ps output. If the parent process
- * exits without ever calling wait, the zombie process does not disappear, but
- * is inherited by the root process (its parent pid is set to 1).
+ * What it finished is collected first, all the same: some of that may be jobs
+ * it stole, whose blocks belong to other slots, and would never be seen again.
+ */
+void dispatch_reset(int id)
+{
+    uint32_t            i, depth = dispatch.header->depth;
+    dispatch_slot_t *   ds = dispatch_slot(id);
+    int64_t             t, b;
+
+    dispatch_collect(id);
+
+    memset(&ds->jobs, 0, sizeof(ds->jobs));
+    memset(&ds->done, 0, sizeof(ds->done));
+
+    /* The deque is emptied by moving both ends past anywhere a thief could
+     * have seen them: a thief still trying its luck on the old deque then
+     * fails its compare-and-swap, instead of taking a job from the new one. */
+    t = __atomic_load_n(&ds->deque.top, __ATOMIC_RELAXED);
+    b = __atomic_load_n(&ds->deque.bottom, __ATOMIC_RELAXED);
+    t = (b > t ? b : t) + depth;
+    __atomic_store_n(&ds->deque.top, t, __ATOMIC_SEQ_CST);
+    __atomic_store_n(&ds->deque.bottom, t, __ATOMIC_SEQ_CST);
+
+    dispatch.since[id] = dispatch.seq;
+
+    for (i = 0; i < depth; ++i)
+        dispatch.free[id * depth + i] = id * depth + i;
+    dispatch.nfree[id] = depth;
+
+    dispatch_fill(id);
+}
+
+/* Hand slot id a job for every free payload block it has, in one batch */
+void dispatch_fill(int id)
+{
+    uint32_t            i, n, tail, block, depth = dispatch.header->depth;
+    dispatch_slot_t *   ds = dispatch_slot(id);
+    job_t *             jobs = dispatch_jobs(ds), *job;
+    uint64_t            now;
+
+    if (!(n = dispatch.nfree[id]))
+        return;
+    now = now_ns();
+
+    /* The ring always has room, since there are never more jobs in it than
+     * there are blocks in use. A real master would read requests straight
+     * into the blocks; ours just makes some up. One run of 1024 jobs in eight
+     * is 64 times the work, which gives the pool something to even out. */
+    tail = ds->jobs.tail;
+    for (i = 0; i < n; ++i) {
+        block       = dispatch.free[id * depth + --dispatch.nfree[id]];
+        job         = &jobs[(tail + i) & (depth - 1)];
+        job->seq    = ++dispatch.seq;
+        job->queued = now;
+        job->block  = block;
+        job->len    = DISPATCH_BLOCK;
+        job->rounds = (job->seq >> 10) % 8 ? 1 : 64;
+        memset(dispatch_payload(block), (uint8_t)job->seq, DISPATCH_BLOCK);
+    }
+
+    /* Publish the whole batch at once, then see whether the child is asleep.
+     * The fence keeps the load of its flag from happening before our store,
+     * as its own fence keeps it from going to sleep without another look at
+     * the tail after raising the flag: one of us is bound to see the other. */
+    __atomic_store_n(&ds->jobs.tail, tail + n, __ATOMIC_RELEASE);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&ds->jobs.waiting, __ATOMIC_RELAXED))
+        ring_wake(&ds->jobs.tail);
+}
+
+/* The master's doorbell rang: children have finished some jobs.
  *
- * Because SIGCHLD is an asynchronous signal, it is possible that if many
- * children die simultaneously, the parent may only notice one SIGCHLD when many
- * have been sent. In order to beat this edge case, we can simply loop through
- * all the known children and call waitpid() in non-blocking mode to see if they
- * have died, and spawn a new one in their place.
+ * Collect from every slot, then refill those whose children are still
+ * wanted (a thief may have freed blocks of a slot that reported nothing
+ * itself). Then raise our waiting flag and take one more look, since a child that
+ * finished in the meantime may not have noticed that we were busy. If one
+ * did, we ring our own doorbell, rather than keep the event loop from
+ * everything else it has to do.
  */
-void restart_children()
+void dispatch_reap()
 {
-    int     i, status[0xff];    /* array of exit statuses, just in case */
-    pid_t   pid;
+    uint64_t            junk;
+    int                 id;
+    bool                more = false;
+    dispatch_slot_t *   ds;
 
-    /* Racing signals may let dead children through the cracks,
-     * so check all children
-     */
-    for (i = 0; i < options.jobs; ++i) {
-        pid = waitpid(children[i], &status[i], WNOHANG); /* non-blocking! */
+    /* an eventfd is reset by a single read; a pipe takes a few */
+    while (read(dispatch.bell[0], &junk, sizeof(junk)) > 0)
+        ;
 
-        if (pid < 0) {
-            perror("waitpid()");
-        } else if (!pid) {
-            /* waitpid returns 0 when the process is alive and well */
+    __atomic_store_n(&dispatch.header->master_waiting, 0, __ATOMIC_RELAXED);
+
+    for (id = 0; id < slots.size; ++id)
+        dispatch_collect(id);
+    for (id = 0; id < slots.size; ++id)
+        if (slots.state[id] == SLOT_RUNNING)
+            dispatch_fill(id);
+
+    __atomic_store_n(&dispatch.header->master_waiting, 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+    for (id = 0; id < slots.size && !more; ++id) {
+        ds   = dispatch_slot(id);
+        more = ds->done.head != __atomic_load_n(&ds->done.tail, __ATOMIC_RELAXED);
+    }
+
+    if (more && __atomic_exchange_n(&dispatch.header->master_waiting, 0, __ATOMIC_RELAXED))
+        dispatch_ring();
+}
+
+/* How long the oldest job waiting in slot id's ring (or deque) has been
+ * there, in ns */
+uint64_t dispatch_age(int id, uint64_t now)
+{
+    uint32_t            head, tail, mask = dispatch.header->depth - 1;
+    int64_t             top, bottom;
+    dispatch_slot_t *   ds = dispatch_slot(id);
+    uint64_t            t, oldest = now;
+
+    /* a peek at entries that may be taken (or stolen) as we look, which will
+     * do for a sample: the master is the only one to write them */
+    head = __atomic_load_n(&ds->jobs.head, __ATOMIC_ACQUIRE);
+    tail = ds->jobs.tail;
+    if (head != tail && (t = dispatch_jobs(ds)[head & mask].queued) < oldest)
+        oldest = t;
+
+    top    = __atomic_load_n(&ds->deque.top, __ATOMIC_ACQUIRE);
+    bottom = __atomic_load_n(&ds->deque.bottom, __ATOMIC_ACQUIRE);
+    if (options.steal && bottom > top && (t = dispatch_deque(ds)[top & mask].queued) < oldest)
+        oldest = t;
+
+    return now - oldest;
+}
+
+/* Make sure the first n slot records are mapped, remapping the segment at its
+ * current size if not. The master grows the segment with the pool, but a
+ * child's mapping stays the size it was when the child was forked (or, for a
+ * child of the zygote, when the zygote was).
+ */
+static void dispatch_cover(int n)
+{
+    struct stat st;
+    void *      p;
+
+    if (sizeof(dispatch_header_t) + (size_t)n * dispatch.header->stride <= dispatch.size)
+        return;
+
+    if (fstat(dispatch.fd, &st) < 0 ||
+        (p = mmap(NULL, st.st_size, PROT_READ|PROT_WRITE, MAP_SHARED, dispatch.fd, 0)) == MAP_FAILED) {
+        log_error("dispatch_cover()");
+        exit(1);
+    }
+    munmap(dispatch.header, dispatch.size);
+    dispatch.header = p;
+    dispatch.size   = st.st_size;
+}
+
+/* In a new child: make sure our own record is mapped */
+void dispatch_child(int id)
+{
+    if (dispatch.fd >= 0)
+        dispatch_cover(id + 1);
+}
+
+/* The owner's end of its deque: push a job on the bottom. As with the rings,
+ * there is always room. */
+static void deque_push(dispatch_slot_t *ds, const job_t *job)
+{
+    int64_t b = __atomic_load_n(&ds->deque.bottom, __ATOMIC_RELAXED);
+
+    dispatch_deque(ds)[b & (dispatch.header->depth - 1)] = *job;
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    __atomic_store_n(&ds->deque.bottom, b + 1, __ATOMIC_RELAXED);
+}
+
+/* ... and take the job at the bottom back off. Only the very last job is
+ * contended, when a thief is after it too; the compare-and-swap on top then
+ * decides which of us gets it. */
+static bool deque_take(dispatch_slot_t *ds, job_t *job)
+{
+    int64_t b = __atomic_load_n(&ds->deque.bottom, __ATOMIC_RELAXED) - 1, t;
+    bool    ok = true;
+
+    __atomic_store_n(&ds->deque.bottom, b, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    t = __atomic_load_n(&ds->deque.top, __ATOMIC_RELAXED);
+
+    if (t > b) {
+        __atomic_store_n(&ds->deque.bottom, b + 1, __ATOMIC_RELAXED);
+        return false;
+    }
+
+    *job = dispatch_deque(ds)[b & (dispatch.header->depth - 1)];
+    if (t == b) {
+        ok = __atomic_compare_exchange_n(&ds->deque.top, &t, t + 1, false,
+                                         __ATOMIC_SEQ_CST, __ATOMIC_RELAXED);
+        __atomic_store_n(&ds->deque.bottom, b + 1, __ATOMIC_RELAXED);
+    }
+
+    return ok;
+}
+
+/* A thief's end: take the job at the top of somebody else's deque. Returns 1
+ * if we got one, 0 if there was none, or -1 if somebody beat us to it. */
+static int deque_steal(dispatch_slot_t *ds, job_t *job)
+{
+    int64_t t = __atomic_load_n(&ds->deque.top, __ATOMIC_ACQUIRE), b;
+
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    b = __atomic_load_n(&ds->deque.bottom, __ATOMIC_ACQUIRE);
+
+    if (t >= b)
+        return 0;
+
+    /* The entry is copied before we own it, since it may be reused as soon as
+     * top moves on; if we lose the race, the copy (torn or not) is dropped. */
+    *job = dispatch_deque(ds)[t & (dispatch.header->depth - 1)];
+    if (!__atomic_compare_exchange_n(&ds->deque.top, &t, t + 1, false,
+                                     __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+        return -1;
+
+    return 1;
+}
+
+/* Do a job: checksum its payload (CRC-32C) in place, look the sum up in the
+ * --warmup table, if there is one, and record the job as done in d */
+static void dispatch_job(const job_t *job, done_t *d)
+{
+    const uint8_t * p = dispatch_payload(job->block);
+    uint32_t        h = ~0u, k, r;
+
+    TRACE(job__start, job->seq);
+
+    for (r = 0; r < job->rounds; ++r)
+        for (k = 0; k < job->len; ++k)
+            h = crc_table[(h ^ p[k]) & 0xff] ^ (h >> 8);
+    h = ~h;
+
+    if (lookup_size)
+        h ^= (uint32_t)lookup[h % lookup_size];
+
+    d->seq    = job->seq;
+    d->block  = job->block;
+    d->result = h;
+    TRACE(job__done, job->seq);
+}
+
+/* With nothing of our own to do, take up to room jobs from our siblings'
+ * deques (of the first count slots, those we have mapped), starting with a
+ * different sibling every time, and do them. They are reported done on done,
+ * our own done ring, which *dtail is the tail of. Returns the number of jobs
+ * done.
+ */
+static uint32_t dispatch_steal(int id, uint32_t count, done_t *done, uint32_t *dtail, uint32_t room)
+{
+    static uint32_t next = 0;
+    uint32_t        i, victim, n = 0, depth = dispatch.header->depth;
+    job_t           job;
+    int             got;
+
+    for (i = 0; i < count && n < room; ++i) {
+        if ((victim = (next + i) % count) == (uint32_t)id)
             continue;
+        while (n < room && (got = deque_steal(dispatch_slot(victim), &job))) {
+            if (got < 0) {
+                STAT_ADD(steal_misses, 1);
+                continue;
+            }
+            dispatch_job(&job, &done[(*dtail)++ & (depth - 1)]);
+            ++n;
+        }
+    }
+
+    ++next;
+    STAT_ADD(steals, n);
+    return n;
+}
+
+/* The life of a dispatch child: take every job there is, do it, and report
+ * back, a batch at a time; sleep when there are none. Jobs left on our deque
+ * when we exit can still be stolen, until the slot is reset.
+ */
+int dispatch_work(int id)
+{
+    uint32_t            n, room, head, tail, dtail, count, depth = dispatch.header->depth;
+    dispatch_slot_t *   ds;
+    job_t *             jobs, job;
+    done_t *            done;
+    uint64_t            woke = now_ns(), now, t;
+    bool                sampled;
+
+    worker_ready(id);
+    while (!draining) {
+        stats_tick();
+        sampled = phase_sampled();
+        t = sampled ? ticks() : 0;
+
+        /* a thief needs to see every sibling, however many there are by now;
+         * it only looks at as many as it has mapped, though the master may
+         * have added more since */
+        count = options.steal ? __atomic_load_n(&dispatch.header->slots, __ATOMIC_ACQUIRE) : 0;
+        dispatch_cover(count > (uint32_t)id ? (int)count : id + 1);
+        ds   = dispatch_slot(id);
+        jobs = dispatch_jobs(ds);
+        done = dispatch_done(ds);
+
+        head  = ds->jobs.head;
+        tail  = __atomic_load_n(&ds->jobs.tail, __ATOMIC_ACQUIRE);
+        dtail = ds->done.tail;
+        n     = 0;
+
+        if (!options.steal) {
+            /* there is always room in done for every job we have been given */
+            for (; head != tail; ++head, ++n)
+                dispatch_job(&jobs[head & (depth - 1)], &done[dtail++ & (depth - 1)]);
         } else {
-            printf("Master: reaped dead child(%d) [pid %d]\n", i, pid);
-            child(i); /* relaunch this particular child */
+            /* move new jobs onto our deque, where idle siblings can get at them */
+            for (; head != tail; ++head)
+                deque_push(ds, &jobs[head & (depth - 1)]);
+
+            /* Then work through some, newest first. Stolen jobs take up room
+             * in done too, so mind how much of it there is. */
+            room = depth - (dtail - __atomic_load_n(&ds->done.head, __ATOMIC_ACQUIRE));
+            if (room > DISPATCH_BATCH)
+                room = DISPATCH_BATCH;
+            for (; n < room && deque_take(ds, &job); ++n)
+                dispatch_job(&job, &done[dtail++ & (depth - 1)]);
+
+            if (!n && room)
+                n = dispatch_steal(id, count, done, &dtail, room);
+        }
+
+        __atomic_store_n(&ds->jobs.head, head, __ATOMIC_RELEASE);
+
+        /* Nothing to do: raise the flag, and have another look, in case the
+         * master filled the ring before it could have seen the flag. A child
+         * that steals naps only briefly, to look around for work again. */
+        if (!n) {
+            __atomic_store_n(&ds->jobs.waiting, 1, __ATOMIC_RELAXED);
+            __atomic_thread_fence(__ATOMIC_SEQ_CST);
+            if (__atomic_load_n(&ds->jobs.tail, __ATOMIC_ACQUIRE) == head) {
+                STAT_ADD(busy_ns, now_ns() - woke);
+                ring_sleep(&ds->jobs.tail, head, options.steal ? 1 : HEARTBEAT_INTERVAL);
+                woke = now_ns();
+            }
+            __atomic_store_n(&ds->jobs.waiting, 0, __ATOMIC_RELAXED);
+            if (sampled)
+                phase_add(PHASE_WAIT, ticks() - t);
+            continue;
         }
+
+        __atomic_store_n(&ds->done.tail, dtail, __ATOMIC_RELEASE);
+        STAT_ADD(requests, n);
+        if (sampled)
+            phase_add(PHASE_WORK, ticks() - t);
+        now = now_ns();
+        STAT_ADD(busy_ns, now - woke);
+        woke = now;
+
+        /* and wake the master, if it had nothing else to do */
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&dispatch.header->master_waiting, __ATOMIC_RELAXED) &&
+            __atomic_exchange_n(&dispatch.header->master_waiting, 0, __ATOMIC_RELAXED))
+            dispatch_ring();
     }
+
+    return 0;
 }
 
-/* Master's kill switch
+/* SIGUSR2: upgrade to a new binary, without dropping a connection.
  *
- * It's important to ensure that all children have exited before the master
- * exits so no root zombies are created. The default handler for SIGINT sends
- * SIGINT to all children, but this is not true with SIGTERM.
+ * This is the trick nginx uses. We fork and exec ourselves (by now, presumably,
+ * a new version of ourselves), with the same arguments. The listening sockets
+ * are passed along by simply leaving them open across exec(), with their
+ * numbers listed in the FORKING_DAEMON_FDS environment variable. The new
+ * master adopts them instead of binding new ones, so the listen queues, and
+ * any connections waiting in them, carry over.
+ *
+ * Once the new master's pool is up (see pool_ready()), it sends us SIGTERM,
+ * and we go the way of any terminated master: our children finish up and
+ * exit, and the new master's children are left to accept() on the same
+ * sockets. If the new master dies before getting that far, we carry on as if
+ * nothing happened.
  */
-void terminate_children()
+void upgrade()
 {
-    int     i, status;
-    pid_t   pid;
+    int     i;
+    char    fds[0x1000] = "", pid[16];
+    size_t  len = 0;
 
-    printf("Termination signal received! Killing children");
+    if (upgrade_pid) {
+        log_msg(LOG_INFO, "Master: upgrade already in progress [pid %d]", upgrade_pid);
+        return;
+    }
 
-    /* Reset all signals! If the SIGCHLD handler in particular is not reset,
-     * all terminated children will be restarted
-     */
-    trap_signals(false);
+    /* shared socket first, then each slot's own socket, in slot order */
+    if (listenfd >= 0)
+        len += snprintf(fds + len, sizeof(fds) - len, "%d,", listenfd);
+    for (i = 0; options.reuseport && i < slots.size && len < sizeof(fds); ++i)
+        if (slots.lfd[i] >= 0)
+            len += snprintf(fds + len, sizeof(fds) - len, "%d,", slots.lfd[i]);
 
-    for (i = 0; i < options.jobs; ++i)
-        kill(children[i], SIGTERM);
+    if (len >= sizeof(fds)) {
+        log_msg(LOG_ERROR, "Master: too many listening sockets to upgrade");
+        return;
+    }
 
-    /* reap all children as they die, until none are left;
-     * at that point wait() returns -1 */
-    while ((pid = wait(&status)) != -1)
-        printf(".");
+    snprintf(pid, sizeof(pid), "%d", getpid());
+    fflush(stdout);
 
-    printf("\nAll children reaped, shutting down.\n");
-    exit(0);
+    if ((upgrade_pid = fork()) < 0) {
+        log_error("fork()");
+        upgrade_pid = 0;
+        return;
+    }
+
+    if (upgrade_pid == 0) {
+        /* the new master must not inherit our blocked signals, either */
+        trap_signals(false);
+
+        /* our ring is the master's, who is still writing to it */
+        my_log = NULL;
+
+        if (listenfd >= 0)
+            fcntl(listenfd, F_SETFD, 0);
+        for (i = 0; options.reuseport && i < slots.size; ++i)
+            if (slots.lfd[i] >= 0)
+                fcntl(slots.lfd[i], F_SETFD, 0);
+
+        setenv("FORKING_DAEMON_FDS", fds, 1);
+        setenv("FORKING_DAEMON_PARENT", pid, 1);
+
+        /* and where the config file is, in case we are in / by now */
+        if (options.config[0])
+            setenv("FORKING_DAEMON_CONFIG", options.config, 1);
+
+        /* and the /metrics socket, which is no use to the children */
+        if (metrics_fd >= 0) {
+            fcntl(metrics_fd, F_SETFD, 0);
+            snprintf(fds, sizeof(fds), "%d", metrics_fd);
+            setenv("FORKING_DAEMON_METRICS_FD", fds, 1);
+        }
+        if (cluster_fd >= 0) {
+            fcntl(cluster_fd, F_SETFD, 0);
+            snprintf(fds, sizeof(fds), "%d", cluster_fd);
+            setenv("FORKING_DAEMON_CLUSTER_FD", fds, 1);
+        }
+
+        execvp(exec_path, exec_argv);
+        log_error(exec_path);
+        _exit(127);
+    }
+
+    log_msg(LOG_INFO, "Master: upgrading, new master [pid %d]", upgrade_pid);
+
+    if (!ev_watch_pid(upgrade_pid, EVENT_UPGRADE, 0, &upgrade_pidfd))
+        upgrade_reap();
+}
+
+/* The new master of an upgrade has exited, before taking over from us */
+void upgrade_reap()
+{
+    int status;
+
+    if (!upgrade_pid || waitpid(upgrade_pid, &status, WNOHANG) <= 0)
+        return;
+
+    log_msg(LOG_ERROR, "Master: upgrade failed, new master [pid %d] exited with status %d",
+            upgrade_pid, WIFEXITED(status) ? WEXITSTATUS(status) : -WTERMSIG(status));
+
+    if (upgrade_pidfd >= 0)
+        close(upgrade_pidfd);
+    upgrade_pidfd = -1;
+    upgrade_pid   = 0;
+}
+
+/* Adopt the listening sockets of an old master, if we are taking over from
+ * one (see upgrade()).
+ */
+bool inherit_listeners()
+{
+    char *  list = getenv("FORKING_DAEMON_FDS"), *end;
+    int     fd, n = 0, on = 0;
+    socklen_t len = sizeof(on);
+
+    if (!list)
+        return true;
+
+    for (; *list; list = *end ? end + 1 : end) {
+        fd = strtol(list, &end, 10);
+        if (end == list)
+            break;
+
+        /* make sure we are handed a listening socket, and not just any fd */
+        on = 0;
+        if (getsockopt(fd, SOL_SOCKET, SO_ACCEPTCONN, &on, &len) < 0 || !on) {
+            log_msg(LOG_ERROR, "Master: inherited fd %d is not a listening socket", fd);
+            continue;
+        }
+        fcntl(fd, F_SETFD, FD_CLOEXEC);
+
+        if (!options.reuseport) {
+            if (listenfd < 0)
+                listenfd = fd;
+            else
+                close(fd);
+            continue;
+        }
+
+        /* each slot gets its socket back; extras are left to die, taking
+         * their queued connections with them */
+        if (n >= options.jobs) {
+            close(fd);
+            continue;
+        }
+        if (n >= slots.size && !slots_resize(n + 1))
+            return false;
+        slots.lfd[n++] = fd;
+    }
+
+    unsetenv("FORKING_DAEMON_FDS");
+    return true;
 }